@@ -0,0 +1,20 @@
+#include <stdio.h>
+#include <time.h>
+
+/**
+ * Calls fn with each value from 0 to iterations - 1 and prints the average
+ * time per call.
+ */
+template<typename F>
+static void benchmark(const char *name, long iterations, F fn)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long i=0 ; i<iterations ; i++)
+	{
+		fn(i);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	printf("%-48s %10.2f ns\n", name, ns / iterations);
+}
@@ -0,0 +1,56 @@
+#include "benchmark.h"
+
+struct A { virtual ~A() {} int a; };
+struct B { virtual ~B() {} int b; };
+struct C : public A, public B { int c; };
+struct D : public C { int d; };
+struct E { virtual ~E() {} int e; };
+struct F : public D, public E { int f; };
+struct V : public virtual A { int v; };
+
+static const long iterations = 10000000;
+
+/**
+ * Prevents the compiler from seeing where a pointer came from.
+ */
+template<typename T>
+static T *launder(T *p)
+{
+	__asm__ volatile("" : "+r"(p));
+	return p;
+}
+
+int main()
+{
+	C c;
+	D d;
+	F f;
+	B b;
+	V v;
+	long found = 0;
+	benchmark("downcast to most-derived type", iterations, [&](long)
+		{
+			found += (0 != dynamic_cast<C*>(launder<B>(&c)));
+		});
+	benchmark("downcast to intermediate type", iterations, [&](long)
+		{
+			found += (0 != dynamic_cast<C*>(launder<B>(&d)));
+		});
+	benchmark("downcast to intermediate type, deep", iterations, [&](long)
+		{
+			found += (0 != dynamic_cast<C*>(launder<B>(&f)));
+		});
+	benchmark("failed downcast", iterations, [&](long)
+		{
+			found += (0 != dynamic_cast<C*>(launder<B>(&b)));
+		});
+	benchmark("cross cast", iterations, [&](long)
+		{
+			found += (0 != dynamic_cast<E*>(launder<B>(&f)));
+		});
+	benchmark("downcast from virtual base", iterations, [&](long)
+		{
+			found += (0 != dynamic_cast<V*>(launder<A>(&v)));
+		});
+	return found == 0;
+}
@@ -0,0 +1,79 @@
+#include "benchmark.h"
+
+static const long iterations = 100000;
+
+static volatile int sink;
+
+/**
+ * Called from every call site.  Throws if throwing is set.
+ */
+static void (*volatile callback)();
+
+static void thrower()
+{
+	throw 0;
+}
+
+static void nothing() {}
+
+/**
+ * Object whose destructor differs for each call site, so that the compiler
+ * can not merge their landing pads, and so their call-site table entries.
+ */
+struct cleanup
+{
+	int n;
+	~cleanup() { sink += n; }
+};
+
+#define SITE(n) case n: { cleanup c{n}; callback(); break; }
+#define SITES10(n) SITE(n##0) SITE(n##1) SITE(n##2) SITE(n##3) SITE(n##4) \
+	SITE(n##5) SITE(n##6) SITE(n##7) SITE(n##8) SITE(n##9)
+#define SITES100(n) SITES10(n##0) SITES10(n##1) SITES10(n##2) \
+	SITES10(n##3) SITES10(n##4) SITES10(n##5) SITES10(n##6) SITES10(n##7) \
+	SITES10(n##8) SITES10(n##9)
+#define SITES1000(n) SITES100(n##0) SITES100(n##1) SITES100(n##2) \
+	SITES100(n##3) SITES100(n##4) SITES100(n##5) SITES100(n##6) \
+	SITES100(n##7) SITES100(n##8) SITES100(n##9)
+
+/**
+ * A function with 3000 call sites, numbered from 1000 to 3999.  Calls the
+ * callback from the one selected by site.
+ */
+static __attribute__((noinline)) void many_call_sites(int site)
+{
+	switch (site)
+	{
+		SITES1000(1) SITES1000(2) SITES1000(3)
+	}
+}
+
+/**
+ * A function with one call site.
+ */
+static __attribute__((noinline)) void one_call_site()
+{
+	cleanup c{0};
+	callback();
+}
+
+int main()
+{
+	long caught = 0;
+	callback = thrower;
+	benchmark("throw from a function with one call site", iterations, [&](long)
+		{
+			try { one_call_site(); } catch (int) { caught++; }
+		});
+	benchmark("throw from 3000 call sites, first case", iterations, [&](long)
+		{
+			try { many_call_sites(1000); } catch (int) { caught++; }
+		});
+	benchmark("throw from 3000 call sites, last case", iterations, [&](long)
+		{
+			try { many_call_sites(3999); } catch (int) { caught++; }
+		});
+	callback = nothing;
+	many_call_sites(1000);
+	return caught != 3 * iterations;
+}
@@ -0,0 +1,93 @@
+#include <new>
+#include <pthread.h>
+#include <stdlib.h>
+#include "benchmark.h"
+
+static const long iterations = 10000000;
+
+/**
+ * The number of objects kept live at once by the batch benchmarks.
+ */
+static const int batch = 1000;
+
+static void *objects[batch];
+
+/**
+ * Prevents the compiler from seeing where a pointer came from or went.
+ */
+static void *launder(void *p)
+{
+	__asm__ volatile("" : "+r"(p) : : "memory");
+	return p;
+}
+
+/**
+ * Allocates and frees a batch of objects with operator new / delete.
+ */
+static void new_delete_batch(long i)
+{
+	for (int j=0 ; j<batch ; j++)
+	{
+		objects[j] = launder(::operator new(16 + ((i + j) % 32) * 16));
+	}
+	for (int j=0 ; j<batch ; j++)
+	{
+		::operator delete(objects[j]);
+	}
+}
+
+/**
+ * Allocates and frees a batch of objects with malloc / free.
+ */
+static void malloc_free_batch(long i)
+{
+	for (int j=0 ; j<batch ; j++)
+	{
+		objects[j] = launder(malloc(16 + ((i + j) % 32) * 16));
+	}
+	for (int j=0 ; j<batch ; j++)
+	{
+		free(objects[j]);
+	}
+}
+
+/**
+ * Allocates a batch with operator new in this thread and frees it in another.
+ */
+static void *free_in_thread(void *arg)
+{
+	void **batch_objects = static_cast<void**>(arg);
+	for (int j=0 ; j<batch ; j++)
+	{
+		::operator delete(batch_objects[j]);
+	}
+	return nullptr;
+}
+
+int main()
+{
+	benchmark("operator new / delete, 64 bytes", iterations, [](long)
+		{
+			::operator delete(launder(::operator new(64)));
+		});
+	benchmark("malloc / free, 64 bytes", iterations, [](long)
+		{
+			free(launder(malloc(64)));
+		});
+	benchmark("operator new / delete, 1000 live, mixed sizes", iterations / batch,
+		new_delete_batch);
+	benchmark("malloc / free, 1000 live, mixed sizes", iterations / batch,
+		malloc_free_batch);
+	benchmark("operator new, delete in another thread, 1000", iterations / batch / 10,
+		[](long i)
+		{
+			for (int j=0 ; j<batch ; j++)
+			{
+				objects[j] = launder(::operator new(16 + ((i + j) % 32) * 16));
+			}
+			pthread_t thread;
+			pthread_create(&thread, nullptr, free_in_thread, objects);
+			pthread_join(thread, nullptr);
+		});
+	return 0;
+}
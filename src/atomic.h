@@ -1,3 +1,4 @@
+#pragma once
 
 #ifndef __has_builtin
 #	define __has_builtin(x) 0
@@ -58,6 +59,12 @@ namespace
 		 */
 		constexpr atomic(T init) : val(init) {}
 
+		/**
+		 * Default constructor.  Objects with static storage duration are
+		 * zero initialised.
+		 */
+		atomic() = default;
+
 		/**
 		 * Atomically load with the specified memory order.
 		 */
@@ -82,6 +89,32 @@ namespace
 			return ATOMIC_BUILTIN(exchange)(&val, v, order);
 		}
 
+		/**
+		 * Atomically and with the specified memory order, returning the old
+		 * value.
+		 */
+		T fetch_and(T v, memory_order order = memory_order::seqcst)
+		{
+#if __has_builtin(__c11_atomic_fetch_and)
+			return __c11_atomic_fetch_and(&val, v, order);
+#else
+			return __atomic_fetch_and(&val, v, order);
+#endif
+		}
+
+		/**
+		 * Atomically add with the specified memory order, returning the old
+		 * value.
+		 */
+		T fetch_add(T v, memory_order order = memory_order::seqcst)
+		{
+#if __has_builtin(__c11_atomic_fetch_add)
+			return __c11_atomic_fetch_add(&val, v, order);
+#else
+			return __atomic_fetch_add(&val, v, order);
+#endif
+		}
+
 		/**
 		 * Atomically exchange with the specified memory order.
 		 */
@@ -262,5 +262,231 @@ char* __cxa_demangle(const char* mangled_name,
 
 namespace abi = __cxxabiv1;
 
+/**
+ * libcxxrt-specific extensions.  These are not part of the Itanium C++ ABI and
+ * are not provided by other implementations.
+ */
+namespace pathscale
+{
+	/**
+	 * Configures the emergency reserve used to allocate exceptions when
+	 * malloc() fails.  The reserve is size bytes, divided into slots granules;
+	 * an exception occupies a power-of-two number of granules, up to 64.  No
+	 * thread may hold more than per_thread_limit emergency allocations at
+	 * once.  A size of 0 disables the reserve.
+	 *
+	 * The reserve is created when the first exception is allocated, so this
+	 * must be called before then.  It overrides the LIBCXXRT_EMERGENCY_RESERVE
+	 * environment variable.  Returns false if the reserve already exists, if
+	 * libcxxrt was built without emergency buffers, or if the arguments would
+	 * give a reserve that can not be used: no slots, slots too small to hold
+	 * an aligned allocation, or a per_thread_limit that is not positive.
+	 * When size is 0, slots is ignored and per_thread_limit may be 0.
+	 */
+	bool set_emergency_reserve(size_t size,
+	                           size_t slots,
+	                           int per_thread_limit) _LIBCXXRT_NOEXCEPT;
+
+	/**
+	 * Reports how many dynamic_cast<> operations were, and were not, answered
+	 * by the dynamic cast cache.  The counts are approximate: concurrent
+	 * updates from different threads may occasionally be lost.  Both are
+	 * always zero unless libcxxrt was built with LIBCXXRT_DYNAMIC_CAST_CACHE.
+	 */
+	void dynamic_cast_cache_stats(unsigned long long *hits,
+	                              unsigned long long *misses) _LIBCXXRT_NOEXCEPT;
+
+	/**
+	 * Contention recorded for a single static initialisation guard.
+	 */
+	struct guard_contention_info
+	{
+		/**
+		 * The address of the guard variable.
+		 */
+		const void *guard;
+		/**
+		 * The number of calls to __cxa_guard_acquire() that found the guarded
+		 * variable uninitialised.
+		 */
+		unsigned long acquisitions;
+		/**
+		 * The number of those calls that found another thread initialising
+		 * the variable and had to wait for it.
+		 */
+		unsigned long contended;
+		/**
+		 * The total number of pause instructions executed by waiting threads
+		 * before the guard was released or they went to sleep.
+		 */
+		unsigned long long spins;
+		/**
+		 * The total time, in nanoseconds, that waiting threads spent waiting.
+		 */
+		unsigned long long wait_nanoseconds;
+		/**
+		 * The operating system's identifier for the thread that last acquired
+		 * the guard to run the initialiser.
+		 */
+		unsigned long initialiser_thread;
+	};
+
+	/**
+	 * Copies the contention recorded for up to count guards into info and
+	 * returns the total number of guards recorded, which may be larger than
+	 * count.  Guards are recorded the first time that a call to
+	 * __cxa_guard_acquire() misses the fast path.  Always returns zero unless
+	 * libcxxrt was built with LIBCXXRT_GUARD_PROFILE.
+	 */
+	size_t guard_contention_stats(guard_contention_info *info,
+	                              size_t count) _LIBCXXRT_NOEXCEPT;
+
+	/**
+	 * Writes a heap profile of the allocations sampled so far, in the
+	 * gperftools heap_v2 text format that pprof reads, to the file at path.
+	 * Sampling is enabled by setting the LIBCXXRT_HEAP_PROFILE environment
+	 * variable, which also names the file that a profile is written to at
+	 * exit; LIBCXXRT_HEAP_PROFILE_RATE sets the mean number of bytes
+	 * allocated between samples.  Returns false if sampling is not enabled,
+	 * the file can't be written, or libcxxrt was built without
+	 * LIBCXXRT_HEAP_PROFILE.
+	 */
+	bool heap_profile_dump(const char *path) _LIBCXXRT_NOEXCEPT;
+
+	/**
+	 * Computes the length of the string that __cxa_demangle() would produce
+	 * for mangled_name, not including the terminating NUL, without
+	 * producing it.  Lets tools size a buffer before demangling into it.
+	 * Returns a status with the same meaning as __cxa_demangle()'s.
+	 */
+	int demangled_length(const char *mangled_name,
+	                     size_t *length) _LIBCXXRT_NOEXCEPT;
+
+	/**
+	 * The offset that demangle_batch() reports for a name that could not be
+	 * demangled.
+	 */
+	static const size_t demangle_failed = static_cast<size_t>(-1);
+
+	/**
+	 * Demangles count names, packing the results into one buffer.  *buffer
+	 * is null or was allocated with malloc() and is *size bytes long; it is
+	 * grown with realloc() as needed, and the caller frees it.  Each result
+	 * is followed by a NUL, and offsets[i] is set to the offset in *buffer of
+	 * the result for mangled_names[i], or to demangle_failed if it is not a
+	 * valid mangled name.
+	 *
+	 * The names are demangled by up to threads threads, including the
+	 * calling thread, or by one per online processor if threads is 0.
+	 * Results are in the same order whatever the number of threads.
+	 *
+	 * Returns 0 at success, -1 if memory could not be allocated, in which
+	 * case the offsets are not valid, or -3 if an argument is invalid.
+	 */
+	int demangle_batch(const char *const *mangled_names,
+	                   size_t count,
+	                   char **buffer,
+	                   size_t *size,
+	                   size_t *offsets,
+	                   unsigned threads) _LIBCXXRT_NOEXCEPT;
+
+	/**
+	 * The parts of a demangled symbol that demangle_structured() reports.
+	 */
+	enum demangle_token_kind : int
+	{
+		/**
+		 * The description of a special name, such as "vtable for ", and
+		 * any offsets that it carries.
+		 */
+		demangle_special,
+		/**
+		 * The return type of a function template specialisation.
+		 */
+		demangle_return_type,
+		/**
+		 * A namespace or class enclosing the name, including its template
+		 * arguments.  A scope that the mangled name refers back to may span
+		 * several levels, such as "std::vector<int>".
+		 */
+		demangle_scope,
+		/**
+		 * The unqualified name.  Local names, and names that are not split,
+		 * are a single name token.
+		 */
+		demangle_name,
+		/**
+		 * The template arguments of the name, including the angle brackets.
+		 */
+		demangle_template_args,
+		/**
+		 * The type of one function parameter.
+		 */
+		demangle_parameter,
+		/**
+		 * The cv and ref qualifiers of a member function, such as "const &".
+		 */
+		demangle_qualifiers
+	};
+
+	/**
+	 * A part of a demangled symbol.
+	 */
+	struct demangle_token
+	{
+		/**
+		 * What this part is.
+		 */
+		demangle_token_kind kind;
+		/**
+		 * The offset of this part in the demangled string.
+		 */
+		size_t offset;
+		/**
+		 * The length of this part.
+		 */
+		size_t length;
+	};
+
+	/**
+	 * A demangled symbol and the parts that it was built from.
+	 */
+	struct demangled_symbol
+	{
+		/**
+		 * The NUL-terminated demangled string, as __cxa_demangle() would
+		 * return it.
+		 */
+		const char *text;
+		/**
+		 * The length of text.
+		 */
+		size_t length;
+		/**
+		 * The number of tokens.
+		 */
+		size_t token_count;
+		/**
+		 * The parts of text, in order.  They do not overlap, but the
+		 * separators between them, such as "::" and ", ", are not covered.
+		 */
+		const demangle_token *tokens;
+	};
+
+	/**
+	 * Demangles mangled_name, recording its parts as it is parsed, so that
+	 * tools can find the name, scopes, template arguments and parameter
+	 * types without parsing the demangled string again.  Only the top-level
+	 * name of a function or variable is split; types inside it are not, and
+	 * names that are types have no tokens.
+	 *
+	 * The result is a single allocation, to be freed with free().  Returns
+	 * null on failure, setting *status, if status is not null, as
+	 * __cxa_demangle() would.
+	 */
+	demangled_symbol *demangle_structured(const char *mangled_name,
+	                                      int *status) _LIBCXXRT_NOEXCEPT;
+}
+
 #endif /* __cplusplus */
 #endif /* __CXXABI_H_ */
@@ -0,0 +1,263 @@
+/**
+ * demangle_batch.cc - Demangling many symbols at once.
+ *
+ * The names are split into chunks of consecutive names, which worker threads
+ * claim in order from a shared counter.  Each chunk is demangled into its own
+ * buffer, with offsets relative to the start of that buffer, so workers never
+ * touch the same memory.  Once every chunk is done, the chunks are copied into
+ * the caller's buffer in order and their offsets rebased.
+ *
+ * With a single thread, there is only one chunk and it is demangled straight
+ * into the caller's buffer.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "atomic.h"
+#include "cxxabi.h"
+#include "libelftc_dem_gnu3.h"
+
+#pragma weak pthread_create
+#pragma weak pthread_join
+
+namespace
+{
+	/**
+	 * The number of names in each chunk.  Large enough that claiming a chunk
+	 * is rare, small enough that the threads finish at about the same time.
+	 */
+	constexpr size_t chunk_names = 256;
+
+	/**
+	 * The most threads that are started for one batch.
+	 */
+	constexpr unsigned max_threads = 64;
+
+	/**
+	 * A run of consecutive names and the buffer that they are demangled into.
+	 */
+	struct chunk
+	{
+		/**
+		 * The demangled names, each followed by a NUL.  Allocated with
+		 * malloc().
+		 */
+		char *buffer;
+		/**
+		 * The allocated size of buffer.
+		 */
+		size_t size;
+		/**
+		 * The number of bytes of buffer that are in use.
+		 */
+		size_t used;
+		/**
+		 * Set if memory ran out while demangling this chunk.
+		 */
+		bool failed;
+	};
+
+	/**
+	 * The state shared by the threads demangling one batch.
+	 */
+	struct batch
+	{
+		/**
+		 * The names to demangle.
+		 */
+		const char *const *names;
+		/**
+		 * The number of names.
+		 */
+		size_t count;
+		/**
+		 * The offset of each result, relative to the start of its chunk until
+		 * all of the chunks are done.
+		 */
+		size_t *offsets;
+		/**
+		 * The chunks, in order.
+		 */
+		chunk *chunks;
+		/**
+		 * The number of chunks.
+		 */
+		size_t chunk_count;
+		/**
+		 * The index of the next chunk to be claimed.
+		 */
+		atomic<size_t> next_chunk;
+	};
+
+	/**
+	 * Demangles names [begin, end) of a batch, appending them to a chunk.
+	 */
+	void demangle_range(batch *b, chunk *c, size_t begin, size_t end)
+	{
+		for (size_t i=begin ; i<end ; i++)
+		{
+			size_t offset = c->used;
+			int status = __cxa_demangle_gnu3_append(b->names[i], &c->buffer,
+			                                        &c->size, &c->used);
+			if (-1 == status)
+			{
+				c->failed = true;
+				return;
+			}
+			b->offsets[i] = (0 == status) ? offset : pathscale::demangle_failed;
+		}
+	}
+
+	/**
+	 * Claims chunks and demangles them until there are none left.  Run by
+	 * each worker thread and by the calling thread.
+	 */
+	void *demangle_chunks(void *arg)
+	{
+		batch *b = static_cast<batch*>(arg);
+		for (;;)
+		{
+			size_t index = b->next_chunk.fetch_add(1);
+			if (index >= b->chunk_count)
+			{
+				return nullptr;
+			}
+			size_t begin = index * chunk_names;
+			size_t end = begin + chunk_names;
+			demangle_range(b, &b->chunks[index], begin,
+			               (end < b->count) ? end : b->count);
+		}
+	}
+
+	/**
+	 * Returns the number of threads to use when the caller asked for
+	 * threads, where 0 means one per online processor.
+	 */
+	unsigned thread_count(unsigned threads, size_t chunk_count)
+	{
+		if (0 == threads)
+		{
+			long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+			threads = (cpus > 0) ? static_cast<unsigned>(cpus) : 1;
+		}
+		if (threads > max_threads)
+		{
+			threads = max_threads;
+		}
+		if (threads > chunk_count)
+		{
+			threads = static_cast<unsigned>(chunk_count);
+		}
+		// Without libpthread, we can only use the calling thread.
+		if ((nullptr == pthread_create) || (nullptr == pthread_join))
+		{
+			threads = 1;
+		}
+		return threads;
+	}
+}
+
+namespace pathscale
+{
+	int demangle_batch(const char *const *mangled_names,
+	                   size_t count,
+	                   char **buffer,
+	                   size_t *size,
+	                   size_t *offsets,
+	                   unsigned threads) _LIBCXXRT_NOEXCEPT
+	{
+		if ((nullptr == buffer) || (nullptr == size) ||
+		    ((count > 0) && ((nullptr == mangled_names) || (nullptr == offsets))))
+		{
+			return -3;
+		}
+		if (nullptr == *buffer)
+		{
+			*size = 0;
+		}
+		size_t chunk_count = (count + chunk_names - 1) / chunk_names;
+		threads = thread_count(threads, chunk_count);
+		if (threads <= 1)
+		{
+			chunk c = { *buffer, *size, 0, false };
+			batch b = { mangled_names, count, offsets, &c, 1, 0 };
+			demangle_range(&b, &c, 0, count);
+			*buffer = c.buffer;
+			*size = c.size;
+			return c.failed ? -1 : 0;
+		}
+
+		chunk *chunks = static_cast<chunk*>(calloc(chunk_count, sizeof(chunk)));
+		if (nullptr == chunks)
+		{
+			return -1;
+		}
+		batch b = { mangled_names, count, offsets, chunks, chunk_count, 0 };
+		pthread_t workers[max_threads];
+		unsigned started = 0;
+		while (started < threads - 1)
+		{
+			if (0 != pthread_create(&workers[started], nullptr, demangle_chunks, &b))
+			{
+				break;
+			}
+			started++;
+		}
+		demangle_chunks(&b);
+		for (unsigned i=0 ; i<started ; i++)
+		{
+			pthread_join(workers[i], nullptr);
+		}
+
+		int status = 0;
+		size_t total = 0;
+		for (size_t i=0 ; i<chunk_count ; i++)
+		{
+			if (chunks[i].failed)
+			{
+				status = -1;
+			}
+			total += chunks[i].used;
+		}
+		if ((0 == status) && (*size < total))
+		{
+			char *grown = static_cast<char*>(realloc(*buffer, total));
+			if (nullptr == grown)
+			{
+				status = -1;
+			}
+			else
+			{
+				*buffer = grown;
+				*size = total;
+			}
+		}
+		size_t base = 0;
+		for (size_t i=0 ; i<chunk_count ; i++)
+		{
+			if (0 == status)
+			{
+				// If every name failed, there may be no buffer to copy into.
+				if (0 != chunks[i].used)
+				{
+					memcpy(*buffer + base, chunks[i].buffer, chunks[i].used);
+				}
+				size_t begin = i * chunk_names;
+				size_t end = (begin + chunk_names < count) ? begin + chunk_names : count;
+				for (size_t j=begin ; j<end ; j++)
+				{
+					if (offsets[j] != demangle_failed)
+					{
+						offsets[j] += base;
+					}
+				}
+				base += chunks[i].used;
+			}
+			free(chunks[i].buffer);
+		}
+		free(chunks);
+		return status;
+	}
+}
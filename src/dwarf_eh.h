@@ -31,6 +31,7 @@
  * language-specific code.  It can be used in any personality function for the
  * Itanium ABI.
  */
+#pragma once
 #include <assert.h>
 
 // TODO: Factor out Itanium / ARM differences.  We probably want an itanium.h
@@ -48,6 +49,7 @@
 #endif
 
 #include <stdint.h>
+#include <string.h>
 
 /// Type used for pointers into DWARF data
 typedef unsigned char *dw_eh_ptr_t;
@@ -293,11 +295,14 @@ static inline void read_value_with_encoding(_Unwind_Context *context,
                                             dw_eh_ptr_t *data,
                                             uint64_t *out)
 {
-	dw_eh_ptr_t start = *data;
 	unsigned char encoding = *((*data)++);
 	// If this value is omitted, skip it and don't touch the output value
 	if (encoding == DW_EH_PE_omit) { return; }
 
+	// A pc-relative value is relative to its own address, not to that of the
+	// encoding before it.
+	dw_eh_ptr_t start = *data;
+
 	*out = read_value(encoding, data);
 	*out = resolve_indirect_value(context, encoding, *out, start);
 }
@@ -396,6 +401,102 @@ struct dwarf_eh_action
 	dw_eh_ptr_t action_record;
 };
 
+/**
+ * Fills in result from the landing pad and action fields of a call-site table
+ * entry.
+ */
+static inline void dwarf_eh_set_action(struct dwarf_eh_lsda *lsda,
+                                       uint64_t landing_pad,
+                                       uint64_t action,
+                                       struct dwarf_eh_action *result)
+{
+	if (action)
+	{
+		// Action records are 1-biased so both no-record and zeroth
+		// record can be stored.
+		result->action_record = lsda->action_table + action - 1;
+	}
+	// No landing pad means keep unwinding.
+	if (landing_pad)
+	{
+		// Landing pad is the offset from the value in the header
+		result->landing_pad = lsda->landing_pads + landing_pad;
+	}
+}
+
+/**
+ * Looks up the landing pad for ip, the offset of the current instruction
+ * pointer from the start of the region, in a call-site table whose start,
+ * length and landing pad fields are all stored as T.
+ *
+ * The trailing action field is always ULEB128 encoded, so entries are not a
+ * fixed size and the table can not be indexed directly.  This walk avoids
+ * going through read_value() for every field, and skips the landing pad and
+ * action of entries that do not cover ip without decoding them.
+ */
+template<typename T>
+static inline bool dwarf_eh_find_fixed_callsite(uint64_t ip,
+                                                struct dwarf_eh_lsda *lsda,
+                                                struct dwarf_eh_action *result)
+{
+	dw_eh_ptr_t callsite_table = lsda->call_site_table;
+	while (callsite_table < lsda->action_table)
+	{
+		T field;
+		memcpy(&field, callsite_table, sizeof field);
+		uint64_t call_site_start = static_cast<uint64_t>(field);
+		// See dwarf_eh_find_callsite() for why these tests are strict on
+		// one side only.
+		if (call_site_start > ip) { break; }
+		memcpy(&field, callsite_table + sizeof field, sizeof field);
+		uint64_t call_site_size = static_cast<uint64_t>(field);
+		callsite_table += 2 * sizeof field;
+		if (call_site_start < ip && ip <= call_site_start + call_site_size)
+		{
+			memcpy(&field, callsite_table, sizeof field);
+			callsite_table += sizeof field;
+			uint64_t landing_pad = static_cast<uint64_t>(field);
+			uint64_t action = read_uleb128(&callsite_table);
+			dwarf_eh_set_action(lsda, landing_pad, action, result);
+			return true;
+		}
+		// Skip the landing pad and the action.
+		callsite_table += sizeof field;
+		while (*(callsite_table++) & 0x80) {}
+	}
+	return false;
+}
+
+/**
+ * Looks up the landing pad for ip in a call-site table whose fields are all
+ * ULEB128 encoded, as GCC emits them.  As with dwarf_eh_find_fixed_callsite(),
+ * the landing pad and action of entries that do not cover ip are skipped
+ * without being decoded.
+ */
+static inline bool dwarf_eh_find_uleb128_callsite(uint64_t ip,
+                                                  struct dwarf_eh_lsda *lsda,
+                                                  struct dwarf_eh_action *result)
+{
+	dw_eh_ptr_t callsite_table = lsda->call_site_table;
+	while (callsite_table < lsda->action_table)
+	{
+		uint64_t call_site_start = read_uleb128(&callsite_table);
+		if (call_site_start > ip) { break; }
+		uint64_t call_site_size = read_uleb128(&callsite_table);
+		if (call_site_start < ip && ip <= call_site_start + call_site_size)
+		{
+			uint64_t landing_pad = read_uleb128(&callsite_table);
+			uint64_t action = read_uleb128(&callsite_table);
+			dwarf_eh_set_action(lsda, landing_pad, action, result);
+			return true;
+		}
+		// Skip the landing pad and the action.
+		while (*(callsite_table++) & 0x80) {}
+		while (*(callsite_table++) & 0x80) {}
+	}
+	return false;
+}
+
 /**
  * Look up the landing pad that corresponds to the current invoke.
  * Returns true if record exists.  The context is provided by the generic
@@ -403,14 +504,31 @@ struct dwarf_eh_action
  *
  * The action record is returned via the result parameter.  
  */
-static bool dwarf_eh_find_callsite(struct _Unwind_Context *context,
-                                   struct dwarf_eh_lsda *lsda,
-                                   struct dwarf_eh_action *result)
+static inline bool dwarf_eh_find_callsite(struct _Unwind_Context *context,
+                                          struct dwarf_eh_lsda *lsda,
+                                          struct dwarf_eh_action *result)
 {
 	result->action_record = 0;
 	result->landing_pad = 0;
 	// The current instruction pointer offset within the region
 	uint64_t ip = _Unwind_GetIP(context) - _Unwind_GetRegionStart(context);
+
+	switch (get_encoding(lsda->callsite_encoding))
+	{
+		case DW_EH_PE_uleb128:
+			return dwarf_eh_find_uleb128_callsite(ip, lsda, result);
+		case DW_EH_PE_udata4:
+			return dwarf_eh_find_fixed_callsite<uint32_t>(ip, lsda, result);
+		case DW_EH_PE_sdata4:
+			return dwarf_eh_find_fixed_callsite<int32_t>(ip, lsda, result);
+		case DW_EH_PE_udata8:
+			return dwarf_eh_find_fixed_callsite<uint64_t>(ip, lsda, result);
+		case DW_EH_PE_sdata8:
+			return dwarf_eh_find_fixed_callsite<int64_t>(ip, lsda, result);
+		default:
+			break;
+	}
+
 	unsigned char *callsite_table = static_cast<unsigned char*>(lsda->call_site_table);
 
 	while (callsite_table <= lsda->action_table)
@@ -441,18 +559,7 @@ static bool dwarf_eh_find_callsite(struct _Unwind_Context *context,
 		// at the end of another EH region.
 		if (call_site_start < ip && ip <= call_site_start + call_site_size)
 		{
-			if (action)
-			{
-				// Action records are 1-biased so both no-record and zeroth
-				// record can be stored.
-				result->action_record = lsda->action_table + action - 1;
-			}
-			// No landing pad means keep unwinding.
-			if (landing_pad)
-			{
-				// Landing pad is the offset from the value in the header
-				result->landing_pad = lsda->landing_pads + landing_pad;
-			}
+			dwarf_eh_set_action(lsda, landing_pad, action, result);
 			return true;
 		}
 	}
@@ -25,7 +25,11 @@
  */
 
 #include "typeinfo.h"
+#include "cxxabi.h"
 #include <stdio.h>
+#ifdef LIBCXXRT_DYNAMIC_CAST_CACHE
+#include "lookup_cache.h"
+#endif
 
 using namespace ABI_NAMESPACE;
 
@@ -184,6 +188,149 @@ bool __vmi_class_type_info::__do_upcast(const __class_type_info *target,
 }
 
 
+#ifdef LIBCXXRT_DYNAMIC_CAST_CACHE
+#ifndef LIBCXXRT_DYNAMIC_CAST_CACHE_SIZE
+/**
+ * The number of entries in the dynamic cast cache.  Must be a power of two.
+ */
+#define LIBCXXRT_DYNAMIC_CAST_CACHE_SIZE 1024
+#endif
+/**
+ * Results stored in the dynamic cast cache.
+ */
+enum cast_result
+{
+	/**
+	 * The cast fails.
+	 */
+	cast_fails = 1,
+	/**
+	 * The cast succeeds, and the result is at the cached offset from the
+	 * source pointer.
+	 */
+	cast_offset,
+	/**
+	 * The cast succeeds, but the result depends on virtual base offsets
+	 * and so must be found by cast_to().
+	 */
+	cast_dynamic
+};
+/**
+ * Cache of dynamic cast results.  The key is the vtable of the source
+ * subobject, the most-derived type and the destination type.  The vtable
+ * determines the most-derived type and which subobject the source is, so the
+ * result is always the same for the same key.  The most-derived type is
+ * included to make it very unlikely that a key is reused if a shared object
+ * is unloaded and another loaded in its place.
+ */
+static lookup_cache<3, 2, LIBCXXRT_DYNAMIC_CAST_CACHE_SIZE> cast_cache;
+
+/**
+ * Hit and miss counters for the dynamic cast cache.  These are sharded, so
+ * that threads do not contend for a single cache line, and updated with a
+ * load and a store rather than an atomic increment, so that counting costs
+ * (almost) nothing.  Concurrent updates to one shard can be lost, so the
+ * counts are approximate.
+ */
+struct alignas(64) cast_cache_counters
+{
+	/** Number of lookups that hit. */
+	atomic<unsigned long long> hits;
+	/** Number of lookups that missed. */
+	atomic<unsigned long long> misses;
+};
+/**
+ * Number of counter shards.
+ */
+static const int cast_cache_shards = 16;
+/**
+ * The counter shards.
+ */
+static cast_cache_counters cast_cache_stats[cast_cache_shards];
+
+/**
+ * Returns the counter shard for the calling thread.  Threads have separate
+ * stacks, so an address on the stack selects a shard cheaply.  Default glibc
+ * thread stacks are a multiple of 8MB apart, so bits 20-22 are the same for
+ * every thread.  Bits from 23 up are mixed in, so that those threads spread
+ * over all of the shards while smaller stacks still do.
+ */
+static inline cast_cache_counters &stats_shard()
+{
+	int marker;
+	uintptr_t stack = reinterpret_cast<uintptr_t>(&marker);
+	return cast_cache_stats[((stack >> 20) ^ (stack >> 23)) % cast_cache_shards];
+}
+
+/**
+ * Increments a counter.
+ */
+static inline void count(atomic<unsigned long long> &counter)
+{
+	counter.store(counter.load(acquire) + 1, release);
+}
+
+/**
+ * Performs the cast, consulting the cache first.
+ */
+static void *cached_cast_to(const void *sub,
+                            const vtable_header *header,
+                            void *leaf,
+                            const __class_type_info *dst)
+{
+	uintptr_t key[3] = { reinterpret_cast<uintptr_t>(*static_cast<void * const *>(sub)),
+	                     reinterpret_cast<uintptr_t>(header->type),
+	                     reinterpret_cast<uintptr_t>(dst) };
+	uintptr_t value[2];
+	bool cached = cast_cache.lookup(key, value);
+	if (cached && (value[0] != cast_dynamic))
+	{
+		count(stats_shard().hits);
+		if (value[0] == cast_fails) { return 0; }
+		return ADD_TO_PTR(const_cast<void *>(sub), static_cast<ptrdiff_t>(value[1]));
+	}
+	count(stats_shard().misses);
+	void *result = header->type->cast_to(leaf, dst);
+	if (cached)
+	{
+		return result;
+	}
+	if (0 == result)
+	{
+		value[0] = cast_fails;
+		value[1] = 0;
+	}
+	else
+	{
+		value[0] = __has_virtual_base(header->type) ? cast_dynamic : cast_offset;
+		value[1] = static_cast<uintptr_t>(static_cast<char*>(result) -
+			static_cast<const char*>(sub));
+	}
+	cast_cache.insert(key, value);
+	return result;
+}
+#endif
+
+namespace pathscale
+{
+	/**
+	 * Reports the dynamic cast cache hit and miss counts.
+	 */
+	void dynamic_cast_cache_stats(unsigned long long *hits,
+	                              unsigned long long *misses) _LIBCXXRT_NOEXCEPT
+	{
+		*hits = 0;
+		*misses = 0;
+#ifdef LIBCXXRT_DYNAMIC_CAST_CACHE
+		for (int i=0 ; i<cast_cache_shards ; i++)
+		{
+			*hits += cast_cache_stats[i].hits.load();
+			*misses += cast_cache_stats[i].misses.load();
+		}
+#endif
+	}
+}
+
 /**
  * ABI function used to implement the dynamic_cast<> operator.  Some cases of
  * this operator are implemented entirely in the compiler (e.g. to void*).
@@ -206,5 +353,33 @@ extern "C" void* __dynamic_cast(const void *sub,
 	const vtable_header *header =
 		reinterpret_cast<const vtable_header*>(vtable_location - sizeof(vtable_header));
 	void *leaf = ADD_TO_PTR(const_cast<void *>(sub), header->leaf_offset);
+	if (header->type == dst)
+	{
+		// A non-negative hint means that src is a unique, public,
+		// non-virtual base of dst at that offset.  If the most-derived object
+		// is a dst, and sub is at that offset in it, then the leaf is the
+		// answer.
+		if ((src2dst_offset >= 0) &&
+		    (ADD_TO_PTR(leaf, src2dst_offset) == sub))
+		{
+			return leaf;
+		}
+		// If src is not a public base of dst, then there is no way of
+		// getting to the most-derived object from sub.
+		if (src2dst_offset == -2)
+		{
+			return 0;
+		}
+	}
+#ifdef LIBCXXRT_DYNAMIC_CAST_CACHE
+	// A class with no bases is a single comparison, which is cheaper than
+	// looking it up.
+	if (typeid(*header->type) != typeid(__class_type_info))
+	{
+		return cached_cast_to(sub, header, leaf, dst);
+	}
+	return header->type->cast_to(leaf, dst);
+#else
 	return header->type->cast_to(leaf, dst);
+#endif
 }
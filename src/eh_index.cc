@@ -0,0 +1,944 @@
+/**
+ * eh_index.cc - Precomputed index of the exception tables of loaded objects.
+ *
+ * Each indexed object records the sorted list of functions that have an LSDA,
+ * taken from the binary search table in its .eh_frame_hdr section, and a
+ * single array of the decoded call-site entries of all of them.
+ *
+ * The set of indexed objects is published as an immutable, sorted snapshot.
+ * Lookups in an up-to-date snapshot never take a lock.  Updates are serialised
+ * by a mutex and publish a new snapshot.  A snapshot that has been replaced may
+ * still be being searched by other threads, so it is retired and freed once no
+ * thread is searching any snapshot.  The index for an object is freed once the
+ * object has been unloaded, because no thread can legitimately be unwinding
+ * through it.
+ *
+ * Some frames can never be indexed: those in objects with no .eh_frame_hdr,
+ * and those in code that is not part of any loaded object, such as code
+ * registered with __register_frame().  The snapshot records these too, so
+ * that looking them up again misses without taking the lock.  An object with
+ * no .eh_frame_hdr is indexed with no functions.  Code outside every object is
+ * recorded as the gap between the neighbouring objects, which is only trusted
+ * while no object has been loaded since the snapshot was made.
+ */
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "eh_index.h"
+
+#if defined(__arm__) && !defined(__ARM_DWARF_EH__)
+
+// ARM EHABI objects have no .eh_frame_hdr, so there is nothing to index.
+eh_index_result eh_index_lookup(struct _Unwind_Context *,
+                                unsigned char *,
+                                unsigned long,
+                                struct dwarf_eh_lsda *,
+                                struct dwarf_eh_action *)
+{
+	return eh_index_miss;
+}
+
+#else
+
+#include <link.h>
+#include "atomic.h"
+
+#ifdef LIBCXXRT_WEAK_LOCKS
+#pragma weak pthread_mutex_lock
+#define pthread_mutex_lock(mtx) do {\
+	if (pthread_mutex_lock) pthread_mutex_lock(mtx);\
+	} while(0)
+#pragma weak pthread_mutex_unlock
+#define pthread_mutex_unlock(mtx) do {\
+	if (pthread_mutex_unlock) pthread_mutex_unlock(mtx);\
+	} while(0)
+#pragma weak pthread_mutex_trylock
+#define pthread_mutex_trylock(mtx) \
+	(pthread_mutex_trylock ? pthread_mutex_trylock(mtx) : 0)
+#endif
+
+namespace
+{
+	/**
+	 * A decoded call-site table entry.
+	 */
+	struct indexed_callsite
+	{
+		/**
+		 * Start of the call site, as an offset from the region start.
+		 */
+		uintptr_t start;
+		/**
+		 * End of the call site, as an offset from the region start.
+		 */
+		uintptr_t end;
+		/**
+		 * The landing pad, or null if there is none.
+		 */
+		dw_eh_ptr_t landing_pad;
+		/**
+		 * The first action record, or null if there is none.
+		 */
+		dw_eh_ptr_t action_record;
+	};
+
+	/**
+	 * A function with an LSDA.
+	 */
+	struct indexed_function
+	{
+		/**
+		 * The start of the function.
+		 */
+		uintptr_t region_start;
+		/**
+		 * The address of the LSDA.
+		 */
+		unsigned char *lsda_addr;
+		/**
+		 * The decoded LSDA header.
+		 */
+		dwarf_eh_lsda lsda;
+		/**
+		 * Index of the first call site of this function in the object's
+		 * call-site array.
+		 */
+		size_t first_callsite;
+		/**
+		 * The number of call sites in this function.
+		 */
+		size_t callsite_count;
+	};
+
+	/**
+	 * The index for one loaded object.
+	 */
+	struct indexed_object
+	{
+		/**
+		 * The load address, used with eh_frame_hdr and name to tell whether
+		 * the object is still loaded.
+		 */
+		uintptr_t load_address;
+		/**
+		 * The address of the .eh_frame_hdr section.
+		 */
+		const unsigned char *eh_frame_hdr;
+		/**
+		 * A copy of the object's name.
+		 */
+		char *name;
+		/**
+		 * Functions with an LSDA, sorted by start address.
+		 */
+		indexed_function *functions;
+		/**
+		 * The number of entries in functions.
+		 */
+		size_t function_count;
+		/**
+		 * The call sites of all functions.
+		 */
+		indexed_callsite *callsites;
+		/**
+		 * The number of entries in callsites.
+		 */
+		size_t callsite_count;
+		/**
+		 * Set while updating the index if the object is still loaded.
+		 */
+		bool loaded;
+	};
+
+	/**
+	 * An entry in a snapshot.  The address range is copied from the object so
+	 * that searching a snapshot never touches the index for an object that
+	 * may since have been unloaded.
+	 */
+	struct snapshot_entry
+	{
+		/**
+		 * Start of the executable segments of the object.
+		 */
+		uintptr_t start;
+		/**
+		 * End of the executable segments of the object.
+		 */
+		uintptr_t end;
+		/**
+		 * The index for the object, or null if this is a gap between
+		 * objects.
+		 */
+		indexed_object *object;
+	};
+
+	/**
+	 * The set of indexed objects.
+	 */
+	struct snapshot
+	{
+		/**
+		 * The value of dlpi_subs + 1 when this snapshot was created.
+		 */
+		unsigned long epoch;
+		/**
+		 * The value of dlpi_adds when this snapshot was created.  Gaps are
+		 * only valid while this is current.
+		 */
+		unsigned long adds;
+		/**
+		 * The next retired snapshot.
+		 */
+		snapshot *next;
+		/**
+		 * The number of objects.
+		 */
+		size_t count;
+		/**
+		 * The objects and gaps, sorted by start address.
+		 */
+		snapshot_entry entries[1];
+	};
+
+	/**
+	 * A growable array, used while building an index.
+	 */
+	template<typename T>
+	struct buffer
+	{
+		T *data;
+		size_t count;
+		size_t capacity;
+		bool failed;
+		/**
+		 * Appends a value.  On allocation failure, sets failed and discards
+		 * the value.
+		 */
+		void push(const T &v)
+		{
+			if (count == capacity)
+			{
+				size_t new_capacity = capacity ? capacity * 2 : 64;
+				T *new_data = static_cast<T*>(realloc(data, new_capacity * sizeof(T)));
+				if (0 == new_data)
+				{
+					failed = true;
+					return;
+				}
+				data = new_data;
+				capacity = new_capacity;
+			}
+			data[count++] = v;
+		}
+	};
+}
+
+/**
+ * The current snapshot.
+ */
+static atomic<snapshot*> current_snapshot{nullptr};
+/**
+ * The number of threads searching a snapshot without holding index_lock.
+ */
+static atomic<long> snapshot_readers{0};
+/**
+ * Snapshots that have been replaced, linked through their next fields.  Only
+ * modified with index_lock held.
+ */
+static atomic<snapshot*> retired_snapshots{nullptr};
+/**
+ * Lock serialising updates to the index.
+ */
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Decodes a pointer from an exception frame table.  Only the absolute,
+ * pc-relative and data-relative (relative to base) forms are supported.
+ * Returns false for anything else.
+ */
+static bool read_pointer(unsigned char encoding,
+                         dw_eh_ptr_t *data,
+                         uintptr_t base,
+                         uintptr_t *out)
+{
+	dw_eh_ptr_t start = *data;
+	if (encoding == DW_EH_PE_omit)
+	{
+		*out = 0;
+		return true;
+	}
+	uintptr_t v = static_cast<uintptr_t>(read_value(encoding, data));
+	switch (get_base(encoding))
+	{
+		case DW_EH_PE_pcrel:
+			v += reinterpret_cast<uintptr_t>(start);
+			break;
+		case DW_EH_PE_datarel:
+			v += base;
+			break;
+		default:
+			// Absolute values have no base bits.
+			if (0 != get_base(encoding)) { return false; }
+			break;
+	}
+	if (is_indirect(encoding))
+	{
+		v = *reinterpret_cast<uintptr_t*>(v);
+	}
+	*out = v;
+	return true;
+}
+
+/**
+ * The encodings found in a CIE that are needed to find the LSDA of an FDE.
+ */
+struct cie_info
+{
+	/**
+	 * Address of the CIE.
+	 */
+	dw_eh_ptr_t cie;
+	/**
+	 * Encoding of the addresses in FDEs.
+	 */
+	unsigned char fde_encoding;
+	/**
+	 * Encoding of the LSDA pointer in FDEs.
+	 */
+	unsigned char lsda_encoding;
+	/**
+	 * Whether the augmentation contains a 'z', and so FDEs have augmentation
+	 * data.
+	 */
+	bool has_augmentation_data;
+};
+
+/**
+ * Parses the CIE at cie.  Returns false if it can not be parsed.
+ */
+static bool parse_cie(dw_eh_ptr_t cie, cie_info *info)
+{
+	info->cie = cie;
+	info->fde_encoding = DW_EH_PE_absptr;
+	info->lsda_encoding = DW_EH_PE_omit;
+	info->has_augmentation_data = false;
+	uint32_t length;
+	memcpy(&length, cie, sizeof(length));
+	dw_eh_ptr_t p = cie + 4;
+	if (length == 0xffffffff) { p += 8; }
+	// Skip the CIE ID.
+	p += 4;
+	unsigned char version = *p++;
+	const char *augmentation = reinterpret_cast<const char*>(p);
+	p += strlen(augmentation) + 1;
+	if (augmentation[0] == 'e' && augmentation[1] == 'h')
+	{
+		p += sizeof(void*);
+		augmentation += 2;
+	}
+	// Code and data alignment factors, return address register.
+	read_uleb128(&p);
+	read_sleb128(&p);
+	if (version == 1)
+	{
+		p++;
+	}
+	else
+	{
+		read_uleb128(&p);
+	}
+	if (augmentation[0] != 'z') { return true; }
+	info->has_augmentation_data = true;
+	read_uleb128(&p);
+	for (const char *a = augmentation + 1 ; *a ; a++)
+	{
+		switch (*a)
+		{
+			case 'L':
+				info->lsda_encoding = *p++;
+				break;
+			case 'R':
+				info->fde_encoding = *p++;
+				break;
+			case 'P':
+			{
+				uintptr_t personality;
+				unsigned char encoding = *p++;
+				if (!read_pointer(encoding, &p, 0, &personality)) { return false; }
+				break;
+			}
+			case 'S':
+			case 'B':
+			case 'G':
+				break;
+			default:
+				return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Finds the LSDA for the FDE at fde.  Returns 0 if it does not have one or if
+ * the CIE can not be parsed.  cie caches the last CIE that was parsed.
+ */
+static unsigned char *find_lsda(dw_eh_ptr_t fde, cie_info *cie)
+{
+	uint32_t length;
+	memcpy(&length, fde, sizeof(length));
+	dw_eh_ptr_t p = fde + 4;
+	if (length == 0xffffffff) { p += 8; }
+	int32_t cie_offset;
+	memcpy(&cie_offset, p, sizeof(cie_offset));
+	dw_eh_ptr_t cie_addr = p - cie_offset;
+	p += 4;
+	if ((cie_addr != cie->cie) && !parse_cie(cie_addr, cie))
+	{
+		cie->cie = 0;
+		return 0;
+	}
+	if (!cie->has_augmentation_data || (cie->lsda_encoding == DW_EH_PE_omit))
+	{
+		return 0;
+	}
+	// Skip the start address and the length.  Only the format of the length
+	// is given by the encoding.
+	uintptr_t ignored;
+	if (!read_pointer(cie->fde_encoding, &p, 0, &ignored)) { return 0; }
+	read_value(cie->fde_encoding & 0x0f, &p);
+	read_uleb128(&p);
+	uintptr_t lsda;
+	if (!read_pointer(cie->lsda_encoding, &p, 0, &lsda)) { return 0; }
+	return reinterpret_cast<unsigned char*>(lsda);
+}
+
+/**
+ * Decodes the LSDA header and the call-site table for the function starting at
+ * region_start.  Returns false if the LSDA uses a feature that the index does
+ * not handle, in which case the function is left out and looked up the slow
+ * way.
+ */
+static bool index_function(uintptr_t region_start,
+                           unsigned char *lsda_addr,
+                           buffer<indexed_function> &functions,
+                           buffer<indexed_callsite> &callsites)
+{
+	indexed_function f;
+	f.region_start = region_start;
+	f.lsda_addr = lsda_addr;
+	f.first_callsite = callsites.count;
+	dwarf_eh_lsda &lsda = f.lsda;
+	dw_eh_ptr_t data = lsda_addr;
+	lsda.region_start = reinterpret_cast<dw_eh_ptr_t>(region_start);
+	// Landing pads relative to something other than the function start would
+	// need the unwind context to decode.
+	if (*data++ != DW_EH_PE_omit) { return false; }
+	lsda.landing_pads = lsda.region_start;
+	lsda.type_table = 0;
+	lsda.type_table_encoding = *data++;
+	if (lsda.type_table_encoding != DW_EH_PE_omit)
+	{
+		uint64_t v = read_uleb128(&data);
+		lsda.type_table = data + v;
+	}
+	lsda.callsite_encoding = *data++;
+	uintptr_t callsite_size = static_cast<uintptr_t>(read_uleb128(&data));
+	lsda.call_site_table = data;
+	lsda.action_table = data + callsite_size;
+
+	uintptr_t previous_end = 0;
+	while (data < lsda.action_table)
+	{
+		indexed_callsite c;
+		c.start = static_cast<uintptr_t>(read_value(lsda.callsite_encoding, &data));
+		c.end = c.start + static_cast<uintptr_t>(read_value(lsda.callsite_encoding, &data));
+		uintptr_t landing_pad = static_cast<uintptr_t>(read_value(lsda.callsite_encoding, &data));
+		uintptr_t action = static_cast<uintptr_t>(read_uleb128(&data));
+		c.landing_pad = landing_pad ? lsda.landing_pads + landing_pad : 0;
+		c.action_record = action ? lsda.action_table + action - 1 : 0;
+		// The lookup relies on the call sites being sorted and disjoint.
+		if (c.start < previous_end)
+		{
+			callsites.count = f.first_callsite;
+			return false;
+		}
+		previous_end = c.end;
+		callsites.push(c);
+	}
+	f.callsite_count = callsites.count - f.first_callsite;
+	functions.push(f);
+	return true;
+}
+
+/**
+ * Frees the index for an object.
+ */
+static void free_object(indexed_object *o)
+{
+	free(o->functions);
+	free(o->callsites);
+	free(o->name);
+	free(o);
+}
+
+/**
+ * Builds the index for the object described by info, whose .eh_frame_hdr
+ * section is at hdr, or which has none if hdr is null.  Returns null on
+ * failure.
+ */
+static indexed_object *build_object(struct dl_phdr_info *info,
+                                    const unsigned char *hdr)
+{
+	uintptr_t base = reinterpret_cast<uintptr_t>(hdr);
+	dw_eh_ptr_t p = const_cast<dw_eh_ptr_t>(hdr);
+	uintptr_t eh_frame, fde_count = 0;
+	// Only the common form of the binary search table is handled: version
+	// 1, with entries that are 4-byte offsets from the start of the section.
+	// Other objects are indexed with no functions, so that every lookup in
+	// them misses without updating the index again.
+	if ((0 != hdr) && (hdr[0] == 1) &&
+	    (hdr[3] == (DW_EH_PE_datarel | DW_EH_PE_sdata4)))
+	{
+		p += 4;
+		if (!read_pointer(hdr[1], &p, base, &eh_frame) ||
+		    !read_pointer(hdr[2], &p, base, &fde_count))
+		{
+			fde_count = 0;
+		}
+	}
+	buffer<indexed_function> functions = {0, 0, 0, false};
+	buffer<indexed_callsite> callsites = {0, 0, 0, false};
+	cie_info cie = {0, 0, 0, false};
+	for (uintptr_t i=0 ; i<fde_count ; i++, p+=8)
+	{
+		int32_t entry[2];
+		memcpy(entry, p, sizeof(entry));
+		uintptr_t region_start = base + entry[0];
+		dw_eh_ptr_t fde = reinterpret_cast<dw_eh_ptr_t>(base + entry[1]);
+		unsigned char *lsda = find_lsda(fde, &cie);
+		if (0 != lsda)
+		{
+			index_function(region_start, lsda, functions, callsites);
+		}
+	}
+	indexed_object *o = static_cast<indexed_object*>(calloc(1, sizeof(indexed_object)));
+	const char *name = info->dlpi_name ? info->dlpi_name : "";
+	char *name_copy = static_cast<char*>(malloc(strlen(name) + 1));
+	if (functions.failed || callsites.failed || (0 == o) || (0 == name_copy))
+	{
+		free(functions.data);
+		free(callsites.data);
+		free(name_copy);
+		free(o);
+		return 0;
+	}
+	strcpy(name_copy, name);
+	o->load_address = info->dlpi_addr;
+	o->eh_frame_hdr = hdr;
+	o->name = name_copy;
+	o->functions = functions.data;
+	o->function_count = functions.count;
+	o->callsites = callsites.data;
+	o->callsite_count = callsites.count;
+	return o;
+}
+
+/**
+ * State for the dl_iterate_phdr() callback that updates the index.
+ */
+struct update_state
+{
+	/**
+	 * The instruction pointer that must be covered by the new snapshot.
+	 */
+	uintptr_t ip;
+	/**
+	 * The previous snapshot.
+	 */
+	snapshot *old;
+	/**
+	 * The object containing ip, if it was not already indexed.
+	 */
+	snapshot_entry added;
+	/**
+	 * Set if an object contains ip.
+	 */
+	bool covered;
+	/**
+	 * The end of the highest object below ip.
+	 */
+	uintptr_t gap_start;
+	/**
+	 * The start of the lowest object above ip.
+	 */
+	uintptr_t gap_end;
+	/**
+	 * The value of dlpi_subs + 1, or zero if not provided.
+	 */
+	unsigned long epoch;
+	/**
+	 * The value of dlpi_adds, or zero if not provided.
+	 */
+	unsigned long adds;
+};
+
+/**
+ * dl_iterate_phdr() callback.  Marks the objects in the old snapshot that are
+ * still loaded and indexes the object containing the instruction pointer.
+ * Narrows the gap around the instruction pointer to exclude this object.
+ */
+static int update_callback(struct dl_phdr_info *info, size_t size, void *data)
+{
+	update_state *state = static_cast<update_state*>(data);
+	if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs))
+	{
+		state->epoch = info->dlpi_subs + 1;
+		state->adds = info->dlpi_adds;
+	}
+	uintptr_t start = UINTPTR_MAX;
+	uintptr_t end = 0;
+	const unsigned char *hdr = 0;
+	for (int i=0 ; i<info->dlpi_phnum ; i++)
+	{
+		const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+		uintptr_t segment = info->dlpi_addr + phdr->p_vaddr;
+		if (phdr->p_type == PT_GNU_EH_FRAME)
+		{
+			hdr = reinterpret_cast<const unsigned char*>(segment);
+		}
+		else if ((phdr->p_type == PT_LOAD) && (phdr->p_flags & PF_X))
+		{
+			if (segment < start) { start = segment; }
+			if (segment + phdr->p_memsz > end) { end = segment + phdr->p_memsz; }
+		}
+	}
+	if (end <= state->ip)
+	{
+		if (end > state->gap_start) { state->gap_start = end; }
+	}
+	else if (start > state->ip)
+	{
+		if (start < state->gap_end) { state->gap_end = start; }
+	}
+	else
+	{
+		state->covered = true;
+	}
+	const char *name = info->dlpi_name ? info->dlpi_name : "";
+	bool indexed = false;
+	if (state->old)
+	{
+		for (size_t i=0 ; i<state->old->count ; i++)
+		{
+			indexed_object *o = state->old->entries[i].object;
+			if ((0 != o) &&
+			    (o->load_address == info->dlpi_addr) &&
+			    (o->eh_frame_hdr == hdr) &&
+			    (strcmp(o->name, name) == 0))
+			{
+				o->loaded = true;
+				indexed = true;
+			}
+		}
+	}
+	if (!indexed && (start <= state->ip) && (state->ip < end))
+	{
+		state->added.start = start;
+		state->added.end = end;
+		state->added.object = build_object(info, hdr);
+	}
+	return 0;
+}
+
+/**
+ * Frees the retired snapshots if no thread can still be searching them.
+ * Called with index_lock held.
+ */
+static void free_retired_snapshots()
+{
+	// A thread searching a retired snapshot loaded it before it was
+	// replaced, and so incremented snapshot_readers before this load.  A
+	// thread that increments it after this load will see the replacement.
+	// This relies on all four accesses being sequentially consistent.
+	if (0 != snapshot_readers.load(seqcst)) { return; }
+	snapshot *s = retired_snapshots.exchange(nullptr);
+	while (s)
+	{
+		snapshot *next = s->next;
+		free(s);
+		s = next;
+	}
+}
+
+/**
+ * dl_iterate_phdr() callback that records the number of objects that have been
+ * loaded.  This is the same for every object, so the iteration stops after the
+ * first.
+ */
+static int record_load_count(struct dl_phdr_info *info, size_t size, void *data)
+{
+	if (size >= offsetof(struct dl_phdr_info, dlpi_adds) + sizeof(info->dlpi_adds))
+	{
+		*static_cast<unsigned long*>(data) = info->dlpi_adds;
+	}
+	return 1;
+}
+
+/**
+ * Returns the number of objects that have been loaded, or zero if the C
+ * library does not report it.
+ */
+static unsigned long current_adds()
+{
+	unsigned long adds = 0;
+	dl_iterate_phdr(record_load_count, &adds);
+	return adds;
+}
+
+/**
+ * Returns whether an entry from the old snapshot is still valid.  Gaps are
+ * only kept if no object has been loaded or unloaded since they were found,
+ * so that they stay disjoint from each other and from the objects.
+ */
+static bool keep_entry(const snapshot_entry &e, bool keep_gaps)
+{
+	return e.object ? e.object->loaded : keep_gaps;
+}
+
+/**
+ * Updates the index so that it reflects the objects that are currently loaded
+ * and covers ip, with the object containing it or, if there is none, with the
+ * gap between objects that contains it.  Called with index_lock held.
+ */
+static void update_index(uintptr_t ip)
+{
+	snapshot *old = current_snapshot.load(acquire);
+	for (size_t i=0 ; old && (i<old->count) ; i++)
+	{
+		if (old->entries[i].object)
+		{
+			old->entries[i].object->loaded = false;
+		}
+	}
+	update_state state = { ip, old, {0, 0, 0}, false, 0, UINTPTR_MAX, 0, 0 };
+	dl_iterate_phdr(update_callback, &state);
+	if (!state.covered)
+	{
+		state.added.start = state.gap_start;
+		state.added.end = state.gap_end;
+	}
+	bool adding = !state.covered || (0 != state.added.object);
+	bool keep_gaps = old && (old->epoch == state.epoch) &&
+	                 (old->adds == state.adds);
+	size_t count = adding ? 1 : 0;
+	for (size_t i=0 ; old && (i<old->count) ; i++)
+	{
+		count += keep_entry(old->entries[i], keep_gaps);
+	}
+	snapshot *s = static_cast<snapshot*>(malloc(sizeof(snapshot) +
+		(count ? count - 1 : 0) * sizeof(snapshot_entry)));
+	if (0 == s)
+	{
+		if (state.added.object) { free_object(state.added.object); }
+		return;
+	}
+	s->epoch = state.epoch;
+	s->adds = state.adds;
+	s->next = 0;
+	s->count = 0;
+	bool inserted_new = !adding;
+	for (size_t i=0 ; old && (i<old->count) ; i++)
+	{
+		snapshot_entry &e = old->entries[i];
+		if (!keep_entry(e, keep_gaps)) { continue; }
+		if (!inserted_new && (state.added.start < e.start))
+		{
+			s->entries[s->count++] = state.added;
+			inserted_new = true;
+		}
+		s->entries[s->count++] = e;
+	}
+	if (!inserted_new)
+	{
+		s->entries[s->count++] = state.added;
+	}
+	current_snapshot.store(s, seqcst);
+	// Objects that are no longer loaded can not be on any thread's stack, so
+	// their indexes can be freed.  The old snapshot itself may still be in
+	// use.
+	for (size_t i=0 ; old && (i<old->count) ; i++)
+	{
+		indexed_object *o = old->entries[i].object;
+		if (o && !o->loaded)
+		{
+			free_object(o);
+		}
+	}
+	if (old)
+	{
+		old->next = retired_snapshots.load(acquire);
+		retired_snapshots.store(old, release);
+	}
+}
+
+/**
+ * Finds the entry containing ip in a snapshot.
+ */
+static snapshot_entry *find_entry(snapshot *s, uintptr_t ip)
+{
+	size_t low = 0;
+	size_t high = s->count;
+	while (low < high)
+	{
+		size_t mid = low + (high - low) / 2;
+		if (ip < s->entries[mid].start)
+		{
+			high = mid;
+		}
+		else if (ip >= s->entries[mid].end)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			return &s->entries[mid];
+		}
+	}
+	return 0;
+}
+
+/**
+ * Finds the object containing ip in the current snapshot, if the snapshot is
+ * no older than epoch.  If the snapshot records ip as being in a gap, returns
+ * null and sets *gap_adds to the value of dlpi_adds that the gap is valid
+ * for.  Does not take index_lock.
+ */
+static indexed_object *find_current_object(uintptr_t ip,
+                                           unsigned long epoch,
+                                           bool *in_gap,
+                                           unsigned long *gap_adds)
+{
+	snapshot_readers.fetch_add(1, seqcst);
+	snapshot *s = current_snapshot.load(seqcst);
+	indexed_object *o = 0;
+	// A snapshot made after this epoch is still correct: every object that
+	// the exception is being unwound through is still loaded.
+	if (s && (s->epoch >= epoch))
+	{
+		snapshot_entry *e = find_entry(s, ip);
+		if (e)
+		{
+			o = e->object;
+			*in_gap = (0 == o);
+			*gap_adds = s->adds;
+		}
+	}
+	// The last thread to stop searching frees any retired snapshots.  If
+	// another thread holds the lock, it will try to free them before it
+	// releases it.
+	if ((1 == snapshot_readers.fetch_add(-1, seqcst)) &&
+	    (0 != retired_snapshots.load(acquire)) &&
+	    (0 == pthread_mutex_trylock(&index_lock)))
+	{
+		free_retired_snapshots();
+		pthread_mutex_unlock(&index_lock);
+	}
+	return o;
+}
+
+eh_index_result eh_index_lookup(struct _Unwind_Context *context,
+                                unsigned char *lsda_addr,
+                                unsigned long epoch,
+                                struct dwarf_eh_lsda *lsda,
+                                struct dwarf_eh_action *action)
+{
+	if (0 == epoch) { return eh_index_miss; }
+	uintptr_t ip = static_cast<uintptr_t>(_Unwind_GetIP(context));
+	bool in_gap = false;
+	unsigned long gap_adds = 0;
+	indexed_object *o = find_current_object(ip, epoch, &in_gap, &gap_adds);
+	// Code outside every object can not be indexed.  Unless an object has
+	// been loaded since, there is nothing to update.
+	if (in_gap && (gap_adds == current_adds()))
+	{
+		return eh_index_miss;
+	}
+	if (0 == o)
+	{
+		// Either this object has not been indexed yet or objects have been
+		// loaded or unloaded since the snapshot was made.  Another thread
+		// may have done the update while we waited for the lock.
+		pthread_mutex_lock(&index_lock);
+		snapshot *s = current_snapshot.load(acquire);
+		snapshot_entry *e = s ? find_entry(s, ip) : 0;
+		if ((0 == e) || (s->epoch < epoch) ||
+		    ((0 == e->object) && (s->adds != current_adds())))
+		{
+			update_index(ip);
+			s = current_snapshot.load(acquire);
+			e = s ? find_entry(s, ip) : 0;
+		}
+		o = e ? e->object : 0;
+		free_retired_snapshots();
+		pthread_mutex_unlock(&index_lock);
+		if (0 == o) { return eh_index_miss; }
+	}
+
+	// Find the function.
+	uintptr_t region_start = static_cast<uintptr_t>(_Unwind_GetRegionStart(context));
+	size_t low = 0;
+	size_t high = o->function_count;
+	indexed_function *f = 0;
+	while (low < high)
+	{
+		size_t mid = low + (high - low) / 2;
+		if (region_start < o->functions[mid].region_start)
+		{
+			high = mid;
+		}
+		else if (region_start > o->functions[mid].region_start)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			f = &o->functions[mid];
+			break;
+		}
+	}
+	if ((0 == f) || (f->lsda_addr != lsda_addr)) { return eh_index_miss; }
+	*lsda = f->lsda;
+
+	// Find the last call site that starts before ip.  As in
+	// dwarf_eh_find_callsite(), a call site does not cover its first byte
+	// but does cover the byte after its end.
+	action->landing_pad = 0;
+	action->action_record = 0;
+	uintptr_t offset = ip - region_start;
+	indexed_callsite *callsites = o->callsites + f->first_callsite;
+	low = 0;
+	high = f->callsite_count;
+	while (low < high)
+	{
+		size_t mid = low + (high - low) / 2;
+		if (callsites[mid].start < offset)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+	if ((low == 0) || (offset > callsites[low - 1].end))
+	{
+		return eh_index_no_callsite;
+	}
+	action->landing_pad = callsites[low - 1].landing_pad;
+	action->action_record = callsites[low - 1].action_record;
+	return eh_index_found;
+}
+
+#endif
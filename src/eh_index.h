@@ -0,0 +1,45 @@
+/**
+ * eh_index.h - Precomputed index of the exception tables of loaded objects.
+ *
+ * When LIBCXXRT_EH_INDEX is defined, the first time that an exception is
+ * unwound through a shared object, the call-site tables of every function in
+ * that object are decoded into sorted arrays.  The personality function can
+ * then find the call site for a frame with two binary searches, rather than
+ * parsing the LSDA and walking its LEB128-encoded call-site table.
+ */
+#pragma once
+#include "dwarf_eh.h"
+
+/**
+ * Result of looking up a frame in the exception index.
+ */
+enum eh_index_result
+{
+	/**
+	 * The frame is not in the index.  The caller must parse the LSDA itself.
+	 */
+	eh_index_miss,
+	/**
+	 * The instruction pointer is not covered by the call-site table.
+	 */
+	eh_index_no_callsite,
+	/**
+	 * The call site was found.
+	 */
+	eh_index_found
+};
+
+/**
+ * Looks up the frame described by context, whose LSDA is lsda_addr, in the
+ * exception index.  The epoch is one more than the number of shared objects
+ * that had been unloaded when it was last checked during this unwind, or zero
+ * if that is not known, in which case the index is not used.
+ *
+ * Unless this returns eh_index_miss, lsda is filled in as if by parse_lsda()
+ * and action as if by dwarf_eh_find_callsite().
+ */
+eh_index_result eh_index_lookup(struct _Unwind_Context *context,
+                                unsigned char *lsda_addr,
+                                unsigned long epoch,
+                                struct dwarf_eh_lsda *lsda,
+                                struct dwarf_eh_action *action);
@@ -27,14 +27,28 @@
 
 #include <stdlib.h>
 #include <dlfcn.h>
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sys/mman.h>
 #include "typeinfo.h"
 #include "dwarf_eh.h"
 #include "atomic.h"
 #include "cxxabi.h"
+#if defined(LIBCXXRT_HANDLER_CACHE) || defined(LIBCXXRT_TYPE_MATCH_CACHE)
+#include "lookup_cache.h"
+#endif
+#ifdef LIBCXXRT_EH_INDEX
+#include "eh_index.h"
+#endif
+#if defined(LIBCXXRT_HANDLER_CACHE) || defined(LIBCXXRT_EH_INDEX) || \
+    defined(LIBCXXRT_TYPE_MATCH_CACHE)
+#define LIBCXXRT_TRACK_UNLOADS
+#include <link.h>
+#endif
 
 #pragma weak pthread_key_create
 #pragma weak pthread_setspecific
@@ -49,9 +63,9 @@
 #define pthread_mutex_unlock(mtx) do {\
 	if (pthread_mutex_unlock) pthread_mutex_unlock(mtx);\
 	} while(0)
-#pragma weak pthread_cond_signal
-#define pthread_cond_signal(cv) do {\
-	if (pthread_cond_signal) pthread_cond_signal(cv);\
+#pragma weak pthread_cond_broadcast
+#define pthread_cond_broadcast(cv) do {\
+	if (pthread_cond_broadcast) pthread_cond_broadcast(cv);\
 	} while(0)
 #pragma weak pthread_cond_wait
 #define pthread_cond_wait(cv, mtx) do {\
@@ -147,6 +161,35 @@ typedef enum
 	handler_catch
 } handler_type;
 
+#ifndef LIBCXXRT_NO_EXCEPTION_CACHE
+/**
+ * The number of size classes in the per-thread exception cache.
+ */
+static const int exception_cache_classes = 3;
+/**
+ * The maximum number of free blocks kept in each size class of the per-thread
+ * exception cache.
+ */
+static const int exception_cache_depth = 4;
+
+/**
+ * Header prepended to every exception allocated with malloc().  It records
+ * the size class of the block so that it can be returned to the right
+ * per-thread cache list when the exception is freed, and links the block into
+ * that list while it is cached.  The header is padded to the alignment of
+ * __cxa_exception, so the exception that follows it stays correctly aligned.
+ */
+struct alignas(__cxa_exception) exception_block
+{
+	/** The next free block in the cache, while this block is cached. */
+	exception_block *next;
+	/**
+	 * The size class of this block, or -1 if it is too large to be cached.
+	 */
+	int sizeClass;
+};
+#endif
+
 /**
  * Per-thread info required by the runtime.  We store a single structure
  * pointer in thread-local storage, because this tends to be a scarce resource
@@ -171,6 +214,18 @@ struct __cxa_thread_info
 	 * in ABI spec [3.3.1]).
 	 */
 	int emergencyBuffersHeld;
+#endif
+#ifndef LIBCXXRT_NO_EXCEPTION_CACHE
+	/**
+	 * Recently freed exception blocks, one list for each size class.  Threads
+	 * that throw frequently will reuse these rather than calling malloc() and
+	 * free() for every exception.
+	 */
+	exception_block *exceptionCache[exception_cache_classes];
+	/**
+	 * The number of blocks in each of the exceptionCache lists.
+	 */
+	int exceptionCacheCount[exception_cache_classes];
 #endif
 	/**
 	 * The exception currently running in a cleanup.
@@ -187,6 +242,19 @@ struct __cxa_thread_info
 		caught,
 		rethrown
 	} foreign_exception_state;
+#ifdef LIBCXXRT_TRACK_UNLOADS
+	/**
+	 * The exception that the personality function was last called for on
+	 * this thread, or null if a new exception has been thrown or caught
+	 * since.
+	 */
+	_Unwind_Exception *unwindingException;
+	/**
+	 * Set once the unload epoch has been brought up to date while unwinding
+	 * unwindingException.
+	 */
+	bool unloadEpochChecked;
+#endif
 	/**
 	 * The public part of this structure, accessible from outside of this
 	 * module.
@@ -376,6 +444,23 @@ static atomic<unexpected_handler> unexpectedHandler = std::terminate;
 /** Key used for thread-local data. */
 static pthread_key_t eh_key;
 
+#ifdef LIBCXXRT_TLS_THREAD_INFO
+/**
+ * The per-thread info, stored directly in thread-local storage rather than
+ * allocated and looked up with pthread_getspecific().  The initial-exec model
+ * makes each access a single load relative to the thread pointer.  eh_key is
+ * still used, but only to run thread_cleanup() when the thread exits.
+ */
+static __thread __cxa_thread_info threadInfo
+	__attribute__((tls_model("initial-exec")));
+/**
+ * Flag indicating whether threadInfo is registered with eh_key for cleanup on
+ * this thread.
+ */
+static __thread bool threadInfoRegistered
+	__attribute__((tls_model("initial-exec")));
+#endif
+
 
 /**
  * Cleanup function, allowing foreign exception handlers to correctly destroy
@@ -411,6 +496,27 @@ static void free_exception_list(__cxa_exception *ex)
 	__cxa_free_exception(ex+1);
 }
 
+#ifndef LIBCXXRT_NO_EXCEPTION_CACHE
+/**
+ * Returns all of the blocks in a thread's exception cache to malloc().
+ */
+static void drain_exception_cache(__cxa_thread_info *info)
+{
+	for (int i=0 ; i<exception_cache_classes ; i++)
+	{
+		exception_block *block = info->exceptionCache[i];
+		while (0 != block)
+		{
+			exception_block *next = block->next;
+			free(block);
+			block = next;
+		}
+		info->exceptionCache[i] = 0;
+		info->exceptionCacheCount[i] = 0;
+	}
+}
+#endif
+
 /**
  * Cleanup function called when a thread exists to make certain that all of the
  * per-thread data is deleted.
@@ -432,7 +538,18 @@ static void thread_cleanup(void* thread_info)
 			free_exception_list(info->globals.caughtExceptions);
 		}
 	}
+#ifndef LIBCXXRT_NO_EXCEPTION_CACHE
+	drain_exception_cache(info);
+#endif
+#ifdef LIBCXXRT_TLS_THREAD_INFO
+	// The structure is not heap allocated, so just reset it to the zeroed
+	// state that a new thread starts with.  If a later thread-specific
+	// destructor throws, it will be registered again.
+	memset(info, 0, sizeof(*info));
+	threadInfoRegistered = false;
+#else
 	free(thread_info);
+#endif
 }
 
 
@@ -447,10 +564,12 @@ static pthread_once_t once_control = PTHREAD_ONCE_INIT;
  * things in a global.
  */
 static bool fakeTLS;
+#ifndef LIBCXXRT_TLS_THREAD_INFO
 /**
  * Thread-local storage for a single-threaded program.
  */
 static __cxa_thread_info singleThreadInfo;
+#endif
 /**
  * Initialise eh_key.
  */
@@ -469,6 +588,47 @@ static void init_key(void)
 	pthread_setspecific(eh_key, 0);
 }
 
+#ifdef LIBCXXRT_TLS_THREAD_INFO
+/**
+ * Registers this thread's info structure so that it is cleaned up when the
+ * thread exits.  If we are not linked against a full pthread implementation,
+ * there is no way to run code on thread exit, but the structure is still
+ * correctly thread-local.
+ */
+__attribute__((noinline))
+static void register_thread_info()
+{
+	threadInfoRegistered = true;
+	if ((0 == pthread_once) || pthread_once(&once_control, init_key))
+	{
+		fakeTLS = true;
+	}
+	if (!fakeTLS)
+	{
+		pthread_setspecific(eh_key, &threadInfo);
+	}
+}
+/**
+ * Returns the thread info structure, registering it for cleanup if this is
+ * the first use on this thread.
+ */
+static inline __cxa_thread_info *thread_info()
+{
+	if (__builtin_expect(!threadInfoRegistered, 0))
+	{
+		register_thread_info();
+	}
+	return &threadInfo;
+}
+/**
+ * Fast version of thread_info().  Returns 0 if thread_info() has not been
+ * called on this thread, or if the thread has already been cleaned up.
+ */
+static inline __cxa_thread_info *thread_info_fast()
+{
+	return threadInfoRegistered ? &threadInfo : 0;
+}
+#else
 /**
  * Returns the thread info structure, creating it if it is not already created.
  */
@@ -496,6 +656,7 @@ static __cxa_thread_info *thread_info_fast()
 	if (fakeTLS) { return &singleThreadInfo; }
 	return static_cast<__cxa_thread_info*>(pthread_getspecific(eh_key));
 }
+#endif
 /**
  * ABI function returning the __cxa_eh_globals structure.
  */
@@ -512,10 +673,89 @@ extern "C" __cxa_eh_globals *ABI_NAMESPACE::__cxa_get_globals_fast(void)
 	return &(thread_info_fast()->globals);
 }
 
+#ifndef LIBCXXRT_NO_EXCEPTION_CACHE
+/**
+ * The largest block (including the exception_block header) that will be
+ * cached in each size class.
+ */
+static const size_t exception_cache_class_size[exception_cache_classes] =
+	{ 256, 512, 1024 };
+
+/**
+ * Allocates size bytes for an exception with malloc(), reusing a block from
+ * this thread's exception cache if one of a suitable size is available.
+ * Returns 0 if malloc() fails.
+ */
+static char *malloc_exception(size_t size)
+{
+	size += sizeof(exception_block);
+	int sizeClass = -1;
+	for (int i=0 ; i<exception_cache_classes ; i++)
+	{
+		if (size <= exception_cache_class_size[i])
+		{
+			sizeClass = i;
+			size = exception_cache_class_size[i];
+			break;
+		}
+	}
+	exception_block *block = 0;
+	if (sizeClass >= 0)
+	{
+		__cxa_thread_info *info = thread_info();
+		block = info->exceptionCache[sizeClass];
+		if (0 != block)
+		{
+			info->exceptionCache[sizeClass] = block->next;
+			info->exceptionCacheCount[sizeClass]--;
+		}
+	}
+	if (0 == block)
+	{
+		block = static_cast<exception_block*>(malloc(size));
+		if (0 == block) { return 0; }
+		block->sizeClass = sizeClass;
+	}
+	return reinterpret_cast<char*>(block + 1);
+}
+
+/**
+ * Frees an exception allocated with malloc_exception().  The block is kept in
+ * the current thread's cache if there is space for it.
+ */
+static void free_exception_block(char *e)
+{
+	exception_block *block = reinterpret_cast<exception_block*>(e) - 1;
+	int sizeClass = block->sizeClass;
+	// Don't use thread_info() here: we may be called from thread_cleanup(),
+	// after the thread-local pointer has been cleared, or on a thread that
+	// has never thrown.  In either case, just give the memory back.
+	__cxa_thread_info *info = thread_info_fast();
+	if ((sizeClass >= 0) && (0 != info) &&
+	    (info->exceptionCacheCount[sizeClass] < exception_cache_depth))
+	{
+		block->next = info->exceptionCache[sizeClass];
+		info->exceptionCache[sizeClass] = block;
+		info->exceptionCacheCount[sizeClass]++;
+		return;
+	}
+	free(block);
+}
+#else
+static char *malloc_exception(size_t size)
+{
+	return static_cast<char*>(malloc(size));
+}
+static void free_exception_block(char *e)
+{
+	free(e);
+}
+#endif
+
 #ifdef LIBCXXRT_NO_EMERGENCY_MALLOC
 static char *alloc_or_die(size_t size)
 {
-	char *buffer = static_cast<char*>(calloc(1, size));
+	char *buffer = malloc_exception(size);
 
 	if (buffer == nullptr)
 	{
@@ -526,126 +766,416 @@ static char *alloc_or_die(size_t size)
 }
 static void free_exception(char *e)
 {
-	free(e);
+	free_exception_block(e);
 }
 #else
 /**
- * An emergency allocation reserved for when malloc fails.  This is treated as
- * 16 buffers of 1KB each.
+ * The number of granules in a bitmap word.  A single allocation may not span
+ * more than one word, so this also limits the size of an emergency
+ * allocation.
+ */
+static const unsigned emergency_granules_per_word = 64;
+/**
+ * The size of the emergency reserve that is used if it is not configured with
+ * pathscale::set_emergency_reserve() or the LIBCXXRT_EMERGENCY_RESERVE
+ * environment variable.
+ */
+static const size_t emergency_default_size = 16384;
+/**
+ * The default number of granules in the emergency reserve.
+ */
+static const size_t emergency_default_granules = 64;
+/**
+ * The default maximum number of emergency allocations that a single thread
+ * may hold (as per recommendation in ABI spec [3.3.1]).
+ */
+static const int emergency_default_per_thread_limit = 4;
+/**
+ * The requested size of the emergency reserve, in bytes.  The reserve is
+ * created on first use, so this may be changed until then.
+ */
+static size_t emergency_reserve_size = emergency_default_size;
+/**
+ * The size of each granule in the emergency reserve.  Emergency allocations
+ * are made in runs of a power-of-two number of granules.
  */
-static char emergency_buffer[16384];
+static size_t emergency_granule_size;
 /**
- * Flag indicating whether each buffer is allocated.
+ * The total number of granules in the emergency reserve.
  */
-static bool buffer_allocated[16];
+static size_t emergency_granules = emergency_default_granules;
 /**
- * Lock used to protect emergency allocation.
+ * The maximum number of emergency allocations that a single thread may hold.
+ */
+static int emergency_per_thread_limit = emergency_default_per_thread_limit;
+/**
+ * The first granule of the emergency reserve.  The reserve is a lazily
+ * committed anonymous mapping, so it costs no memory until it is used.  This
+ * is null if the reserve has not been created or is disabled.
+ */
+static char *emergency_buffer;
+/**
+ * The end of the emergency reserve.
+ */
+static char *emergency_buffer_end;
+/**
+ * The number of words in the emergency reserve bitmap.
+ */
+static size_t emergency_bitmap_words;
+/**
+ * Bitmap of allocated granules, stored at the start of the mapping.  Bit i of
+ * word j is set if granule (j * emergency_granules_per_word + i) is in use.
+ * Allocations and frees update this with atomic operations and never take a
+ * lock.
+ */
+static atomic<uint64_t> *emergency_bitmap;
+/**
+ * For the first granule of each allocation, the base-two logarithm of the
+ * number of granules in the allocation.  Written by the allocating thread
+ * after it has claimed the granules and read when the allocation is freed.
+ */
+static unsigned char *emergency_order;
+/**
+ * Flag indicating that the emergency reserve has been created (or that
+ * creating it has failed).  After this is set, the configuration above does
+ * not change.
+ */
+static atomic<bool> emergency_reserve_created{false};
+/**
+ * Flag indicating that the emergency reserve has been configured with
+ * pathscale::set_emergency_reserve(), so the environment should be ignored.
+ */
+static bool emergency_reserve_configured;
+/**
+ * Once control used to create the emergency reserve.
+ */
+static pthread_once_t emergency_once = PTHREAD_ONCE_INIT;
+/**
+ * The number of threads waiting for space in the emergency reserve.  Only
+ * modified with emergency_malloc_lock held.
+ */
+static atomic<int> emergency_waiters{0};
+/**
+ * Lock used, along with emergency_malloc_wait, to sleep when the emergency
+ * reserve is exhausted and to protect the configuration before the reserve is
+ * created.  This is not needed to allocate or free.
  */
 static pthread_mutex_t emergency_malloc_lock = PTHREAD_MUTEX_INITIALIZER;
 /**
- * Condition variable used to wait when two threads are both trying to use the
- * emergency malloc() buffer at once.
+ * Condition variable used to wait when the emergency reserve is exhausted.
  */
 static pthread_cond_t emergency_malloc_wait = PTHREAD_COND_INITIALIZER;
 
 /**
- * Allocates size bytes from the emergency allocation mechanism, if possible.
- * This function will fail if size is over 1KB or if this thread already has 4
- * emergency buffers.  If all emergency buffers are allocated, it will sleep
- * until one becomes available.
+ * Parses a size with an optional K or M suffix.  Updates *str to point after
+ * the parsed value.  Returns false if *str does not start with a size or if
+ * the size does not fit in a size_t.
  */
-static char *emergency_malloc(size_t size)
+static bool parse_size(const char **str, size_t *size)
+{
+	if ((**str < '0') || (**str > '9')) { return false; }
+	char *end;
+	errno = 0;
+	unsigned long long v = strtoull(*str, &end, 0);
+	unsigned shift = 0;
+	switch (*end)
+	{
+		case 'k': case 'K': shift = 10; end++; break;
+		case 'm': case 'M': shift = 20; end++; break;
+		default: break;
+	}
+	if ((ERANGE == errno) || (v > (SIZE_MAX >> shift))) { return false; }
+	*str = end;
+	*size = static_cast<size_t>(v) << shift;
+	return true;
+}
+
+/**
+ * Returns the size of each granule of an emergency reserve of size bytes
+ * divided into granules granules.  Granules must keep exceptions correctly
+ * aligned, so this is zero if they would be too small.
+ */
+static size_t emergency_granule_size_for(size_t size, size_t granules)
 {
-	if (size > 1024) { return 0; }
+	if (0 == granules) { return 0; }
+	return (size / granules) & ~(alignof(__cxa_exception) - 1);
+}
 
-	__cxa_thread_info *info = thread_info();
-	// Only 4 emergency buffers allowed per thread!
-	if (info->emergencyBuffersHeld > 3) { return 0; }
+/**
+ * Returns whether a reserve configuration is valid.  A size of 0 disables the
+ * reserve.  Otherwise, the granules must be large enough to hold an aligned
+ * allocation and each thread must be allowed at least one allocation, so that
+ * the reserve can be used.
+ */
+static bool valid_emergency_reserve(size_t size,
+                                    size_t granules,
+                                    long long per_thread_limit)
+{
+	if ((per_thread_limit < 0) || (per_thread_limit > INT_MAX)) { return false; }
+	if (0 == size) { return true; }
+	return (0 != per_thread_limit) &&
+	       (0 != emergency_granule_size_for(size, granules));
+}
+
+/**
+ * Reads the emergency reserve configuration from the environment.  The
+ * LIBCXXRT_EMERGENCY_RESERVE variable takes the form size[,slots[,limit]],
+ * where size is the size of the reserve in bytes (with an optional K or M
+ * suffix), slots is the number of granules that it is divided into and limit
+ * is the maximum number of emergency allocations held by each thread.  A size
+ * of 0 disables the reserve.  If the variable is malformed, or would give a
+ * reserve that can not be used, it is ignored.
+ */
+static void read_emergency_reserve_config()
+{
+	const char *config = getenv("LIBCXXRT_EMERGENCY_RESERVE");
+	if (0 == config) { return; }
+	size_t size;
+	size_t granules = emergency_granules;
+	size_t limit = static_cast<size_t>(emergency_per_thread_limit);
+	if (!parse_size(&config, &size)) { return; }
+	if (',' == *config)
+	{
+		config++;
+		if (!parse_size(&config, &granules)) { return; }
+		if (',' == *config)
+		{
+			config++;
+			if (!parse_size(&config, &limit) || (limit > INT_MAX)) { return; }
+		}
+	}
+	if ((0 != *config) ||
+	    !valid_emergency_reserve(size, granules, static_cast<long long>(limit)))
+	{
+		return;
+	}
+	emergency_reserve_size = size;
+	emergency_granules = granules;
+	emergency_per_thread_limit = static_cast<int>(limit);
+}
 
+/**
+ * Creates the emergency reserve.  Called once, the first time that an
+ * exception is allocated.
+ */
+static void create_emergency_reserve()
+{
 	pthread_mutex_lock(&emergency_malloc_lock);
-	int buffer = -1;
-	while (buffer < 0)
-	{
-		// While we were sleeping on the lock, another thread might have free'd
-		// enough memory for us to use, so try the allocation again - no point
-		// using the emergency buffer if there is some real memory that we can
-		// use...
-		void *m = calloc(1, size);
-		if (0 != m)
+	if (!emergency_reserve_configured)
+	{
+		read_emergency_reserve_config();
+	}
+	size_t granules = emergency_granules;
+	size_t granule_size =
+		emergency_granule_size_for(emergency_reserve_size, granules);
+	if (0 != granule_size)
+	{
+		size_t words = (granules + emergency_granules_per_word - 1) /
+			emergency_granules_per_word;
+		// Lay out the bitmap and the order table at the start of the mapping,
+		// with the granules after them.
+		size_t metadata = words * sizeof(uint64_t) + granules;
+		metadata = (metadata + 63) & ~static_cast<size_t>(63);
+		size_t length = metadata + granules * granule_size;
+		int flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_NORESERVE
+		flags |= MAP_NORESERVE;
+#endif
+		void *region = mmap(0, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+		if (MAP_FAILED != region)
 		{
-			pthread_mutex_unlock(&emergency_malloc_lock);
-			return static_cast<char*>(m);
+			char *base = static_cast<char*>(region);
+			emergency_bitmap = reinterpret_cast<atomic<uint64_t>*>(base);
+			emergency_order = reinterpret_cast<unsigned char*>(base) +
+				words * sizeof(uint64_t);
+			// Mark the bits past the end of the last word as allocated, so
+			// that they are never claimed.
+			size_t spare = words * emergency_granules_per_word - granules;
+			if (spare > 0)
+			{
+				emergency_bitmap[words - 1].store(~static_cast<uint64_t>(0) <<
+					(emergency_granules_per_word - spare));
+			}
+			emergency_bitmap_words = words;
+			emergency_granule_size = granule_size;
+			emergency_buffer = base + metadata;
+			emergency_buffer_end = emergency_buffer + granules * granule_size;
 		}
-		for (int i=0 ; i<16 ; i++)
+	}
+	emergency_reserve_created.store(true, memory_order::release);
+	pthread_mutex_unlock(&emergency_malloc_lock);
+}
+
+/**
+ * Ensures that the emergency reserve has been created.  This is called before
+ * malloc() has failed, because creating the reserve itself needs to map
+ * memory.
+ */
+static inline void ensure_emergency_reserve()
+{
+	if (emergency_reserve_created.load(memory_order::acquire)) { return; }
+	if (0 != pthread_once)
+	{
+		pthread_once(&emergency_once, create_emergency_reserve);
+	}
+	else if (!emergency_reserve_created.load())
+	{
+		create_emergency_reserve();
+	}
+}
+
+/**
+ * Returns the base-two logarithm of the number of granules needed for an
+ * allocation of size bytes, or -1 if it is too large for the emergency
+ * reserve.
+ */
+static int emergency_order_for_size(size_t size)
+{
+	size_t granules = (size + emergency_granule_size - 1) /
+		emergency_granule_size;
+	int order = 0;
+	while ((static_cast<size_t>(1) << order) < granules)
+	{
+		order++;
+	}
+	if (((static_cast<size_t>(1) << order) > emergency_granules_per_word) ||
+	    ((static_cast<size_t>(1) << order) > emergency_granules))
+	{
+		return -1;
+	}
+	return order;
+}
+
+/**
+ * Tries to claim a free, naturally aligned run of 2^order granules.  Returns
+ * the index of the first granule, or -1 if there is no free run of this size.
+ * The bitmap is first read with the given memory order.
+ */
+static int emergency_claim(int order, memory_order order_of_load)
+{
+	unsigned run = 1U << order;
+	uint64_t mask = (run == 64) ? ~static_cast<uint64_t>(0) :
+		((static_cast<uint64_t>(1) << run) - 1);
+	for (unsigned word=0 ; word<emergency_bitmap_words ; word++)
+	{
+		uint64_t old = emergency_bitmap[word].load(order_of_load);
+		for (unsigned i=0 ; i<emergency_granules_per_word ; )
 		{
-			if (!buffer_allocated[i])
+			uint64_t claim = mask << i;
+			if ((old & claim) != 0)
 			{
-				buffer = i;
-				buffer_allocated[i] = true;
-				break;
+				i += run;
+				continue;
 			}
+			// If this fails, old is updated with the current value and we
+			// recheck the same run.
+			if (emergency_bitmap[word].compare_exchange(old, old | claim))
+			{
+				return static_cast<int>(word * emergency_granules_per_word + i);
+			}
+		}
+	}
+	return -1;
+}
+
+/**
+ * Allocates size bytes from the emergency allocation mechanism, if possible.
+ * This function will fail if size is larger than 64 granules or the whole
+ * reserve, or if this thread already holds its limit of emergency
+ * allocations.  If there is no free space of
+ * the right size in the reserve, it will sleep until another thread frees
+ * some.
+ */
+static char *emergency_malloc(size_t size)
+{
+	if (0 == emergency_buffer) { return 0; }
+	int order = emergency_order_for_size(size);
+	if (order < 0) { return 0; }
+
+	__cxa_thread_info *info = thread_info();
+	if (info->emergencyBuffersHeld >= emergency_per_thread_limit) { return 0; }
+
+	int granule = emergency_claim(order, memory_order::acquire);
+	while (granule < 0)
+	{
+		// Another thread might have freed enough memory for us to use, so try
+		// the allocation again - no point using the emergency buffer if there
+		// is some real memory that we can use...
+		char *m = malloc_exception(size);
+		if (0 != m)
+		{
+			return m;
 		}
-		// If there still isn't a buffer available, then sleep on the condition
-		// variable.  This will be signalled when another thread releases one
-		// of the emergency buffers.
-		if (buffer < 0)
+		// The reserve is exhausted, so sleep until a free wakes us.  We
+		// register as a waiter before trying to claim space again, so a
+		// thread that frees after our attempt will see us and signal.  The
+		// free clears its bits and then reads the waiter count, so both
+		// sides must be sequentially consistent: with an acquire load here,
+		// we could see the bits still set while the freeing thread sees no
+		// waiters, and then sleep with nothing to wake us.
+		pthread_mutex_lock(&emergency_malloc_lock);
+		emergency_waiters.store(emergency_waiters.load() + 1);
+		granule = emergency_claim(order, memory_order::seqcst);
+		if (granule < 0)
 		{
 			pthread_cond_wait(&emergency_malloc_wait, &emergency_malloc_lock);
 		}
+		emergency_waiters.store(emergency_waiters.load() - 1);
+		pthread_mutex_unlock(&emergency_malloc_lock);
 	}
-	pthread_mutex_unlock(&emergency_malloc_lock);
+	emergency_order[granule] = static_cast<unsigned char>(order);
 	info->emergencyBuffersHeld++;
-	return emergency_buffer + (1024 * buffer);
+	return emergency_buffer + (emergency_granule_size * granule);
 }
 
 /**
- * Frees a buffer returned by emergency_malloc().
- *
- * Note: Neither this nor emergency_malloc() is particularly efficient.  This
- * should not matter, because neither will be called in normal operation - they
- * are only used when the program runs out of memory, which should not happen
- * often.
+ * Frees a buffer returned by emergency_malloc().  The caller has already
+ * checked that ptr is inside the emergency reserve.
  */
 static void emergency_malloc_free(char *ptr)
 {
-	int buffer = -1;
-	// Find the buffer corresponding to this pointer.
-	for (int i=0 ; i<16 ; i++)
+	size_t granule = (ptr - emergency_buffer) / emergency_granule_size;
+	assert((ptr == emergency_buffer + granule * emergency_granule_size) &&
+	       "Trying to free something that is not an emergency buffer!");
+	unsigned run = 1U << emergency_order[granule];
+	uint64_t mask = (run == 64) ? ~static_cast<uint64_t>(0) :
+		((static_cast<uint64_t>(1) << run) - 1);
+	unsigned word = granule / emergency_granules_per_word;
+	unsigned bit = granule % emergency_granules_per_word;
+	emergency_bitmap[word].fetch_and(~(mask << bit));
+	// The held count is per thread, but exceptions are usually freed by the
+	// thread that threw them, so give the allowance back to this thread.
+	__cxa_thread_info *info = thread_info_fast();
+	if ((0 != info) && (info->emergencyBuffersHeld > 0))
 	{
-		if (ptr == static_cast<void*>(emergency_buffer + (1024 * i)))
-		{
-			buffer = i;
-			break;
-		}
+		info->emergencyBuffersHeld--;
+	}
+	// Wake up any threads that are blocking waiting for some space in the
+	// emergency buffer.  This is only needed when the reserve was exhausted,
+	// so the lock is not touched in the common case.  Both the fetch_and()
+	// above and this load are sequentially consistent, which pairs with the
+	// waiter registering itself before it rechecks the bitmap.
+	if (emergency_waiters.load() > 0)
+	{
+		pthread_mutex_lock(&emergency_malloc_lock);
+		pthread_cond_broadcast(&emergency_malloc_wait);
+		pthread_mutex_unlock(&emergency_malloc_lock);
 	}
-	assert(buffer >= 0 &&
-	       "Trying to free something that is not an emergency buffer!");
-	// emergency_malloc() is expected to return 0-initialized data.  We don't
-	// zero the buffer when allocating it, because the static buffers will
-	// begin life containing 0 values.
-	memset(ptr, 0, 1024);
-	// Signal the condition variable to wake up any threads that are blocking
-	// waiting for some space in the emergency buffer
-	pthread_mutex_lock(&emergency_malloc_lock);
-	// In theory, we don't need to do this with the lock held.  In practice,
-	// our array of bools will probably be updated using 32-bit or 64-bit
-	// memory operations, so this update may clobber adjacent values.
-	buffer_allocated[buffer] = false;
-	pthread_cond_signal(&emergency_malloc_wait);
-	pthread_mutex_unlock(&emergency_malloc_lock);
 }
 
 static char *alloc_or_die(size_t size)
 {
-	char *buffer = static_cast<char*>(calloc(1, size));
+	ensure_emergency_reserve();
+	char *buffer = malloc_exception(size);
 
-	// If calloc() doesn't want to give us any memory, try using an emergency
+	// If malloc() doesn't want to give us any memory, try using an emergency
 	// buffer.
 	if (0 == buffer)
 	{
 		buffer = emergency_malloc(size);
-		// This is only reached if the allocation is greater than 1KB, and
-		// anyone throwing objects that big really should know better.  
+		// This is only reached if the allocation is larger than the
+		// emergency reserve, and anyone throwing objects that big really
+		// should know better.
 		if (0 == buffer)
 		{
 			fprintf(stderr, "Out of memory attempting to allocate exception\n");
@@ -658,14 +1188,13 @@ static void free_exception(char *e)
 {
 	// If this allocation is within the address range of the emergency buffer,
 	// don't call free() because it was not allocated with malloc()
-	if ((e >= emergency_buffer) &&
-	    (e < (emergency_buffer + sizeof(emergency_buffer))))
+	if ((e >= emergency_buffer) && (e < emergency_buffer_end))
 	{
 		emergency_malloc_free(e);
 	}
 	else
 	{
-		free(e);
+		free_exception_block(e);
 	}
 }
 #endif
@@ -680,6 +1209,9 @@ extern "C" void *__cxa_allocate_exception(size_t thrown_size) _LIBCXXRT_NOEXCEPT
 {
 	size_t size = thrown_size + sizeof(__cxa_exception);
 	char *buffer = alloc_or_die(size);
+	// Only the header needs to be zeroed.  The compiler will construct the
+	// thrown object in the remainder of the buffer.
+	memset(buffer, 0, sizeof(__cxa_exception));
 	return buffer+sizeof(__cxa_exception);
 }
 
@@ -687,6 +1219,7 @@ extern "C" void *__cxa_allocate_dependent_exception(void)
 {
 	size_t size = sizeof(__cxa_dependent_exception);
 	char *buffer = alloc_or_die(size);
+	memset(buffer, 0, sizeof(__cxa_dependent_exception));
 	return buffer+sizeof(__cxa_dependent_exception);
 }
 
@@ -777,6 +1310,128 @@ static void report_failure(_Unwind_Reason_Code err, __cxa_exception *thrown_exce
 	std::terminate();
 }
 
+#ifdef LIBCXXRT_HANDLER_CACHE
+#ifndef LIBCXXRT_HANDLER_CACHE_SIZE
+/**
+ * The number of entries in the handler cache.  Must be a power of two.
+ */
+#define LIBCXXRT_HANDLER_CACHE_SIZE 256
+#endif
+/**
+ * Classification stored in the handler cache for an instruction pointer that
+ * is not covered by the call-site table.  The other classifications are the
+ * values of handler_type.
+ */
+static const uintptr_t handler_no_callsite = 3;
+/**
+ * Flag stored with the classification in the handler cache, indicating that
+ * the action record set the adjusted pointer.
+ */
+static const uintptr_t handler_adjusted = 4;
+/**
+ * Cache of the results of searching a frame for a handler.  The key is the
+ * instruction pointer, the LSDA and the type of the thrown object.  The value
+ * is the classification, the landing pad, the action record, the selector,
+ * the offset of the adjusted pointer from the thrown object and the unload
+ * epoch when the entry was added.
+ */
+static lookup_cache<3, 6, LIBCXXRT_HANDLER_CACHE_SIZE> handler_cache;
+#endif
+
+#ifdef LIBCXXRT_TRACK_UNLOADS
+/**
+ * One more than the number of shared objects that have been unloaded, as last
+ * seen by any thread, or zero if the C library does not report it.
+ * Unloading a shared object invalidates everything that the handler cache and
+ * the exception index know about it, because another one may later be loaded
+ * at the same address.
+ *
+ * Reading the count takes the loader lock, so it is only done when a cached
+ * result is about to be used, and then at most once for each exception that
+ * a thread unwinds.
+ */
+static atomic<unsigned long> unload_epoch{0};
+
+/**
+ * dl_iterate_phdr() callback that records the number of shared objects that
+ * have been unloaded.  This is the same for every object, so the iteration
+ * stops after the first.
+ */
+static int record_unload_count(struct dl_phdr_info *info, size_t size, void *data)
+{
+	if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs))
+	{
+		*static_cast<unsigned long*>(data) = info->dlpi_subs + 1;
+	}
+	return 1;
+}
+
+/**
+ * Updates the unload epoch.
+ */
+static void sync_unload_epoch()
+{
+	unsigned long epoch = 0;
+	dl_iterate_phdr(record_unload_count, &epoch);
+	unsigned long old = unload_epoch.load(acquire);
+	// Another thread may have seen a later count, don't go backwards.
+	while ((old < epoch) && !unload_epoch.compare_exchange(old, epoch)) {}
+}
+
+/**
+ * Records that the personality function has been called for exceptionObject.
+ * If this is a different exception from last time, the unload epoch must be
+ * checked again before cached results are used.
+ */
+static void note_unwinding_exception(_Unwind_Exception *exceptionObject)
+{
+	__cxa_thread_info *info = thread_info();
+	if (info->unwindingException != exceptionObject)
+	{
+		info->unwindingException = exceptionObject;
+		info->unloadEpochChecked = false;
+	}
+}
+
+/**
+ * Forgets the exception being unwound, so that the next one is treated as new
+ * even if it is at the same address.  Called when an exception is thrown,
+ * rethrown or caught.
+ */
+static void forget_unwinding_exception(__cxa_thread_info *info)
+{
+	info->unwindingException = 0;
+}
+
+/**
+ * Returns the unload epoch, bringing it up to date first if that has not
+ * been done since the personality function started on the current exception.
+ * Use this before trusting anything cached with an earlier epoch.
+ */
+static unsigned long checked_unload_epoch()
+{
+	__cxa_thread_info *info = thread_info_fast();
+	if (!info->unloadEpochChecked)
+	{
+		sync_unload_epoch();
+		info->unloadEpochChecked = true;
+	}
+	return unload_epoch.load(acquire);
+}
+
+/**
+ * Returns an unload epoch to record with a newly cached result.  This may be
+ * out of date, which only means that the result will be checked again the
+ * next time that it is used.  A result computed while unwinding through an
+ * object is valid as long as that object has not been unloaded since.
+ */
+static unsigned long recorded_unload_epoch()
+{
+	unsigned long epoch = unload_epoch.load(acquire);
+	return (0 != epoch) ? epoch : checked_unload_epoch();
+}
+#endif
+
 static void throw_exception(__cxa_exception *ex)
 {
 	__cxa_thread_info *info = thread_info();
@@ -791,6 +1446,9 @@ static void throw_exception(__cxa_exception *ex)
 		ex->terminateHandler = terminateHandler.load();
 	}
 	info->globals.uncaughtExceptions++;
+#ifdef LIBCXXRT_TRACK_UNLOADS
+	forget_unwinding_exception(info);
+#endif
 
 	_Unwind_Reason_Code err = _Unwind_RaiseException(&ex->unwindHeader);
 	// The _Unwind_RaiseException() function should not return, it should
@@ -922,6 +1580,9 @@ extern "C" void __cxa_rethrow()
 	// exception was rethrown and exception object should not be destroyed
 	// when handler count become zero
 	ex->handlerCount = -ex->handlerCount;
+#ifdef LIBCXXRT_TRACK_UNLOADS
+	forget_unwinding_exception(ti);
+#endif
 
 	// Continue unwinding the stack with this exception.  This should unwind to
 	// the place in the caller where __cxa_end_catch() is called.  The caller
@@ -956,6 +1617,41 @@ static std::type_info *get_type_info_entry(_Unwind_Context *context,
 
 
 
+#ifdef LIBCXXRT_TYPE_MATCH_CACHE
+#ifndef LIBCXXRT_TYPE_MATCH_CACHE_SIZE
+/**
+ * The number of entries in the type match cache.  Must be a power of two.
+ */
+#define LIBCXXRT_TYPE_MATCH_CACHE_SIZE 512
+#endif
+/**
+ * Results stored in the type match cache.
+ */
+enum type_match
+{
+	/**
+	 * The handler does not match the thrown type.
+	 */
+	type_match_none = 1,
+	/**
+	 * The handler matches, and the adjusted pointer is always at the cached
+	 * offset from the thrown object.
+	 */
+	type_match_offset,
+	/**
+	 * The handler matches, but the adjusted pointer depends on the object,
+	 * so must be found by calling __do_catch().
+	 */
+	type_match_dynamic
+};
+/**
+ * Cache of the results of __do_catch().  The key is the thrown type and the
+ * handler type.  The value is a type_match, the offset of the adjusted pointer
+ * for type_match_offset, and the unload epoch when the entry was added.
+ */
+static lookup_cache<2, 3, LIBCXXRT_TYPE_MATCH_CACHE_SIZE> type_match_cache;
+#endif
+
 /**
  * Checks the type signature found in a handler against the type of the thrown
  * object.  If ex is 0 then it is assumed to be a foreign exception and only
@@ -996,7 +1692,45 @@ static bool check_type_signature(__cxa_exception *ex,
 	}
 
 
+#ifdef LIBCXXRT_TYPE_MATCH_CACHE
+	// Pointers are never given a cached offset, because a null pointer must
+	// not be adjusted.  Classes with virtual bases find them via the vtable.
+	uintptr_t key[2] = { reinterpret_cast<uintptr_t>(ex_type),
+	                     reinterpret_cast<uintptr_t>(type) };
+	uintptr_t value[3];
+	bool cached = type_match_cache.lookup(key, value) && (0 != value[2]) &&
+		(value[2] == checked_unload_epoch());
+	if (cached)
+	{
+		if (value[0] == type_match_none) { return false; }
+		if (value[0] == type_match_offset)
+		{
+			adjustedPtr = static_cast<char*>(exception_ptr) +
+				static_cast<ptrdiff_t>(value[1]);
+			return true;
+		}
+	}
+	void *thrown_ptr = exception_ptr;
+	bool matched = type->__do_catch(ex_type, &exception_ptr, 1);
+	unsigned long epoch = cached ? 0 : recorded_unload_epoch();
+	if (0 != epoch)
+	{
+		value[0] = type_match_none;
+		value[1] = 0;
+		if (matched)
+		{
+			value[0] = (is_ptr || __has_virtual_base(ex_type)) ?
+				type_match_dynamic : type_match_offset;
+			value[1] = static_cast<uintptr_t>(static_cast<char*>(exception_ptr) -
+				static_cast<char*>(thrown_ptr));
+		}
+		value[2] = epoch;
+		type_match_cache.insert(key, value);
+	}
+	if (matched)
+#else
 	if (type->__do_catch(ex_type, &exception_ptr, 1))
+#endif
 	{
 		adjustedPtr = exception_ptr;
 		return true;
@@ -1085,6 +1819,136 @@ static handler_type check_action_record(_Unwind_Context *context,
 	return found;
 }
 
+/**
+ * Decodes the LSDA for this frame and finds the call site for the current
+ * instruction pointer.  Returns false if there isn't one.
+ */
+static bool find_callsite(_Unwind_Context *context,
+                          unsigned char *lsda_addr,
+                          dwarf_eh_lsda &lsda,
+                          dwarf_eh_action &action)
+{
+#ifdef LIBCXXRT_EH_INDEX
+	switch (eh_index_lookup(context, lsda_addr, checked_unload_epoch(),
+	                        &lsda, &action))
+	{
+		case eh_index_found:
+			return true;
+		case eh_index_no_callsite:
+			return false;
+		case eh_index_miss:
+			break;
+	}
+#endif
+	lsda = parse_lsda(context, lsda_addr);
+	return dwarf_eh_find_callsite(context, &lsda, &action);
+}
+
+#ifdef LIBCXXRT_HANDLER_CACHE
+/**
+ * Searches the call-site and action tables for this frame.  Returns false if
+ * the instruction pointer is not covered by the call-site table, otherwise
+ * returns true and sets found to the kind of handler.
+ *
+ * C++ exceptions of non-pointer types are looked up in the handler cache
+ * first.  The result of matching a pointer depends on its value, not just its
+ * type, so these are never cached.
+ */
+static bool search_frame(_Unwind_Context *context,
+                         unsigned char *lsda_addr,
+                         __cxa_exception *realEx,
+                         dwarf_eh_action &action,
+                         unsigned long &selector,
+                         handler_type &found,
+                         void *&adjustedPtr)
+{
+	uintptr_t key[3];
+	uintptr_t value[6];
+	bool cacheable = (0 != realEx) &&
+		!realEx->exceptionType->__is_pointer_p();
+	char *thrown = reinterpret_cast<char*>(realEx + 1);
+	if (cacheable)
+	{
+		key[0] = static_cast<uintptr_t>(_Unwind_GetIP(context));
+		key[1] = reinterpret_cast<uintptr_t>(lsda_addr);
+		key[2] = reinterpret_cast<uintptr_t>(realEx->exceptionType);
+		if (handler_cache.lookup(key, value) && (0 != value[5]) &&
+		    (value[5] == checked_unload_epoch()))
+		{
+			action.landing_pad = reinterpret_cast<dw_eh_ptr_t>(value[1]);
+			action.action_record = reinterpret_cast<dw_eh_ptr_t>(value[2]);
+			selector = value[3];
+			if (value[0] & handler_adjusted)
+			{
+				adjustedPtr = thrown + static_cast<ptrdiff_t>(value[4]);
+			}
+			if ((value[0] & 3) == handler_no_callsite) { return false; }
+			found = static_cast<handler_type>(value[0] & 3);
+			return true;
+		}
+	}
+	struct dwarf_eh_lsda lsda;
+	if (!find_callsite(context, lsda_addr, lsda, action))
+	{
+		unsigned long epoch = cacheable ? recorded_unload_epoch() : 0;
+		if (0 != epoch)
+		{
+			uintptr_t none[6] = { handler_no_callsite, 0, 0, 0, 0, epoch };
+			handler_cache.insert(key, none);
+		}
+		return false;
+	}
+	if (!cacheable)
+	{
+		found = check_action_record(context, &lsda, action.action_record,
+				realEx, &selector, adjustedPtr);
+		return true;
+	}
+	// The adjusted pointer for a non-pointer type is never null, so this
+	// tells us whether the action record set it.
+	void *adjusted = 0;
+	found = check_action_record(context, &lsda, action.action_record, realEx,
+			&selector, adjusted);
+	value[0] = found;
+	value[1] = reinterpret_cast<uintptr_t>(action.landing_pad);
+	value[2] = reinterpret_cast<uintptr_t>(action.action_record);
+	value[3] = selector;
+	value[4] = 0;
+	if (adjusted)
+	{
+		adjustedPtr = adjusted;
+		value[0] |= handler_adjusted;
+		value[4] = static_cast<uintptr_t>(static_cast<char*>(adjusted) - thrown);
+	}
+	value[5] = recorded_unload_epoch();
+	if (0 != value[5])
+	{
+		handler_cache.insert(key, value);
+	}
+	return true;
+}
+#else
+/**
+ * Searches the call-site and action tables for this frame.  Returns false if
+ * the instruction pointer is not covered by the call-site table, otherwise
+ * returns true and sets found to the kind of handler.
+ */
+static bool search_frame(_Unwind_Context *context,
+                         unsigned char *lsda_addr,
+                         __cxa_exception *realEx,
+                         dwarf_eh_action &action,
+                         unsigned long &selector,
+                         handler_type &found,
+                         void *&adjustedPtr)
+{
+	struct dwarf_eh_lsda lsda;
+	if (!find_callsite(context, lsda_addr, lsda, action)) { return false; }
+	found = check_action_record(context, &lsda, action.action_record, realEx,
+			&selector, adjustedPtr);
+	return true;
+}
+#endif
+
 static void pushCleanupException(_Unwind_Exception *exceptionObject,
                                  __cxa_exception *ex)
 {
@@ -1132,6 +1996,9 @@ BEGIN_PERSONALITY_FUNCTION(__gxx_personality_v0)
 		ex = exceptionFromPointer(exceptionObject);
 		realEx = realExceptionFromException(ex);
 	}
+#ifdef LIBCXXRT_TRACK_UNLOADS
+	note_unwinding_exception(exceptionObject);
+#endif
 
 #if defined(__arm__) && !defined(__ARM_DWARF_EH__)
 	unsigned char *lsda_addr =
@@ -1165,9 +2032,9 @@ BEGIN_PERSONALITY_FUNCTION(__gxx_personality_v0)
 	// look it up again from the action table.
 	if (actions & _UA_SEARCH_PHASE)
 	{
-		struct dwarf_eh_lsda lsda = parse_lsda(context, lsda_addr);
-
-		if (!dwarf_eh_find_callsite(context, &lsda, &action))
+		handler_type found_handler = handler_none;
+		if (!search_frame(context, lsda_addr, realEx, action, selector,
+		                  found_handler, ex->adjustedPtr))
 		{
 			// EH range not found. This happens if exception is thrown and not
 			// caught inside a cleanup (destructor).  We should call
@@ -1177,8 +2044,6 @@ BEGIN_PERSONALITY_FUNCTION(__gxx_personality_v0)
 			return _URC_HANDLER_FOUND;
 		}
 
-		handler_type found_handler = check_action_record(context, &lsda,
-				action.action_record, realEx, &selector, ex->adjustedPtr);
 		// If there's no action record, we've only found a cleanup, so keep
 		// searching for something real
 		if (found_handler == handler_catch)
@@ -1205,11 +2070,10 @@ BEGIN_PERSONALITY_FUNCTION(__gxx_personality_v0)
 	if (!(actions & _UA_HANDLER_FRAME))
 	{
 		// cleanup
-		struct dwarf_eh_lsda lsda = parse_lsda(context, lsda_addr);
-		dwarf_eh_find_callsite(context, &lsda, &action);
+		handler_type found_handler = handler_none;
+		search_frame(context, lsda_addr, realEx, action, selector,
+		             found_handler, ex->adjustedPtr);
 		if (0 == action.landing_pad) { return continueUnwinding(exceptionObject, context); }
-		handler_type found_handler = check_action_record(context, &lsda,
-				action.action_record, realEx, &selector, ex->adjustedPtr);
 		// Ignore handlers this time.
 		if (found_handler != handler_cleanup) { return continueUnwinding(exceptionObject, context); }
 		pushCleanupException(exceptionObject, ex);
@@ -1261,6 +2125,9 @@ extern "C" void *__cxa_begin_catch(void *e)
 	__cxa_thread_info *ti = thread_info();
 	__cxa_eh_globals *globals = &ti->globals;
 	_Unwind_Exception *exceptionObject = static_cast<_Unwind_Exception*>(e);
+#ifdef LIBCXXRT_TRACK_UNLOADS
+	forget_unwinding_exception(ti);
+#endif
 
 	if (isCXXException(exceptionObject->exception_class))
 	{
@@ -1497,6 +2364,34 @@ namespace pathscale
 		info->terminateHandler = f;
 		return old;
 	}
+	/**
+	 * Configures the emergency exception reserve.
+	 */
+	bool set_emergency_reserve(size_t size,
+	                           size_t slots,
+	                           int per_thread_limit) _LIBCXXRT_NOEXCEPT
+	{
+#ifdef LIBCXXRT_NO_EMERGENCY_MALLOC
+		return false;
+#else
+		if (!valid_emergency_reserve(size, slots, per_thread_limit))
+		{
+			return false;
+		}
+		bool configured = false;
+		pthread_mutex_lock(&emergency_malloc_lock);
+		if (!emergency_reserve_created.load())
+		{
+			emergency_reserve_size = size;
+			emergency_granules = slots;
+			emergency_per_thread_limit = per_thread_limit;
+			emergency_reserve_configured = true;
+			configured = true;
+		}
+		pthread_mutex_unlock(&emergency_malloc_lock);
+		return configured;
+#endif
+	}
 }
 
 namespace std
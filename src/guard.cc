@@ -42,10 +42,22 @@
  * initialised.
  */
 #include "atomic.h"
+#include "cxxabi.h"
 #include <assert.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
+#ifdef LIBCXXRT_GUARD_PROFILE
+#	include <dlfcn.h>
+#	include <stdio.h>
+#	include <string.h>
+#	include <time.h>
+#endif
+#ifdef __linux__
+#	include <linux/futex.h>
+#	include <sys/syscall.h>
+#	include <unistd.h>
+#endif
 
 // Older GCC doesn't define __LITTLE_ENDIAN__
 #ifndef __LITTLE_ENDIAN__
@@ -75,9 +87,41 @@
  * locking by loading the guard word and, if it is not initialised, trying to
  * transition the lock word from the unlocked to locked state, and then
  * manipulate the guard word.
+ *
+ * A third bit, in the same 32-bit half as the lock bit, records that threads
+ * are waiting for the lock.  On Linux, waiters sleep on a futex on that half
+ * and are woken when the lock is released.  Elsewhere, they fall back to
+ * yielding and retrying.
  */
 namespace
 {
+	/**
+	 * Sleeps until the 32-bit word at addr might no longer contain expected.
+	 * May return spuriously.
+	 */
+	void wait_on_word(uint32_t *addr, uint32_t expected)
+	{
+#ifdef __linux__
+		syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#else
+		(void)addr;
+		(void)expected;
+		sched_yield();
+#endif
+	}
+
+	/**
+	 * Wakes all threads sleeping in wait_on_word() on addr.
+	 */
+	void wake_word(uint32_t *addr)
+	{
+#ifdef __linux__
+		syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+#else
+		(void)addr;
+#endif
+	}
+
 	/**
 	 * The state of the guard variable when an attempt is made to lock it.
 	 */
@@ -104,11 +148,14 @@ namespace
 	 * Class encapsulating a single atomic word being used to represent the
 	 * guard.  The word size is defined by the type of `GuardWord`.  The bit
 	 * used to indicate the locked state is `1<<LockedBit`, the bit used to
-	 * indicate the initialised state is `1<<InitBit`.
+	 * indicate the initialised state is `1<<InitBit`, and the bit used to
+	 * indicate that there are waiters is `1<<WaitingBit`.
 	 */
-	template<typename GuardWord, int LockedBit, int InitBit>
+	template<typename GuardWord, int LockedBit, int InitBit, int WaitingBit>
 	struct SingleWordGuard
 	{
+		static_assert(LockedBit / 32 == WaitingBit / 32,
+		              "Lock and waiting bits must be in the same 32-bit half");
 		/**
 		 * The value indicating that the lock bit is set (and no other bits).
 		 */
@@ -122,19 +169,55 @@ namespace
 		static constexpr GuardWord initialised = static_cast<GuardWord>(1)
 		                                         << InitBit;
 
+		/**
+		 * The value indicating that other threads are waiting for the lock.
+		 */
+		static constexpr GuardWord waiting = static_cast<GuardWord>(1)
+		                                     << WaitingBit;
+
+		/**
+		 * The shift that moves the 32-bit half containing the lock and
+		 * waiting bits into the low bits.
+		 */
+		static constexpr int lock_half_shift = (LockedBit / 32) * 32;
+
 		/**
 		 * The guard variable.
 		 */
 		atomic<GuardWord> val;
 
+		/**
+		 * Returns the address of the 32-bit half of the guard word that holds
+		 * the lock and waiting bits.
+		 */
+		uint32_t *lock_half()
+		{
+			uint32_t *words = reinterpret_cast<uint32_t*>(this);
+			if (sizeof(GuardWord) == sizeof(uint32_t))
+			{
+				return words;
+			}
+#ifdef __LITTLE_ENDIAN__
+			return words + (LockedBit / 32);
+#else
+			return words + 1 - (LockedBit / 32);
+#endif
+		}
+
 		public:
 		/**
 		 * Release the lock and set the initialised state.  In the single-word
-		 * implementation here, these are both done by a single store.
+		 * implementation here, these are both done by a single exchange, which
+		 * also tells us whether anyone needs waking.
 		 */
 		void unlock(bool isInitialised)
 		{
-			val.store(isInitialised ? initialised : 0, memory_order::release);
+			GuardWord old = val.exchange(isInitialised ? initialised : 0,
+			                             memory_order::release);
+			if (old & waiting)
+			{
+				wake_word(lock_half());
+			}
 #ifndef NDEBUG
 			GuardWord init_state = initialised;
 			assert(*reinterpret_cast<uint8_t*>(&init_state) != 0);
@@ -147,13 +230,15 @@ namespace
 		 * contended, or it wasn't acquired because the guarded variable is
 		 * already initialised.
 		 */
-		GuardState try_lock()
+		GuardState try_lock(bool hasWaited)
 		{
 			GuardWord old = 0;
 			// Try to acquire the lock, assuming that we are in the state where
 			// the lock is not held and the variable is not initialised (so the
-			// expected value is 0).
-			if (val.compare_exchange(old, locked))
+			// expected value is 0).  A thread that has waited can't tell
+			// whether others are still waiting, so it must assume that they
+			// are.
+			if (val.compare_exchange(old, hasWaited ? locked | waiting : locked))
 			{
 				return GuardState::InitLockSucceeded;
 			}
@@ -168,6 +253,35 @@ namespace
 			return GuardState::InitLockFailed;
 		}
 
+		/**
+		 * Wait until the lock might have been released.  Sets the waiting
+		 * bit, so that the holder wakes us when it releases the lock.
+		 */
+		void wait()
+		{
+			GuardWord old = val.load(memory_order::acquire);
+			while ((old & locked) && !(old & waiting))
+			{
+				if (val.compare_exchange(old, old | waiting))
+				{
+					old |= waiting;
+				}
+			}
+			if (old & locked)
+			{
+				wait_on_word(lock_half(),
+				             static_cast<uint32_t>(old >> lock_half_shift));
+			}
+		}
+
+		/**
+		 * Check whether another thread currently holds the lock.
+		 */
+		bool is_locked()
+		{
+			return (val.load(memory_order::acquire) & locked) == locked;
+		}
+
 		/**
 		 * Check whether the guard indicates that the variable is initialised.
 		 */
@@ -182,7 +296,7 @@ namespace
 	 * Class encapsulating using two 32-bit atomic values to represent a 64-bit
 	 * guard variable.
 	 */
-	template<int LockedBit, int InitBit>
+	template<int LockedBit, int InitBit, int WaitingBit>
 	class DoubleWordGuard
 	{
 		/**
@@ -197,6 +311,13 @@ namespace
 		static constexpr uint32_t initialised = static_cast<uint32_t>(1)
 		                                        << InitBit;
 
+		/**
+		 * The bit in `lock_word` indicating that other threads are waiting
+		 * for the lock.
+		 */
+		static constexpr uint32_t waiting = static_cast<uint32_t>(1)
+		                                    << WaitingBit;
+
 		/**
 		 * The word used for the initialised flag.  This is always the first
 		 * word irrespective of endian because the generated code compares the
@@ -216,11 +337,13 @@ namespace
 		 * contended, or it wasn't acquired because the guarded variable is
 		 * already initialised.
 		 */
-		GuardState try_lock()
+		GuardState try_lock(bool hasWaited)
 		{
 			uint32_t old = 0;
-			// Try to acquire the lock
-			if (lock_word.compare_exchange(old, locked))
+			// Try to acquire the lock.  A thread that has waited can't tell
+			// whether others are still waiting, so it must assume that they
+			// are.
+			if (lock_word.compare_exchange(old, hasWaited ? locked | waiting : locked))
 			{
 				// If we succeeded, check if initialisation has happened.  In
 				// this version, we don't have atomic manipulation of both the
@@ -232,7 +355,7 @@ namespace
 					// If another thread did manage to initialise this, release
 					// the lock and notify the caller that initialisation is
 					// done.
-					lock_word.store(0, memory_order::release);
+					release_lock();
 					return GuardState::InitDone;
 				}
 				return GuardState::InitLockSucceeded;
@@ -249,10 +372,49 @@ namespace
 		{
 			init_word.store(isInitialised ? initialised : 0,
 			                  memory_order::release);
-			lock_word.store(0, memory_order::release);
+			release_lock();
 			assert((*reinterpret_cast<uint8_t*>(this) != 0) == isInitialised);
 		}
 
+		/**
+		 * Release the lock, waking any waiters.
+		 */
+		void release_lock()
+		{
+			if (lock_word.exchange(0, memory_order::release) & waiting)
+			{
+				wake_word(reinterpret_cast<uint32_t*>(&lock_word));
+			}
+		}
+
+		/**
+		 * Wait until the lock might have been released.  Sets the waiting
+		 * bit, so that the holder wakes us when it releases the lock.
+		 */
+		void wait()
+		{
+			uint32_t old = lock_word.load(memory_order::acquire);
+			while ((old & locked) && !(old & waiting))
+			{
+				if (lock_word.compare_exchange(old, old | waiting))
+				{
+					old |= waiting;
+				}
+			}
+			if (old & locked)
+			{
+				wait_on_word(reinterpret_cast<uint32_t*>(&lock_word), old);
+			}
+		}
+
+		/**
+		 * Return whether another thread currently holds the lock.
+		 */
+		bool is_locked()
+		{
+			return (lock_word.load(memory_order::acquire) & locked) == locked;
+		}
+
 		/**
 		 * Return whether the guarded variable is initialised.
 		 */
@@ -264,50 +426,462 @@ namespace
 	};
 
 	// Check that the two implementations are the correct size.
-	static_assert(sizeof(SingleWordGuard<uint32_t, 31, 0>) == sizeof(uint32_t),
+	static_assert(sizeof(SingleWordGuard<uint32_t, 31, 0, 30>) == sizeof(uint32_t),
 	              "Single-word 32-bit guard must be 32 bits");
-	static_assert(sizeof(SingleWordGuard<uint64_t, 63, 0>) == sizeof(uint64_t),
+	static_assert(sizeof(SingleWordGuard<uint64_t, 63, 0, 62>) == sizeof(uint64_t),
 	              "Single-word 64-bit guard must be 64 bits");
-	static_assert(sizeof(DoubleWordGuard<31, 0>) == sizeof(uint64_t),
+	static_assert(sizeof(DoubleWordGuard<31, 0, 30>) == sizeof(uint64_t),
 	              "Double-word guard must be 64 bits");
 
 #ifdef __arm__
 	/**
 	 * The Arm PCS defines a variant of the Itanium ABI with 32-bit lock words.
 	 */
-	using Guard = SingleWordGuard<uint32_t, 31, 0>;
+	using Guard = SingleWordGuard<uint32_t, 31, 0, 30>;
 #elif defined(_LP64)
 #	if defined(__LITTLE_ENDIAN__)
 	/**
 	 * On little-endian 64-bit platforms the guard word is a single 64-bit
 	 * atomic with the lock in the high bit and the initialised flag in the low
-	 * bit.
+	 * bit.  The waiting flag is next to the lock.
 	 */
-	using Guard = SingleWordGuard<uint64_t, 63, 0>;
+	using Guard = SingleWordGuard<uint64_t, 63, 0, 62>;
 #	else
 	/**
 	 * On bit-endian 64-bit platforms, the guard word is a single 64-bit atomic
 	 * with the lock in the low bit and the initialised bit in the highest
-	 * byte.
+	 * byte.  The waiting flag is next to the lock.
 	 */
-	using Guard = SingleWordGuard<uint64_t, 0, 56>;
+	using Guard = SingleWordGuard<uint64_t, 0, 56, 1>;
 #	endif
 #else
 #	if defined(__LITTLE_ENDIAN__)
 	/**
 	 * 32-bit platforms use the same layout as 64-bit.
 	 */
-	using Guard = DoubleWordGuard<31, 0>;
+	using Guard = DoubleWordGuard<31, 0, 30>;
 #	else
 	/**
 	 * 32-bit platforms use the same layout as 64-bit.
 	 */
-	using Guard = DoubleWordGuard<0, 24>;
+	using Guard = DoubleWordGuard<0, 24, 1>;
 #	endif
 #endif
 
+#ifndef LIBCXXRT_GUARD_SPIN
+	/**
+	 * The default number of pause instructions that a thread will execute
+	 * waiting for a contended guard to be released before it goes to sleep.
+	 * Can be overridden at run time with the LIBCXXRT_GUARD_SPIN environment
+	 * variable.
+	 */
+#	define LIBCXXRT_GUARD_SPIN 4096
+#endif
+
+	/**
+	 * The maximum number of pause instructions between two checks of the
+	 * guard while spinning.
+	 */
+	constexpr unsigned max_guard_backoff = 64;
+
+	/**
+	 * The spin budget, or -1 if the environment has not yet been checked.
+	 */
+	atomic<long> guard_spin_budget(-1);
+
+	/**
+	 * Returns the number of pause instructions to execute waiting for a
+	 * contended guard before sleeping.
+	 */
+	unsigned long spin_budget()
+	{
+		long budget = guard_spin_budget.load(memory_order::acquire);
+		if (budget < 0)
+		{
+			budget = LIBCXXRT_GUARD_SPIN;
+			const char *env = getenv("LIBCXXRT_GUARD_SPIN");
+			if (env != nullptr)
+			{
+				char *end;
+				long v = strtol(env, &end, 0);
+				if ((end != env) && (v >= 0))
+				{
+					budget = v;
+				}
+			}
+			guard_spin_budget.store(budget, memory_order::release);
+		}
+		return static_cast<unsigned long>(budget);
+	}
+
+	/**
+	 * Hint to the CPU that we are in a spin loop.
+	 */
+	inline void cpu_relax()
+	{
+#if defined(__i386__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__) || (defined(__arm__) && __ARM_ARCH >= 7)
+		__asm__ __volatile__("yield" ::: "memory");
+#elif defined(__powerpc__)
+		__asm__ __volatile__("or 27,27,27" ::: "memory");
+#elif defined(__riscv)
+		__asm__ __volatile__(".insn i 0x0F, 0, x0, x0, 0x010" ::: "memory");
+#else
+		__asm__ __volatile__("" ::: "memory");
+#endif
+	}
+
+	/**
+	 * Spin, with exponential backoff, until the guard is no longer locked or
+	 * the spin budget is exhausted.  Returns true if the lock was seen to be
+	 * released.  The number of pause instructions executed is added to spins.
+	 */
+	bool spin_until_unlocked(Guard *guard_object, unsigned long long &spins)
+	{
+		unsigned long budget = spin_budget();
+		unsigned backoff = 1;
+		while (budget > 0)
+		{
+			if (!guard_object->is_locked())
+			{
+				return true;
+			}
+			unsigned pauses = (backoff < budget) ? backoff : budget;
+			for (unsigned i=0 ; i<pauses ; i++)
+			{
+				cpu_relax();
+			}
+			budget -= pauses;
+			spins += pauses;
+			if (backoff < max_guard_backoff)
+			{
+				backoff *= 2;
+			}
+		}
+		return !guard_object->is_locked();
+	}
+
+#ifdef LIBCXXRT_GUARD_PROFILE
+#ifndef LIBCXXRT_GUARD_PROFILE_SIZE
+	/**
+	 * The maximum number of guards whose contention is recorded.  Must be a
+	 * power of two.
+	 */
+#	define LIBCXXRT_GUARD_PROFILE_SIZE 4096
+#endif
+
+	/**
+	 * Contention recorded for a single guard.  The fields mirror
+	 * pathscale::guard_contention_info.
+	 */
+	struct guard_profile_record
+	{
+		atomic<uintptr_t>          guard;
+		atomic<unsigned long>      acquisitions;
+		atomic<unsigned long>      contended;
+		atomic<unsigned long long> spins;
+		atomic<unsigned long long> wait_nanoseconds;
+		atomic<unsigned long>      initialiser_thread;
+	};
+
+	/**
+	 * Open-addressed hash table of guard records, keyed by guard address.
+	 * Records are claimed with a compare and exchange on the guard field and
+	 * never removed.
+	 */
+	guard_profile_record guard_profile[LIBCXXRT_GUARD_PROFILE_SIZE];
+
+	/**
+	 * Set once the profile dump has been registered, or found not to be
+	 * requested.
+	 */
+	atomic<bool> guard_profile_dump_checked;
+
+	/**
+	 * The path that the profile is written to at exit.
+	 */
+	const char *guard_profile_path;
+
+	/**
+	 * Returns the current value of the monotonic clock, in nanoseconds.
+	 */
+	unsigned long long guard_profile_now()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return static_cast<unsigned long long>(ts.tv_sec) * 1000000000ULL +
+		       ts.tv_nsec;
+	}
+
+	/**
+	 * Returns an identifier for the calling thread, matching the ones shown
+	 * by debuggers where possible.
+	 */
+	unsigned long guard_profile_thread_id()
+	{
+#ifdef __linux__
+		return static_cast<unsigned long>(syscall(SYS_gettid));
+#else
+		return reinterpret_cast<unsigned long>(pthread_self());
+#endif
+	}
+
+	/**
+	 * Returns the record for a guard, claiming one if necessary.  Returns null
+	 * if the table is full.
+	 */
+	guard_profile_record *guard_profile_find(Guard *guard_object)
+	{
+		uintptr_t key = reinterpret_cast<uintptr_t>(guard_object);
+		const size_t mask = LIBCXXRT_GUARD_PROFILE_SIZE - 1;
+		size_t i = static_cast<size_t>(
+		  (static_cast<uint64_t>(key >> 3) * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+		for (size_t probe=0 ; probe<LIBCXXRT_GUARD_PROFILE_SIZE ; probe++)
+		{
+			guard_profile_record &record = guard_profile[i];
+			uintptr_t existing = record.guard.load(memory_order::acquire);
+			if ((existing == 0) && record.guard.compare_exchange(existing, key))
+			{
+				return &record;
+			}
+			if (existing == key)
+			{
+				return &record;
+			}
+			i = (i + 1) & mask;
+		}
+		return nullptr;
+	}
+
+	/**
+	 * Orders records by decreasing wait time.
+	 */
+	int guard_profile_compare(const void *a, const void *b)
+	{
+		auto *x = static_cast<const pathscale::guard_contention_info*>(a);
+		auto *y = static_cast<const pathscale::guard_contention_info*>(b);
+		if (x->wait_nanoseconds != y->wait_nanoseconds)
+		{
+			return (x->wait_nanoseconds > y->wait_nanoseconds) ? -1 : 1;
+		}
+		return (x->contended > y->contended) ? -1 :
+		       (x->contended < y->contended) ? 1 : 0;
+	}
+
+	/**
+	 * Writes the recorded contention, most contended first, to the file named
+	 * by the LIBCXXRT_GUARD_PROFILE environment variable.  Called at exit.
+	 */
+	void guard_profile_dump()
+	{
+		size_t count = pathscale::guard_contention_stats(nullptr, 0);
+		auto *info = static_cast<pathscale::guard_contention_info*>(
+		  calloc(count, sizeof(pathscale::guard_contention_info)));
+		if ((count > 0) && (info == nullptr))
+		{
+			return;
+		}
+		count = pathscale::guard_contention_stats(info, count);
+		qsort(info, count, sizeof(*info), guard_profile_compare);
+		FILE *out = stderr;
+		if (strcmp(guard_profile_path, "-") != 0)
+		{
+			out = fopen(guard_profile_path, "w");
+			if (out == nullptr)
+			{
+				free(info);
+				return;
+			}
+		}
+		fprintf(out, "# Static initialisation guard contention (%zu guards)\n",
+		        count);
+		fprintf(out, "# acquisitions contended spins wait_ms initialiser_thread "
+		             "guard symbol [object]\n");
+		for (size_t i=0 ; i<count ; i++)
+		{
+			Dl_info dl;
+			const char *symbol = "??";
+			const char *object = "??";
+			char *demangled = nullptr;
+			// Guards for function-local statics usually have local symbols,
+			// which dladdr() can't see, so fall back to the offset in the
+			// object for addr2line.
+			char offset[32];
+			if (dladdr(info[i].guard, &dl) != 0)
+			{
+				if (dl.dli_fname != nullptr)
+				{
+					object = dl.dli_fname;
+				}
+				snprintf(offset, sizeof(offset), "+0x%lx",
+				         static_cast<unsigned long>(
+				           static_cast<const char*>(info[i].guard) -
+				           static_cast<const char*>(dl.dli_fbase)));
+				symbol = offset;
+				if (dl.dli_sname != nullptr)
+				{
+					int status;
+					demangled = abi::__cxa_demangle(dl.dli_sname, nullptr, nullptr,
+					                                &status);
+					symbol = (demangled != nullptr) ? demangled : dl.dli_sname;
+				}
+			}
+			fprintf(out, "%lu %lu %llu %.3f %lu %p %s [%s]\n",
+			        info[i].acquisitions,
+			        info[i].contended,
+			        info[i].spins,
+			        info[i].wait_nanoseconds / 1e6,
+			        info[i].initialiser_thread,
+			        info[i].guard,
+			        symbol,
+			        object);
+			free(demangled);
+		}
+		if (out != stderr)
+		{
+			fclose(out);
+		}
+		free(info);
+	}
+
+	/**
+	 * Registers the profile dump the first time that a guard is recorded, if
+	 * the LIBCXXRT_GUARD_PROFILE environment variable names a file (or is -,
+	 * for standard error).
+	 */
+	void guard_profile_register_dump()
+	{
+		bool checked = false;
+		if (guard_profile_dump_checked.load(memory_order::acquire) ||
+		    !guard_profile_dump_checked.compare_exchange(checked, true))
+		{
+			return;
+		}
+		const char *path = getenv("LIBCXXRT_GUARD_PROFILE");
+		if ((path != nullptr) && (*path != '\0'))
+		{
+			guard_profile_path = path;
+			atexit(guard_profile_dump);
+		}
+	}
+
+	/**
+	 * Accumulates the profile for a single slow-path call to
+	 * __cxa_guard_acquire() and records it on destruction.
+	 */
+	class guard_profile_sample
+	{
+		/**
+		 * The guard being acquired.
+		 */
+		Guard *guard_object;
+		/**
+		 * The time at which the lock was first found to be held, or zero.
+		 */
+		unsigned long long wait_start = 0;
+		/**
+		 * Whether this thread acquired the lock to run the initialiser.
+		 */
+		bool initialiser = false;
+
+		public:
+		/**
+		 * The number of pause instructions executed while waiting.
+		 */
+		unsigned long long spins = 0;
+
+		/**
+		 * Constructor.
+		 */
+		explicit guard_profile_sample(Guard *g) : guard_object(g) {}
+
+		/**
+		 * Notes that the lock was held by another thread.
+		 */
+		void lock_failed()
+		{
+			if (wait_start == 0)
+			{
+				wait_start = guard_profile_now();
+			}
+		}
+
+		/**
+		 * Notes that this thread will run the initialiser.
+		 */
+		void lock_acquired()
+		{
+			initialiser = true;
+		}
+
+		/**
+		 * Destructor.  Adds this sample to the guard's record.
+		 */
+		~guard_profile_sample()
+		{
+			guard_profile_register_dump();
+			guard_profile_record *record = guard_profile_find(guard_object);
+			if (record == nullptr)
+			{
+				return;
+			}
+			record->acquisitions.fetch_add(1);
+			if (wait_start != 0)
+			{
+				record->contended.fetch_add(1);
+				record->spins.fetch_add(spins);
+				record->wait_nanoseconds.fetch_add(guard_profile_now() -
+				                                   wait_start);
+			}
+			if (initialiser)
+			{
+				record->initialiser_thread.store(guard_profile_thread_id(),
+				                                 memory_order::release);
+			}
+		}
+	};
+#endif
+
 } // namespace
 
+namespace pathscale
+{
+	/**
+	 * Reports the recorded guard contention.
+	 */
+	size_t guard_contention_stats(guard_contention_info *info,
+	                              size_t count) _LIBCXXRT_NOEXCEPT
+	{
+		size_t found = 0;
+#ifdef LIBCXXRT_GUARD_PROFILE
+		for (guard_profile_record &record : guard_profile)
+		{
+			uintptr_t guard = record.guard.load(memory_order::acquire);
+			if (guard == 0)
+			{
+				continue;
+			}
+			if (found < count)
+			{
+				guard_contention_info &out = info[found];
+				out.guard = reinterpret_cast<const void*>(guard);
+				out.acquisitions = record.acquisitions.load();
+				out.contended = record.contended.load();
+				out.spins = record.spins.load();
+				out.wait_nanoseconds = record.wait_nanoseconds.load();
+				out.initialiser_thread = record.initialiser_thread.load();
+			}
+			found++;
+		}
+#else
+		(void)info;
+		(void)count;
+#endif
+		return found;
+	}
+}
+
 /**
  * Acquires a lock on a guard, returning 0 if the object has already been
  * initialised, and 1 if it has not.  If the object is already constructed then
@@ -321,14 +895,21 @@ extern "C" int __cxa_guard_acquire(Guard *guard_object)
 	{
 		return 0;
 	}
-	// Spin trying to acquire the lock.  If we fail to acquire the lock the
+	// Loop trying to acquire the lock.  If we fail to acquire the lock the
 	// first time then another thread will *probably* initialise it, but if the
 	// constructor throws an exception then we may have to try again in this
 	// thread.
+#ifdef LIBCXXRT_GUARD_PROFILE
+	guard_profile_sample sample(guard_object);
+	unsigned long long &spins = sample.spins;
+#else
+	unsigned long long spins = 0;
+#endif
+	bool hasWaited = false;
 	for (;;)
 	{
 		// Try to acquire the lock.
-		switch (guard_object->try_lock())
+		switch (guard_object->try_lock(hasWaited))
 		{
 			// If we failed to acquire the lock but another thread has
 			// initialised the lock while we were waiting, return immediately
@@ -338,12 +919,24 @@ extern "C" int __cxa_guard_acquire(Guard *guard_object)
 			// If we acquired the lock, return immediately to start
 			// initialisation.
 			case GuardState::InitLockSucceeded:
+#ifdef LIBCXXRT_GUARD_PROFILE
+				sample.lock_acquired();
+#endif
 				return 1;
-			// If we didn't acquire the lock, pause and retry.
+			// If we didn't acquire the lock, wait and retry.
 			case GuardState::InitLockFailed:
 				break;
 		}
-		sched_yield();
+#ifdef LIBCXXRT_GUARD_PROFILE
+		sample.lock_failed();
+#endif
+		// Most initialisers are quick, so spin for a little while before
+		// paying for a trip into the kernel.
+		if (!spin_until_unlocked(guard_object, spins))
+		{
+			guard_object->wait();
+			hasWaited = true;
+		}
 	}
 }
 
@@ -0,0 +1,588 @@
+/**
+ * heap_profile.cc - Sampling heap profiler for operator new.
+ *
+ * Samples are grouped into buckets by allocation stack.  Each bucket counts
+ * the samples allocated from its stack and those still live.  Live samples
+ * are kept in a hash table keyed by address, so that operator delete can find
+ * their bucket.  Both tables are protected by a single lock, which is only
+ * taken when an allocation is sampled or a sampled allocation is freed.
+ *
+ * operator delete must not take the lock for every free while profiling, so
+ * each live sample also increments a counter in a small filter indexed by a
+ * hash of its address.  A free whose filter counter is zero can't be a sample.
+ *
+ * The profile is written in the text format used by gperftools' heap
+ * profiler (heap_v2), which pprof reads.  pprof scales the sampled counts to
+ * estimates of the true totals using the sampling rate in the header.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "atomic.h"
+#include "cxxabi.h"
+#include "heap_profile.h"
+#include "unwind.h"
+
+#ifdef LIBCXXRT_WEAK_LOCKS
+#pragma weak pthread_mutex_lock
+#define pthread_mutex_lock(mtx) do {\
+	if (pthread_mutex_lock) pthread_mutex_lock(mtx);\
+	} while(0)
+#pragma weak pthread_mutex_unlock
+#define pthread_mutex_unlock(mtx) do {\
+	if (pthread_mutex_unlock) pthread_mutex_unlock(mtx);\
+	} while(0)
+#endif
+
+__thread long heap_sample_countdown HEAP_PROFILE_TLS_MODEL;
+
+unsigned long heap_profile_live_samples;
+
+namespace
+{
+	/**
+	 * The maximum number of frames recorded for each sample.
+	 */
+	constexpr int max_depth = 32;
+
+	/**
+	 * The number of chains in each of the hash tables.
+	 */
+	constexpr size_t table_size = 4096;
+
+	/**
+	 * The number of counters in the filter.
+	 */
+	constexpr size_t filter_size = 65536;
+
+	/**
+	 * The default mean number of bytes between samples.
+	 */
+	constexpr long default_sample_rate = 512 * 1024;
+
+	/**
+	 * The allocations from one stack.
+	 */
+	struct heap_bucket
+	{
+		/**
+		 * The next bucket in the same chain.
+		 */
+		heap_bucket *next;
+		/**
+		 * Hash of the stack.
+		 */
+		uintptr_t hash;
+		/**
+		 * The number of frames in the stack.
+		 */
+		int depth;
+		/**
+		 * The return addresses, innermost first.
+		 */
+		void *stack[max_depth];
+		/**
+		 * Samples allocated from this stack.
+		 */
+		size_t allocs;
+		/**
+		 * Total size of the samples allocated from this stack.
+		 */
+		size_t alloc_bytes;
+		/**
+		 * Samples allocated from this stack and not yet freed.
+		 */
+		size_t live;
+		/**
+		 * Total size of the live samples.
+		 */
+		size_t live_bytes;
+	};
+
+	/**
+	 * A sampled allocation that has not been freed.
+	 */
+	struct live_sample
+	{
+		/**
+		 * The next sample in the same chain.
+		 */
+		live_sample *next;
+		/**
+		 * The address returned by operator new.
+		 */
+		void *ptr;
+		/**
+		 * The size requested.
+		 */
+		size_t size;
+		/**
+		 * The bucket for the stack that allocated it.
+		 */
+		heap_bucket *bucket;
+	};
+
+	/**
+	 * Profiling state.
+	 */
+	enum profile_state
+	{
+		/**
+		 * The environment has not been read yet.
+		 */
+		profile_unknown,
+		/**
+		 * Profiling is disabled.
+		 */
+		profile_disabled,
+		/**
+		 * Profiling is enabled.
+		 */
+		profile_enabled
+	};
+
+	/**
+	 * Whether profiling is enabled.
+	 */
+	atomic<profile_state> state{profile_unknown};
+
+	/**
+	 * The mean number of bytes between samples.
+	 */
+	long sample_rate = default_sample_rate;
+
+	/**
+	 * The path that the profile is written to at exit.
+	 */
+	const char *profile_path;
+
+	/**
+	 * Lock protecting the buckets and the live samples.
+	 */
+	pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+	/**
+	 * The buckets, chained by stack hash.
+	 */
+	heap_bucket *buckets[table_size];
+
+	/**
+	 * The live samples, chained by address.
+	 */
+	live_sample *live_samples[table_size];
+
+	/**
+	 * Counts of the live samples whose addresses hash to each entry.
+	 */
+	atomic<uint16_t> filter[filter_size];
+
+	/**
+	 * Whether this thread has chosen its first sampling point.
+	 */
+	__thread bool sampler_started HEAP_PROFILE_TLS_MODEL;
+
+	/**
+	 * Set while this thread is recording a sample, so that any allocation
+	 * made by the unwinder is not itself sampled.
+	 */
+	__thread bool in_sampler HEAP_PROFILE_TLS_MODEL;
+
+	/**
+	 * State of this thread's random number generator.
+	 */
+	__thread uint64_t random_state HEAP_PROFILE_TLS_MODEL;
+
+	/**
+	 * Returns a hash of an address.
+	 */
+	inline uint64_t hash_pointer(const void *ptr)
+	{
+		return (reinterpret_cast<uintptr_t>(ptr) >> 4) * 0x9e3779b97f4a7c15ULL;
+	}
+
+	/**
+	 * Returns the filter counter for an address.
+	 */
+	inline atomic<uint16_t> &filter_for(const void *ptr)
+	{
+		return filter[(hash_pointer(ptr) >> 48) & (filter_size - 1)];
+	}
+
+	/**
+	 * Returns the live sample chain for an address.
+	 */
+	inline live_sample *&live_chain_for(const void *ptr)
+	{
+		return live_samples[(hash_pointer(ptr) >> 32) & (table_size - 1)];
+	}
+
+	/**
+	 * Returns the next value from this thread's random number generator
+	 * (xorshift64*).
+	 */
+	uint64_t next_random()
+	{
+		uint64_t x = random_state;
+		if (x == 0)
+		{
+			struct timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			x = (reinterpret_cast<uintptr_t>(&random_state) ^
+			     static_cast<uint64_t>(ts.tv_nsec) ^
+			     (static_cast<uint64_t>(ts.tv_sec) << 32)) | 1;
+		}
+		x ^= x >> 12;
+		x ^= x << 25;
+		x ^= x >> 27;
+		random_state = x;
+		return x * 0x2545f4914f6cdd1dULL;
+	}
+
+	/**
+	 * Returns the natural logarithm of x, which must be positive.  Accurate
+	 * to about one part in a million, which is plenty for choosing sampling
+	 * intervals, and avoids depending on libm.
+	 */
+	double natural_log(double x)
+	{
+		int exponent = 0;
+		while (x >= 2.0)
+		{
+			x /= 2.0;
+			exponent++;
+		}
+		while (x < 1.0)
+		{
+			x *= 2.0;
+			exponent--;
+		}
+		// ln(x) = 2 atanh((x - 1) / (x + 1)), and the series converges
+		// quickly for x in [1, 2).
+		double z = (x - 1.0) / (x + 1.0);
+		double z2 = z * z;
+		double sum = 0;
+		double term = z;
+		for (int i=1 ; i<16 ; i+=2)
+		{
+			sum += term / i;
+			term *= z2;
+		}
+		return 2.0 * sum + exponent * 0.69314718055994530942;
+	}
+
+	/**
+	 * Returns the number of bytes until the next sample, drawn from an
+	 * exponential distribution with mean sample_rate, so that samples form a
+	 * Poisson process over the bytes allocated.
+	 */
+	long next_sample_interval()
+	{
+		// Uniform in (0, 1].
+		double u = (static_cast<double>(next_random() >> 11) + 1.0) /
+		           9007199254740992.0;
+		double interval = -natural_log(u) * sample_rate;
+		return (interval < 1.0) ? 1 : static_cast<long>(interval);
+	}
+
+	/**
+	 * State for capture_stack()'s callback.
+	 */
+	struct stack_capture
+	{
+		/**
+		 * The return address into operator new from the profiler.  Frames up
+		 * to and including the one with this address are in the unwinder, the
+		 * profiler or operator new, so are not recorded.  Null once it has
+		 * been found.
+		 */
+		void *skip_until;
+		/**
+		 * The number of frames recorded.
+		 */
+		int depth;
+		/**
+		 * The recorded return addresses.
+		 */
+		void *stack[max_depth];
+	};
+
+	/**
+	 * Callback function used with _Unwind_Backtrace() to record a stack.
+	 */
+	_Unwind_Reason_Code record_frame(struct _Unwind_Context *context, void *c)
+	{
+		stack_capture *capture = static_cast<stack_capture*>(c);
+		void *ip = reinterpret_cast<void*>(_Unwind_GetIP(context));
+		if (ip == nullptr)
+		{
+			return _URC_END_OF_STACK;
+		}
+		if (capture->skip_until != nullptr)
+		{
+			if (ip == capture->skip_until)
+			{
+				capture->skip_until = nullptr;
+			}
+			return _URC_NO_REASON;
+		}
+		capture->stack[capture->depth++] = ip;
+		return (capture->depth == max_depth) ? _URC_END_OF_STACK :
+		                                       _URC_NO_REASON;
+	}
+
+	/**
+	 * Returns the bucket for a stack, creating it if necessary.  Must be
+	 * called with the lock held.  Returns null if a new bucket can't be
+	 * allocated.
+	 */
+	heap_bucket *find_bucket(const stack_capture &capture)
+	{
+		uintptr_t hash = 0;
+		for (int i=0 ; i<capture.depth ; i++)
+		{
+			hash = (hash ^ reinterpret_cast<uintptr_t>(capture.stack[i])) *
+			       0x9e3779b97f4a7c15ULL;
+		}
+		heap_bucket *&chain = buckets[(hash >> 32) & (table_size - 1)];
+		for (heap_bucket *b = chain ; b != nullptr ; b = b->next)
+		{
+			if ((b->hash == hash) && (b->depth == capture.depth) &&
+			    (memcmp(b->stack, capture.stack,
+			            capture.depth * sizeof(void*)) == 0))
+			{
+				return b;
+			}
+		}
+		heap_bucket *b = static_cast<heap_bucket*>(calloc(1, sizeof(heap_bucket)));
+		if (b == nullptr)
+		{
+			return nullptr;
+		}
+		b->hash = hash;
+		b->depth = capture.depth;
+		memcpy(b->stack, capture.stack, capture.depth * sizeof(void*));
+		b->next = chain;
+		chain = b;
+		return b;
+	}
+
+	/**
+	 * Writes the profile to an open file.  Must be called with the lock held.
+	 */
+	void write_profile(FILE *out)
+	{
+		size_t live = 0, live_bytes = 0, allocs = 0, alloc_bytes = 0;
+		for (heap_bucket *chain : buckets)
+		{
+			for (heap_bucket *b = chain ; b != nullptr ; b = b->next)
+			{
+				live += b->live;
+				live_bytes += b->live_bytes;
+				allocs += b->allocs;
+				alloc_bytes += b->alloc_bytes;
+			}
+		}
+		fprintf(out, "heap profile: %6zu: %8zu [%6zu: %8zu] @ heap_v2/%ld\n",
+		        live, live_bytes, allocs, alloc_bytes, sample_rate);
+		for (heap_bucket *chain : buckets)
+		{
+			for (heap_bucket *b = chain ; b != nullptr ; b = b->next)
+			{
+				fprintf(out, "%6zu: %8zu [%6zu: %8zu] @",
+				        b->live, b->live_bytes, b->allocs, b->alloc_bytes);
+				for (int i=0 ; i<b->depth ; i++)
+				{
+					fprintf(out, " %p", b->stack[i]);
+				}
+				fputc('\n', out);
+			}
+		}
+		// pprof uses the memory map to symbolise the addresses.
+		FILE *maps = fopen("/proc/self/maps", "r");
+		if (maps != nullptr)
+		{
+			fputs("\nMAPPED_LIBRARIES:\n", out);
+			char buffer[4096];
+			size_t length;
+			while ((length = fread(buffer, 1, sizeof(buffer), maps)) > 0)
+			{
+				fwrite(buffer, 1, length, out);
+			}
+			fclose(maps);
+		}
+	}
+
+	/**
+	 * Writes the profile to the file named by the environment.  Called at
+	 * exit.
+	 */
+	void dump_at_exit()
+	{
+		pathscale::heap_profile_dump(profile_path);
+	}
+
+	/**
+	 * Reads the configuration from the environment, the first time that any
+	 * thread reaches the sampling slow path.
+	 */
+	__attribute__((noinline))
+	profile_state read_configuration()
+	{
+		pthread_mutex_lock(&profile_lock);
+		profile_state s = state.load(memory_order::acquire);
+		if (s == profile_unknown)
+		{
+			s = profile_disabled;
+			const char *path = getenv("LIBCXXRT_HEAP_PROFILE");
+			if ((path != nullptr) && (*path != '\0'))
+			{
+				const char *rate = getenv("LIBCXXRT_HEAP_PROFILE_RATE");
+				if (rate != nullptr)
+				{
+					long r = strtol(rate, nullptr, 0);
+					if (r > 0)
+					{
+						sample_rate = r;
+					}
+				}
+				profile_path = path;
+				atexit(dump_at_exit);
+				s = profile_enabled;
+			}
+			state.store(s, memory_order::release);
+		}
+		pthread_mutex_unlock(&profile_lock);
+		return s;
+	}
+}
+
+__attribute__((noinline))
+void heap_profile_sample(void *ptr, size_t size)
+{
+	profile_state s = state.load(memory_order::acquire);
+	if (s == profile_unknown)
+	{
+		s = read_configuration();
+	}
+	if (s != profile_enabled)
+	{
+		heap_sample_countdown = __LONG_MAX__;
+		return;
+	}
+	if (in_sampler)
+	{
+		// Allocations made while sampling are never sampled.
+		heap_sample_countdown += static_cast<long>(size);
+		return;
+	}
+	if (!sampler_started)
+	{
+		// The countdown started at zero.  Start it at a random point
+		// instead, so that the first allocation isn't always sampled.
+		sampler_started = true;
+		heap_sample_countdown = next_sample_interval() - static_cast<long>(size);
+		if (heap_sample_countdown >= 0)
+		{
+			return;
+		}
+	}
+	// Allocations larger than the sampling interval can cover several
+	// sampling points, but each is recorded once and pprof's scaling accounts
+	// for that.
+	do
+	{
+		heap_sample_countdown += next_sample_interval();
+	} while (heap_sample_countdown < 0);
+
+	in_sampler = true;
+	stack_capture capture;
+	capture.skip_until = __builtin_return_address(0);
+	capture.depth = 0;
+	_Unwind_Backtrace(record_frame, &capture);
+	if (capture.skip_until != nullptr)
+	{
+		// The unwinder didn't report our caller, so record everything.
+		capture.depth = 0;
+		_Unwind_Backtrace(record_frame, &capture);
+	}
+	live_sample *sample = static_cast<live_sample*>(malloc(sizeof(live_sample)));
+	if (sample != nullptr)
+	{
+		pthread_mutex_lock(&profile_lock);
+		heap_bucket *bucket = find_bucket(capture);
+		if (bucket != nullptr)
+		{
+			bucket->allocs++;
+			bucket->alloc_bytes += size;
+			bucket->live++;
+			bucket->live_bytes += size;
+			sample->ptr = ptr;
+			sample->size = size;
+			sample->bucket = bucket;
+			live_sample *&chain = live_chain_for(ptr);
+			sample->next = chain;
+			chain = sample;
+			filter_for(ptr).fetch_add(1);
+			__atomic_fetch_add(&heap_profile_live_samples, 1, __ATOMIC_RELAXED);
+		}
+		else
+		{
+			free(sample);
+		}
+		pthread_mutex_unlock(&profile_lock);
+	}
+	in_sampler = false;
+}
+
+void heap_profile_forget(void *ptr)
+{
+	if ((ptr == nullptr) || (filter_for(ptr).load(memory_order::acquire) == 0))
+	{
+		return;
+	}
+	live_sample *found = nullptr;
+	pthread_mutex_lock(&profile_lock);
+	for (live_sample **p = &live_chain_for(ptr) ; *p != nullptr ; p = &(*p)->next)
+	{
+		if ((*p)->ptr == ptr)
+		{
+			found = *p;
+			*p = found->next;
+			found->bucket->live--;
+			found->bucket->live_bytes -= found->size;
+			filter_for(ptr).fetch_add(static_cast<uint16_t>(-1));
+			__atomic_fetch_sub(&heap_profile_live_samples, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&profile_lock);
+	free(found);
+}
+
+namespace pathscale
+{
+	/**
+	 * Writes the heap profile.
+	 */
+	bool heap_profile_dump(const char *path) _LIBCXXRT_NOEXCEPT
+	{
+		if (state.load(memory_order::acquire) != profile_enabled)
+		{
+			return false;
+		}
+		FILE *out = fopen(path, "w");
+		if (out == nullptr)
+		{
+			return false;
+		}
+		in_sampler = true;
+		pthread_mutex_lock(&profile_lock);
+		write_profile(out);
+		pthread_mutex_unlock(&profile_lock);
+		in_sampler = false;
+		return fclose(out) == 0;
+	}
+}
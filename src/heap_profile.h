@@ -0,0 +1,75 @@
+/**
+ * heap_profile.h - Sampling heap profiler for operator new.
+ *
+ * When LIBCXXRT_HEAP_PROFILE is defined, operator new and operator delete
+ * call the hooks here.  Profiling is enabled at run time by setting the
+ * LIBCXXRT_HEAP_PROFILE environment variable to the path that the profile is
+ * written to at exit.  On average, one allocation is sampled for every
+ * LIBCXXRT_HEAP_PROFILE_RATE bytes allocated (512KB by default), by choosing
+ * the gaps between samples from an exponential distribution.  Sampled
+ * allocations record their stack and are tracked until they are freed.
+ *
+ * When profiling is disabled, the allocation hook is a thread-local decrement
+ * and a branch that is not taken, and the deallocation hook is a load and a
+ * branch that is not taken.
+ */
+#pragma once
+#include <stddef.h>
+
+/**
+ * The TLS model of the profiler's thread-local state.  initial-exec is only
+ * used when LIBCXXRT_TLS_THREAD_INFO opts in to it, because a library using
+ * it may fail to load with dlopen().
+ */
+#ifdef LIBCXXRT_TLS_THREAD_INFO
+#define HEAP_PROFILE_TLS_MODEL __attribute__((tls_model("initial-exec")))
+#else
+#define HEAP_PROFILE_TLS_MODEL
+#endif
+
+/**
+ * The number of bytes that this thread may allocate before the next sample.
+ * When profiling is disabled, this is set so high that it never runs out.
+ */
+extern __thread long heap_sample_countdown HEAP_PROFILE_TLS_MODEL;
+
+/**
+ * The number of sampled allocations that have not yet been freed.  Only
+ * accessed atomically.
+ */
+extern unsigned long heap_profile_live_samples;
+
+/**
+ * Slow path for heap_profile_alloc(), called when the countdown runs out.
+ */
+void heap_profile_sample(void *ptr, size_t size);
+
+/**
+ * Slow path for heap_profile_free(), called while there are live samples.
+ */
+void heap_profile_forget(void *ptr);
+
+/**
+ * Records that operator new has returned size bytes at ptr.
+ */
+__attribute__((always_inline))
+inline void heap_profile_alloc(void *ptr, size_t size)
+{
+	if (__builtin_expect((heap_sample_countdown -= static_cast<long>(size)) < 0, 0))
+	{
+		heap_profile_sample(ptr, size);
+	}
+}
+
+/**
+ * Records that operator delete is about to free ptr.
+ */
+__attribute__((always_inline))
+inline void heap_profile_free(void *ptr)
+{
+	if (__builtin_expect(__atomic_load_n(&heap_profile_live_samples,
+	                                     __ATOMIC_RELAXED) != 0, 0))
+	{
+		heap_profile_forget(ptr);
+	}
+}
@@ -30,10 +30,13 @@
 #include <errno.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "libelftc_dem_gnu3.h"
+
 /**
  * @file cpp_demangle.c
  * @brief Decode IA-64 C++ ABI style implementation.
@@ -44,6 +47,47 @@
  * http://www.codesourcery.com/cxx-abi/abi-mangling.html
  */
 
+/** @brief Size of the buffer that a dem_arena starts with. */
+#define DEM_ARENA_INITIAL	4096
+
+/** @brief Alignment of every allocation from a dem_arena. */
+#define DEM_ARENA_ALIGN		sizeof(void *)
+
+/** @brief Rounds a size up to a multiple of DEM_ARENA_ALIGN. */
+#define DEM_ARENA_ROUND(x)	\
+	(((x) + DEM_ARENA_ALIGN - 1) & ~(DEM_ARENA_ALIGN - 1))
+
+/** @brief Block allocated by a dem_arena once its buffer is full. */
+struct dem_arena_block {
+	/** Previously allocated block */
+	struct dem_arena_block	*next;
+};
+
+/**
+ * @brief Bump allocator for everything built while demangling one name.
+ *
+ * Vectors and the strings in them are never freed individually; all of
+ * their memory is released at once by dem_arena_dest().  Most names fit in
+ * the initial buffer, so demangling them does not call malloc() at all.
+ */
+struct dem_arena {
+	/** Next free byte */
+	char			*cur;
+	/** End of the current buffer */
+	char			*end;
+	/** Most recent allocation, which can be resized in place */
+	char			*last;
+	/** Blocks allocated with malloc(), most recent first */
+	struct dem_arena_block	*blocks;
+	/** Size of the next block to allocate */
+	size_t			 next_size;
+	/** Initial buffer */
+	union {
+		char		 bytes[DEM_ARENA_INITIAL];
+		void		*align;
+	} initial;
+};
+
 /** @brief Dynamic vector data for string. */
 struct vector_str {
 	/** Current size */
@@ -52,6 +96,10 @@ struct vector_str {
 	size_t		capacity;
 	/** String array */
 	char		**container;
+	/** The strings in strcmp() order, or NULL if not indexed */
+	char		**sorted;
+	/** Arena holding the array and the strings */
+	struct dem_arena *arena;
 };
 
 #define BUFFER_GROWFACTOR	1.618
@@ -72,6 +120,7 @@ struct vector_type_qualifier {
 	size_t size, capacity;
 	enum type_qualifier *q_container;
 	struct vector_str ext_name;
+	struct dem_arena *arena;
 };
 
 enum read_cmd {
@@ -87,6 +136,7 @@ struct read_cmd_item {
 struct vector_read_cmd {
 	size_t size, capacity;
 	struct read_cmd_item *r_container;
+	struct dem_arena *arena;
 };
 
 enum push_qualifier {
@@ -95,7 +145,15 @@ enum push_qualifier {
 	PUSH_NON_CV_QUALIFIER,
 };
 
+/** @brief Tokens recorded for a structured demangling. */
+struct vector_token {
+	size_t			 size;
+	size_t			 capacity;
+	struct demangle_token	*container;
+};
+
 struct cpp_demangle_data {
+	struct dem_arena	 arena;		/* vector storage */
 	struct vector_str	 output;	/* output string vector */
 	struct vector_str	 subst;		/* substitution string vector */
 	struct vector_str	 tmpl;
@@ -115,6 +173,8 @@ struct cpp_demangle_data {
 	int			 func_type;
 	const char		*cur;		/* current mangled name ptr */
 	const char		*last_sname;	/* last source name */
+	struct vector_token	 tokens;	/* structured output */
+	bool			 tokens_active;	/* in top-level name */
 };
 
 struct type_delimit {
@@ -134,6 +194,114 @@ struct type_delimit {
 static size_t	get_strlen_sum(const struct vector_str *v);
 static bool	vector_str_grow(struct vector_str *v);
 
+/**
+ * @brief Initialize dem_arena.
+ */
+static void
+dem_arena_init(struct dem_arena *a)
+{
+
+	a->cur = a->initial.bytes;
+	a->end = a->initial.bytes + sizeof(a->initial.bytes);
+	a->last = NULL;
+	a->blocks = NULL;
+	a->next_size = 2 * DEM_ARENA_INITIAL;
+}
+
+/**
+ * @brief Release everything allocated from dem_arena.
+ */
+static void
+dem_arena_dest(struct dem_arena *a)
+{
+	struct dem_arena_block *b;
+
+	if (a == NULL)
+		return;
+
+	while ((b = a->blocks) != NULL) {
+		a->blocks = b->next;
+		free(b);
+	}
+}
+
+/**
+ * @brief Allocate from dem_arena.
+ * @return NULL at failed or memory that lives until dem_arena_dest().
+ */
+static void *
+dem_alloc(struct dem_arena *a, size_t size)
+{
+	struct dem_arena_block *b;
+	size_t b_size;
+
+	if (size > SIZE_MAX / 4)
+		return (NULL);
+
+	size = DEM_ARENA_ROUND(size);
+
+	if (size > (size_t)(a->end - a->cur)) {
+		b_size = a->next_size;
+		while (b_size - sizeof(*b) < size)
+			b_size *= 2;
+		if ((b = malloc(b_size)) == NULL)
+			return (NULL);
+		b->next = a->blocks;
+		a->blocks = b;
+		a->cur = (char *)(b + 1);
+		a->end = (char *)b + b_size;
+		a->next_size = 2 * b_size;
+	}
+
+	a->last = a->cur;
+	a->cur += size;
+
+	return (a->last);
+}
+
+/**
+ * @brief Resize memory from dem_arena.
+ *
+ * The most recent allocation is extended in place if there is room.
+ * Otherwise, the old contents are copied to a new allocation.
+ * @return NULL at failed or the resized memory.
+ */
+static void *
+dem_realloc(struct dem_arena *a, void *p, size_t old_size, size_t size)
+{
+	void *rtn;
+
+	if (p != NULL && p == a->last && size <= SIZE_MAX / 4 &&
+	    DEM_ARENA_ROUND(size) <= (size_t)(a->end - a->last)) {
+		a->cur = a->last + DEM_ARENA_ROUND(size);
+		return (p);
+	}
+
+	if ((rtn = dem_alloc(a, size)) == NULL)
+		return (NULL);
+
+	if (old_size > 0)
+		memcpy(rtn, p, old_size < size ? old_size : size);
+
+	return (rtn);
+}
+
+/**
+ * @brief Give back memory from dem_arena.
+ *
+ * Only the most recent allocation can be reused; anything else is kept
+ * until dem_arena_dest().
+ */
+static void
+dem_free(struct dem_arena *a, void *p)
+{
+
+	if (p != NULL && p == a->last) {
+		a->cur = a->last;
+		a->last = NULL;
+	}
+}
+
 static size_t
 get_strlen_sum(const struct vector_str *v)
 {
@@ -152,23 +320,52 @@ get_strlen_sum(const struct vector_str *v)
 
 /**
  * @brief Deallocate resource in vector_str.
+ *
+ * The strings stay in the arena, because other vectors may share them.
  */
 static void
 vector_str_dest(struct vector_str *v)
 {
-	size_t i;
 
 	if (v == NULL)
 		return;
 
-	for (i = 0; i < v->size; ++i)
-		free(v->container[i]);
+	dem_free(v->arena, v->sorted);
+	dem_free(v->arena, v->container);
+}
+
+/**
+ * @brief Find the first string in the index that does not sort before the
+ * first l characters of o.
+ *
+ * Every string that starts with those characters sorts at or after the
+ * returned position, and the strings that start with them are adjacent.
+ */
+static size_t
+vector_str_index_lower_bound(const struct vector_str *v, const char *o,
+    size_t l)
+{
+	size_t low, high, mid;
+
+	low = 0;
+	high = v->size;
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (strncmp(v->sorted[mid], o, l) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
 
-	free(v->container);
+	return (low);
 }
 
 /**
  * @brief Find string in vector_str.
+ *
+ * Finds whether any string in the vector starts with the first l
+ * characters of o.  Indexed vectors are searched in O(log n) comparisons
+ * rather than by scanning every string.
  * @param v Destination vector.
  * @param o String to find.
  * @param l Length of the string.
@@ -182,6 +379,11 @@ vector_str_find(const struct vector_str *v, const char *o, size_t l)
 	if (v == NULL || o == NULL)
 		return (-1);
 
+	if (v->sorted != NULL) {
+		i = vector_str_index_lower_bound(v, o, l);
+		return (i < v->size && strncmp(v->sorted[i], o, l) == 0);
+	}
+
 	for (i = 0; i < v->size; ++i)
 		if (strncmp(v->container[i], o, l) == 0)
 			return (1);
@@ -189,13 +391,56 @@ vector_str_find(const struct vector_str *v, const char *o, size_t l)
 	return (0);
 }
 
+/**
+ * @brief Add the last string in vector_str to its index.
+ */
+static void
+vector_str_index_push(struct vector_str *v)
+{
+	char *str;
+	size_t low, high, mid;
+
+	str = v->container[v->size - 1];
+	low = 0;
+	high = v->size - 1;
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (strcmp(v->sorted[mid], str) <= 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	memmove(v->sorted + low + 1, v->sorted + low,
+	    sizeof(char *) * (v->size - 1 - low));
+	v->sorted[low] = str;
+}
+
+/**
+ * @brief Remove the last string in vector_str from its index.
+ */
+static void
+vector_str_index_pop(struct vector_str *v)
+{
+	char *str;
+	size_t i;
+
+	str = v->container[v->size - 1];
+	i = vector_str_index_lower_bound(v, str, strlen(str) + 1);
+	while (v->sorted[i] != str)
+		++i;
+
+	memmove(v->sorted + i, v->sorted + i + 1,
+	    sizeof(char *) * (v->size - 1 - i));
+}
+
 /**
  * @brief Get new allocated flat string from vector.
  *
  * If l is not NULL, return length of the string.
  * @param v Destination vector.
  * @param l Length of the string.
- * @return NULL at failed or NUL terminated new allocated string.
+ * @return NULL at failed or NUL terminated string allocated with malloc().
  */
 static char *
 vector_str_get_flat(const struct vector_str *v, size_t *l)
@@ -226,7 +471,7 @@ vector_str_get_flat(const struct vector_str *v, size_t *l)
 static bool
 vector_str_grow(struct vector_str *v)
 {
-	size_t i, tmp_cap;
+	size_t tmp_cap;
 	char **tmp_ctn;
 
 	if (v == NULL)
@@ -238,15 +483,20 @@ vector_str_grow(struct vector_str *v)
 
 	assert(tmp_cap > v->capacity);
 
-	if ((tmp_ctn = malloc(sizeof(char *) * tmp_cap)) == NULL)
+	if ((tmp_ctn = dem_realloc(v->arena, v->container,
+	    sizeof(char *) * v->size, sizeof(char *) * tmp_cap)) == NULL)
 		return (false);
 
-	for (i = 0; i < v->size; ++i)
-		tmp_ctn[i] = v->container[i];
+	v->container = tmp_ctn;
 
-	free(v->container);
+	if (v->sorted != NULL) {
+		if ((tmp_ctn = dem_realloc(v->arena, v->sorted,
+		    sizeof(char *) * v->size, sizeof(char *) * tmp_cap)) ==
+		    NULL)
+			return (false);
+		v->sorted = tmp_ctn;
+	}
 
-	v->container = tmp_ctn;
 	v->capacity = tmp_cap;
 
 	return (true);
@@ -254,21 +504,26 @@ vector_str_grow(struct vector_str *v)
 
 /**
  * @brief Initialize vector_str.
+ * @param v Vector to initialize.
+ * @param a Arena to allocate the vector and its strings from.
  * @return false at failed, true at success.
  */
 static bool
-vector_str_init(struct vector_str *v)
+vector_str_init(struct vector_str *v, struct dem_arena *a)
 {
 
-	if (v == NULL)
+	if (v == NULL || a == NULL)
 		return (false);
 
 	v->size = 0;
 	v->capacity = VECTOR_DEF_CAPACITY;
+	v->sorted = NULL;
+	v->arena = a;
 
 	assert(v->capacity > 0);
 
-	if ((v->container = malloc(sizeof(char *) * v->capacity)) == NULL)
+	if ((v->container = dem_alloc(a, sizeof(char *) * v->capacity)) ==
+	    NULL)
 		return (false);
 
 	assert(v->container != NULL);
@@ -276,6 +531,27 @@ vector_str_init(struct vector_str *v)
 	return (true);
 }
 
+/**
+ * @brief Keep an index of the strings in an empty vector_str.
+ *
+ * Makes vector_str_find() take O(log n) comparisons, for vectors that are
+ * searched before every push.
+ * @return false at failed, true at success.
+ */
+static bool
+vector_str_init_index(struct vector_str *v)
+{
+
+	if (v == NULL || v->size != 0)
+		return (false);
+
+	if ((v->sorted = dem_alloc(v->arena, sizeof(char *) * v->capacity)) ==
+	    NULL)
+		return (false);
+
+	return (true);
+}
+
 /**
  * @brief Remove last element in vector_str.
  * @return false at failed, true at success.
@@ -290,9 +566,11 @@ vector_str_pop(struct vector_str *v)
 	if (v->size == 0)
 		return (true);
 
+	if (v->sorted != NULL)
+		vector_str_index_pop(v);
+
 	--v->size;
 
-	free(v->container[v->size]);
 	v->container[v->size] = NULL;
 
 	return (true);
@@ -327,51 +605,53 @@ vector_str_push(struct vector_str *v, const char *str, size_t len)
 	if (v->size == v->capacity && vector_str_grow(v) == false)
 		return (false);
 
-	if ((v->container[v->size] = malloc(sizeof(char) * (len + 1))) == NULL)
+	if ((v->container[v->size] = dem_alloc(v->arena,
+	    sizeof(char) * (len + 1))) == NULL)
 		return (false);
 
 	copy_string(v->container[v->size], str, len + 1);
 
 	++v->size;
 
+	if (v->sorted != NULL)
+		vector_str_index_push(v);
+
 	return (true);
 }
 
 /**
  * @brief Push front org vector to det vector.
+ *
+ * The strings are shared rather than copied; both vectors must be in the
+ * same arena.
  * @return false at failed, true at success.
  */
 static bool
 vector_str_push_vector_head(struct vector_str *dst, struct vector_str *org)
 {
-	size_t i, j, tmp_cap;
+	size_t tmp_cap;
 	char **tmp_ctn;
 
 	if (dst == NULL || org == NULL)
 		return (false);
 
-	tmp_cap = BUFFER_GROW(dst->size + org->size);
-
-	if ((tmp_ctn = malloc(sizeof(char *) * tmp_cap)) == NULL)
-		return (false);
-
-	for (i = 0; i < org->size; ++i)
-		if ((tmp_ctn[i] = strdup(org->container[i])) == NULL) {
-			for (j = 0; j < i; ++j)
-				free(tmp_ctn[j]);
-
-			free(tmp_ctn);
+	assert(dst->arena == org->arena);
+	assert(dst->sorted == NULL);
 
+	if (dst->size + org->size > dst->capacity) {
+		tmp_cap = BUFFER_GROW(dst->size + org->size);
+		if ((tmp_ctn = dem_alloc(dst->arena, sizeof(char *) * tmp_cap))
+		    == NULL)
 			return (false);
-		}
-
-	for (i = 0; i < dst->size; ++i)
-		tmp_ctn[i + org->size] = dst->container[i];
-
-	free(dst->container);
-
-	dst->container = tmp_ctn;
-	dst->capacity = tmp_cap;
+		memcpy(tmp_ctn + org->size, dst->container,
+		    sizeof(char *) * dst->size);
+		dst->container = tmp_ctn;
+		dst->capacity = tmp_cap;
+	} else
+		memmove(dst->container + org->size, dst->container,
+		    sizeof(char *) * dst->size);
+
+	memcpy(dst->container, org->container, sizeof(char *) * org->size);
 	dst->size += org->size;
 
 	return (true);
@@ -379,50 +659,46 @@ vector_str_push_vector_head(struct vector_str *dst, struct vector_str *org)
 
 /**
  * @brief Push org vector to the tail of det vector.
+ *
+ * The strings are shared rather than copied; both vectors must be in the
+ * same arena.
  * @return false at failed, true at success.
  */
 static bool
 vector_str_push_vector(struct vector_str *dst, struct vector_str *org)
 {
-	size_t i, j, tmp_cap;
+	size_t tmp_cap;
 	char **tmp_ctn;
 
 	if (dst == NULL || org == NULL)
 		return (false);
 
-	tmp_cap = BUFFER_GROW(dst->size + org->size);
-
-	if ((tmp_ctn = malloc(sizeof(char *) * tmp_cap)) == NULL)
-		return (false);
-
-	for (i = 0; i < dst->size; ++i)
-		tmp_ctn[i] = dst->container[i];
-
-	for (i = 0; i < org->size; ++i)
-		if ((tmp_ctn[i + dst->size] = strdup(org->container[i])) ==
-		    NULL) {
-			for (j = 0; j < i + dst->size; ++j)
-				free(tmp_ctn[j]);
-
-			free(tmp_ctn);
+	assert(dst->arena == org->arena);
+	assert(dst->sorted == NULL);
 
+	if (dst->size + org->size > dst->capacity) {
+		tmp_cap = BUFFER_GROW(dst->size + org->size);
+		if ((tmp_ctn = dem_realloc(dst->arena, dst->container,
+		    sizeof(char *) * dst->size, sizeof(char *) * tmp_cap)) ==
+		    NULL)
 			return (false);
-		}
-
-	free(dst->container);
+		dst->container = tmp_ctn;
+		dst->capacity = tmp_cap;
+	}
 
-	dst->container = tmp_ctn;
-	dst->capacity = tmp_cap;
+	memcpy(dst->container + dst->size, org->container,
+	    sizeof(char *) * org->size);
 	dst->size += org->size;
 
 	return (true);
 }
 
 /**
- * @brief Get new allocated flat string from vector between begin and end.
+ * @brief Get flat string from vector between begin and end.
  *
  * If r_len is not NULL, string length will be returned.
- * @return NULL at failed or NUL terminated new allocated string.
+ * @return NULL at failed or NUL terminated string allocated from the
+ * vector's arena.
  */
 static char *
 vector_str_substr(const struct vector_str *v, size_t begin, size_t end,
@@ -438,7 +714,7 @@ vector_str_substr(const struct vector_str *v, size_t begin, size_t end,
 	for (i = begin; i < end + 1; ++i)
 		len += strlen(v->container[i]);
 
-	if ((rtn = malloc(sizeof(char) * (len + 1))) == NULL)
+	if ((rtn = dem_alloc(v->arena, sizeof(char) * (len + 1))) == NULL)
 		return (NULL);
 
 	if (r_len != NULL)
@@ -456,6 +732,8 @@ static int	cpp_demangle_data_init(struct cpp_demangle_data *,
 		    const char *);
 static int	cpp_demangle_get_subst(struct cpp_demangle_data *, size_t);
 static int	cpp_demangle_get_tmpl_param(struct cpp_demangle_data *, size_t);
+static void	cpp_demangle_nested_name_tokens(struct vector_token *, size_t);
+static size_t	cpp_demangle_output_len(const struct cpp_demangle_data *);
 static int	cpp_demangle_push_fp(struct cpp_demangle_data *,
 		    char *(*)(const char *, size_t));
 static int	cpp_demangle_push_str(struct cpp_demangle_data *, const char *,
@@ -465,6 +743,8 @@ static int	cpp_demangle_push_subst(struct cpp_demangle_data *,
 		    const char *, size_t);
 static int	cpp_demangle_push_subst_v(struct cpp_demangle_data *,
 		    struct vector_str *);
+static int	cpp_demangle_push_token(struct cpp_demangle_data *, size_t,
+		    int, size_t, size_t);
 static int	cpp_demangle_push_type_qualifier(struct cpp_demangle_data *,
 		    struct vector_type_qualifier *, const char *);
 static int	cpp_demangle_read_array(struct cpp_demangle_data *);
@@ -496,6 +776,7 @@ static int	cpp_demangle_read_offset_number(struct cpp_demangle_data *);
 static int	cpp_demangle_read_pointer_to_member(struct cpp_demangle_data *,
 		    struct vector_type_qualifier *);
 static int	cpp_demangle_read_sname(struct cpp_demangle_data *);
+static int	cpp_demangle_read_special_type(struct cpp_demangle_data *);
 static int	cpp_demangle_read_subst(struct cpp_demangle_data *);
 static int	cpp_demangle_read_subst_std(struct cpp_demangle_data *);
 static int	cpp_demangle_read_subst_stdtmpl(struct cpp_demangle_data *,
@@ -515,68 +796,85 @@ static char	*decode_fp_to_float128(const char *, size_t);
 static char	*decode_fp_to_float80(const char *, size_t);
 static char	*decode_fp_to_long_double(const char *, size_t);
 static int	hex_to_dec(char);
-static void	vector_read_cmd_dest(struct vector_read_cmd *);
 static struct read_cmd_item *vector_read_cmd_find(struct vector_read_cmd *,
 		    enum read_cmd);
-static int	vector_read_cmd_init(struct vector_read_cmd *);
+static int	vector_read_cmd_init(struct vector_read_cmd *,
+		    struct dem_arena *);
 static int	vector_read_cmd_pop(struct vector_read_cmd *);
 static int	vector_read_cmd_push(struct vector_read_cmd *, enum read_cmd,
 		    void *);
 static void	vector_type_qualifier_dest(struct vector_type_qualifier *);
-static int	vector_type_qualifier_init(struct vector_type_qualifier *);
+static int	vector_type_qualifier_init(struct vector_type_qualifier *,
+		    struct dem_arena *);
 static int	vector_type_qualifier_push(struct vector_type_qualifier *,
 		    enum type_qualifier);
 
 /**
- * @brief Decode the input string by IA-64 C++ ABI style.
+ * @brief Decode the input string by IA-64 C++ ABI style into ddata->output.
  *
- * GNU GCC v3 use IA-64 standard ABI.
- * @return New allocated demangled string or NULL if failed.
+ * GNU GCC v3 use IA-64 standard ABI.  ddata is initialized here and must be
+ * released with cpp_demangle_data_dest() whether or not this succeeds.
+ * @param structured Also record the parts of an encoding in ddata->tokens.
+ * @return 0 at failed, 1 at success.
  * @todo 1. Testing and more test case. 2. Code cleaning.
  */
-char *
-__cxa_demangle_gnu3(const char *org)
+static int
+cpp_demangle_gnu3(struct cpp_demangle_data *ddata, const char *org,
+    bool structured)
 {
-	struct cpp_demangle_data ddata;
 	struct vector_str ret_type;
 	struct type_delimit td;
 	ssize_t org_len;
+	size_t i, len, tok_start;
 	unsigned int limit;
-	char *rtn = NULL;
+	int rtn = 0;
 	bool has_ret = false, more_type = false;
 
-	if (org == NULL)
-		return (NULL);
-
 	org_len = strlen(org);
 	// Try demangling as a type for short encodings
 	if ((org_len < 2) || (org[0] != '_' || org[1] != 'Z' )) {
-		if (!cpp_demangle_data_init(&ddata, org))
-			return (NULL);
-		if (!cpp_demangle_read_type(&ddata, 0))
-			goto clean;
-		rtn = vector_str_get_flat(&ddata.output, (size_t *) NULL);
+		if (!cpp_demangle_data_init(ddata, org))
+			return (0);
+		rtn = cpp_demangle_read_type(ddata, 0);
 		goto clean;
 	}
 	if (org_len > 11 && !strncmp(org, "_GLOBAL__I_", 11)) {
-		if ((rtn = malloc(org_len + 19)) == NULL)
-			return (NULL);
-		snprintf(rtn, org_len + 19,
-		    "global constructors keyed to %s", org + 11);
-		return (rtn);
+		if (!cpp_demangle_data_init(ddata, org))
+			return (0);
+		if (!DEM_PUSH_STR(ddata, "global constructors keyed to "))
+			return (0);
+		return (DEM_PUSH_STR(ddata, org + 11));
 	}
 
-	if (!cpp_demangle_data_init(&ddata, org + 2))
-		return (NULL);
+	if (!cpp_demangle_data_init(ddata, org + 2))
+		return (0);
+
+	ddata->tokens_active = structured;
 
-	if (!cpp_demangle_read_encoding(&ddata))
+	if (!cpp_demangle_read_encoding(ddata))
 		goto clean;
 
+	/*
+	 * Anything before the first token of the name is the description of
+	 * a special name.  A name that could not be split is one token.
+	 */
+	ddata->tokens_active = false;
+	if (structured) {
+		len = cpp_demangle_output_len(ddata);
+		if (ddata->tokens.size == 0) {
+			if (!cpp_demangle_push_token(ddata, 0, DEM_TOKEN_NAME,
+			    0, len))
+				goto clean;
+		} else if (!cpp_demangle_push_token(ddata, 0,
+		    DEM_TOKEN_SPECIAL, 0, ddata->tokens.container[0].offset))
+			goto clean;
+	}
+
 	/*
 	 * Pop function name from substitution candidate list.
 	 */
-	if (*ddata.cur != 0 && ddata.subst.size >= 1) {
-		if (!vector_str_pop(&ddata.subst))
+	if (*ddata->cur != 0 && ddata->subst.size >= 1) {
+		if (!vector_str_pop(&ddata->subst))
 			goto clean;
 	}
 
@@ -589,39 +887,61 @@ __cxa_demangle_gnu3(const char *org)
 	 * args. (the template args is right next to the function name,
 	 * which means it's a template function)
 	 */
-	if (ddata.is_tmpl) {
-		ddata.is_tmpl = false;
-		if (!vector_str_init(&ret_type))
+	if (ddata->is_tmpl) {
+		ddata->is_tmpl = false;
+		if (!vector_str_init(&ret_type, &ddata->arena))
 			goto clean;
-		ddata.cur_output = &ret_type;
+		ddata->cur_output = &ret_type;
 		has_ret = true;
 	}
 
-	while (*ddata.cur != '\0') {
+	while (*ddata->cur != '\0') {
 		/*
 		 * Breaking at some gcc info at tail. e.g) @@GLIBCXX_3.4
 		 */
-		if (*ddata.cur == '@' && *(ddata.cur + 1) == '@')
+		if (*ddata->cur == '@' && *(ddata->cur + 1) == '@')
 			break;
 
 		if (has_ret) {
 			/* Read return type */
-			if (!cpp_demangle_read_type(&ddata, NULL))
+			if (!cpp_demangle_read_type(ddata, NULL))
 				goto clean;
 		} else {
-			/* Read function arg type */
-			if (!cpp_demangle_read_type(&ddata, &td))
+			/* Read function arg type, skipping "(" or ", " */
+			tok_start = 0;
+			if (structured)
+				tok_start = cpp_demangle_output_len(ddata) +
+				    (td.paren ? 0 : 1) +
+				    (!td.firstp && *ddata->cur != 'I' ? 2 : 0);
+			if (!cpp_demangle_read_type(ddata, &td))
 				goto clean;
+			if (structured) {
+				len = cpp_demangle_output_len(ddata);
+				if (len > tok_start &&
+				    !cpp_demangle_push_token(ddata,
+				    ddata->tokens.size, DEM_TOKEN_PARAMETER,
+				    tok_start, len - tok_start))
+					goto clean;
+			}
 		}
 
 		if (has_ret) {
 			/* Push return type to the beginning */
 			if (!VEC_PUSH_STR(&ret_type, " "))
 				goto clean;
-			if (!vector_str_push_vector_head(&ddata.output,
+			if (structured) {
+				len = get_strlen_sum(&ret_type);
+				for (i = 0; i < ddata->tokens.size; ++i)
+					ddata->tokens.container[i].offset +=
+					    len;
+				if (!cpp_demangle_push_token(ddata, 0,
+				    DEM_TOKEN_RETURN_TYPE, 0, len - 1))
+					goto clean;
+			}
+			if (!vector_str_push_vector_head(&ddata->output,
 			    &ret_type))
 				goto clean;
-			ddata.cur_output = &ddata.output;
+			ddata->cur_output = &ddata->output;
 			vector_str_dest(&ret_type);
 			has_ret = false;
 			more_type = true;
@@ -633,32 +953,225 @@ __cxa_demangle_gnu3(const char *org)
 	if (more_type)
 		goto clean;
 
-	if (ddata.output.size == 0)
+	if (ddata->output.size == 0)
 		goto clean;
-	if (td.paren && !VEC_PUSH_STR(&ddata.output, ")"))
+	if (td.paren && !VEC_PUSH_STR(&ddata->output, ")"))
 		goto clean;
-	if (ddata.mem_vat && !VEC_PUSH_STR(&ddata.output, " volatile"))
+	/* The qualifiers token skips the leading space. */
+	tok_start = 0;
+	if (structured)
+		tok_start = cpp_demangle_output_len(ddata) + 1;
+	if (ddata->mem_vat && !VEC_PUSH_STR(&ddata->output, " volatile"))
 		goto clean;
-	if (ddata.mem_cst && !VEC_PUSH_STR(&ddata.output, " const"))
+	if (ddata->mem_cst && !VEC_PUSH_STR(&ddata->output, " const"))
 		goto clean;
-	if (ddata.mem_rst && !VEC_PUSH_STR(&ddata.output, " restrict"))
+	if (ddata->mem_rst && !VEC_PUSH_STR(&ddata->output, " restrict"))
 		goto clean;
-	if (ddata.mem_ref && !VEC_PUSH_STR(&ddata.output, " &"))
+	if (ddata->mem_ref && !VEC_PUSH_STR(&ddata->output, " &"))
 		goto clean;
-	if (ddata.mem_rref && !VEC_PUSH_STR(&ddata.output, " &&"))
+	if (ddata->mem_rref && !VEC_PUSH_STR(&ddata->output, " &&"))
 		goto clean;
+	if (structured) {
+		len = cpp_demangle_output_len(ddata);
+		if (len > tok_start &&
+		    !cpp_demangle_push_token(ddata, ddata->tokens.size,
+		    DEM_TOKEN_QUALIFIERS, tok_start, len - tok_start))
+			goto clean;
+	}
 
-	rtn = vector_str_get_flat(&ddata.output, (size_t *) NULL);
+	rtn = 1;
 
 clean:
 	if (has_ret)
 		vector_str_dest(&ret_type);
 
+	return (rtn);
+}
+
+/**
+ * @brief Decode the input string by IA-64 C++ ABI style.
+ * @return New allocated demangled string or NULL if failed.
+ */
+char *
+__cxa_demangle_gnu3(const char *org)
+{
+	struct cpp_demangle_data ddata;
+	char *rtn = NULL;
+
+	if (org == NULL)
+		return (NULL);
+
+	if (cpp_demangle_gnu3(&ddata, org, false))
+		rtn = vector_str_get_flat(&ddata.output, (size_t *) NULL);
+
+	cpp_demangle_data_dest(&ddata);
+
+	return (rtn);
+}
+
+/**
+ * @brief Decode the input string by IA-64 C++ ABI style, writing the result
+ * at offset off in a buffer.
+ *
+ * If buf is NULL, only the length of the result is computed.  Otherwise,
+ * *buf is NULL or was allocated with malloc() and is *size bytes long.  If
+ * the result and its terminating NUL do not fit after off, the buffer is
+ * grown with realloc(), to exactly the size needed or, if geometric is true,
+ * to at least twice its old size, and *size is set to its new size.  On
+ * failure, the first off bytes of *buf are left unchanged.
+ * @return 0 at success, -1 if memory could not be allocated or -2 if org
+ * could not be demangled.
+ */
+static int
+cpp_demangle_gnu3_render(const char *org, char **buf, size_t *size,
+    size_t off, size_t *len, bool geometric)
+{
+	struct cpp_demangle_data ddata;
+	size_t i, need, rtn_len;
+	char *p;
+	int rtn;
+
+	if (org == NULL)
+		return (-2);
+
+	rtn = -2;
+	if (!cpp_demangle_gnu3(&ddata, org, false) || ddata.output.size == 0)
+		goto clean;
+
+	if ((rtn_len = get_strlen_sum(&ddata.output)) == 0)
+		goto clean;
+
+	if (buf != NULL) {
+		need = off + rtn_len + 1;
+		if (*buf == NULL || *size < need) {
+			if (geometric && *buf != NULL && need < *size * 2)
+				need = *size * 2;
+			if ((p = realloc(*buf, need)) == NULL) {
+				rtn = -1;
+				goto clean;
+			}
+			*buf = p;
+			*size = need;
+		}
+		p = *buf + off;
+		for (i = 0; i < ddata.output.size; ++i)
+			p = stpcpy(p, ddata.output.container[i]);
+	}
+
+	if (len != NULL)
+		*len = rtn_len;
+	rtn = 0;
+
+clean:
 	cpp_demangle_data_dest(&ddata);
 
 	return (rtn);
 }
 
+/**
+ * @brief Decode the input string by IA-64 C++ ABI style into a buffer.
+ *
+ * If buf is NULL, only the length of the result is computed.  Otherwise,
+ * *buf is NULL or was allocated with malloc() and is *size bytes long.  The
+ * result is written directly into it if it fits; if not, it is grown with
+ * realloc() and *size is set to its new size.  On failure, *buf is left
+ * unchanged.
+ * @param len Set to the length of the result, if not NULL.
+ * @return 0 at success, -1 if memory could not be allocated or -2 if org
+ * could not be demangled.
+ */
+int
+__cxa_demangle_gnu3_buf(const char *org, char **buf, size_t *size,
+    size_t *len)
+{
+
+	return (cpp_demangle_gnu3_render(org, buf, size, 0, len, false));
+}
+
+/**
+ * @brief Decode the input string by IA-64 C++ ABI style, appending the
+ * result and its terminating NUL to a buffer.
+ *
+ * *buf is NULL or was allocated with malloc() and is *size bytes long, of
+ * which the first *used are in use.  The buffer is grown geometrically with
+ * realloc() if the result does not fit, so appending many results costs
+ * amortised constant time each.  At success, *used is advanced past the
+ * terminating NUL.  On failure, nothing is appended.
+ * @return 0 at success, -1 if memory could not be allocated or -2 if org
+ * could not be demangled.
+ */
+int
+__cxa_demangle_gnu3_append(const char *org, char **buf, size_t *size,
+    size_t *used)
+{
+	size_t len;
+	int rtn;
+
+	if ((rtn = cpp_demangle_gnu3_render(org, buf, size, *used, &len,
+	    true)) == 0)
+		*used += len + 1;
+
+	return (rtn);
+}
+
+/**
+ * @brief Decode the input string by IA-64 C++ ABI style into a string and
+ * a stream of tokens for its parts.
+ *
+ * The tokens are recorded while the encoding is read, so callers can pick
+ * out the name, scopes, template args and parameters without parsing the
+ * string again.  They are in order and do not overlap.  Only the top-level
+ * name is split; types and names that are not encodings have no tokens.
+ * The result is a single allocation, to be released with free().
+ * @param status Set to 0 at success, -1 if memory could not be allocated or
+ * -2 if org could not be demangled, if not NULL.
+ * @return The result, or NULL at failed.
+ */
+struct demangled_symbol *
+__cxa_demangle_gnu3_structured(const char *org, int *status)
+{
+	struct cpp_demangle_data ddata;
+	struct demangled_symbol *rtn;
+	struct demangle_token *tokens;
+	size_t i, len, tokens_size;
+	char *p;
+	int st;
+
+	rtn = NULL;
+	st = -2;
+	if (org == NULL)
+		goto done;
+
+	if (!cpp_demangle_gnu3(&ddata, org, true) || ddata.output.size == 0 ||
+	    (len = get_strlen_sum(&ddata.output)) == 0)
+		goto clean;
+
+	st = -1;
+	tokens_size = ddata.tokens.size * sizeof(struct demangle_token);
+	if ((rtn = malloc(sizeof(*rtn) + tokens_size + len + 1)) == NULL)
+		goto clean;
+
+	tokens = (struct demangle_token *)(rtn + 1);
+	if (tokens_size > 0)
+		memcpy(tokens, ddata.tokens.container, tokens_size);
+	p = (char *)tokens + tokens_size;
+	rtn->text = p;
+	rtn->length = len;
+	rtn->token_count = ddata.tokens.size;
+	rtn->tokens = tokens;
+	for (i = 0; i < ddata.output.size; ++i)
+		p = stpcpy(p, ddata.output.container[i]);
+	st = 0;
+
+clean:
+	cpp_demangle_data_dest(&ddata);
+done:
+	if (status != NULL)
+		*status = st;
+
+	return (rtn);
+}
+
 static void
 cpp_demangle_data_dest(struct cpp_demangle_data *d)
 {
@@ -666,11 +1179,7 @@ cpp_demangle_data_dest(struct cpp_demangle_data *d)
 	if (d == NULL)
 		return;
 
-	vector_read_cmd_dest(&d->cmd);
-	vector_str_dest(&d->class_type);
-	vector_str_dest(&d->tmpl);
-	vector_str_dest(&d->subst);
-	vector_str_dest(&d->output);
+	dem_arena_dest(&d->arena);
 }
 
 static int
@@ -680,16 +1189,20 @@ cpp_demangle_data_init(struct cpp_demangle_data *d, const char *cur)
 	if (d == NULL || cur == NULL)
 		return (0);
 
-	if (!vector_str_init(&d->output))
-		return (0);
-	if (!vector_str_init(&d->subst))
-		goto clean1;
-	if (!vector_str_init(&d->tmpl))
-		goto clean2;
-	if (!vector_str_init(&d->class_type))
-		goto clean3;
-	if (!vector_read_cmd_init(&d->cmd))
-		goto clean4;
+	dem_arena_init(&d->arena);
+
+	if (!vector_str_init(&d->output, &d->arena))
+		goto clean;
+	if (!vector_str_init(&d->subst, &d->arena) ||
+	    !vector_str_init_index(&d->subst))
+		goto clean;
+	if (!vector_str_init(&d->tmpl, &d->arena) ||
+	    !vector_str_init_index(&d->tmpl))
+		goto clean;
+	if (!vector_str_init(&d->class_type, &d->arena))
+		goto clean;
+	if (!vector_read_cmd_init(&d->cmd, &d->arena))
+		goto clean;
 
 	assert(d->output.container != NULL);
 	assert(d->subst.container != NULL);
@@ -709,17 +1222,15 @@ cpp_demangle_data_init(struct cpp_demangle_data *d, const char *cur)
 	d->cur = cur;
 	d->cur_output = &d->output;
 	d->last_sname = NULL;
+	d->tokens.size = 0;
+	d->tokens.capacity = 0;
+	d->tokens.container = NULL;
+	d->tokens_active = false;
 
 	return (1);
 
-clean4:
-	vector_str_dest(&d->class_type);
-clean3:
-	vector_str_dest(&d->tmpl);
-clean2:
-	vector_str_dest(&d->subst);
-clean1:
-	vector_str_dest(&d->output);
+clean:
+	dem_arena_dest(&d->arena);
 
 	return (0);
 }
@@ -782,6 +1293,95 @@ cpp_demangle_pop_str(struct cpp_demangle_data *ddata)
 	return (vector_str_pop(ddata->cur_output));
 }
 
+/**
+ * @brief Insert a token at index idx of ddata->tokens.
+ *
+ * Empty tokens are dropped.
+ * @return 0 at failed, 1 at success.
+ */
+static int
+cpp_demangle_push_token(struct cpp_demangle_data *ddata, size_t idx,
+    int kind, size_t offset, size_t length)
+{
+	struct vector_token *v;
+	struct demangle_token *tmp_ctn;
+	size_t tmp_cap;
+
+	if (ddata == NULL)
+		return (0);
+
+	if (length == 0)
+		return (1);
+
+	v = &ddata->tokens;
+	if (v->size == v->capacity) {
+		tmp_cap = v->capacity == 0 ? VECTOR_DEF_CAPACITY :
+		    BUFFER_GROW(v->capacity);
+		if ((tmp_ctn = dem_realloc(&ddata->arena, v->container,
+		    sizeof(*tmp_ctn) * v->size,
+		    sizeof(*tmp_ctn) * tmp_cap)) == NULL)
+			return (0);
+		v->container = tmp_ctn;
+		v->capacity = tmp_cap;
+	}
+
+	memmove(v->container + idx + 1, v->container + idx,
+	    sizeof(*v->container) * (v->size - idx));
+	v->container[idx].kind = kind;
+	v->container[idx].offset = offset;
+	v->container[idx].length = length;
+	++v->size;
+
+	return (1);
+}
+
+/**
+ * @brief Length of the demangled string in ddata->output so far.
+ */
+static size_t
+cpp_demangle_output_len(const struct cpp_demangle_data *ddata)
+{
+	size_t i, len = 0;
+
+	for (i = 0; i < ddata->output.size; ++i)
+		len += strlen(ddata->output.container[i]);
+
+	return (len);
+}
+
+/**
+ * @brief Finish the tokens recorded for a nested name from index first.
+ *
+ * The last scope is the name itself.  Template args of an enclosing scope
+ * are merged into that scope, so only the name's own stay separate.
+ */
+static void
+cpp_demangle_nested_name_tokens(struct vector_token *v, size_t first)
+{
+	struct demangle_token *t;
+	size_t i, j, last;
+
+	t = v->container;
+	last = v->size;
+	for (i = first; i < v->size; ++i)
+		if (t[i].kind == DEM_TOKEN_SCOPE)
+			last = i;
+	if (last == v->size)
+		return;
+	t[last].kind = DEM_TOKEN_NAME;
+
+	for (i = j = first; i < v->size; ++i) {
+		if (j > first && t[i].kind == DEM_TOKEN_TEMPLATE_ARGS &&
+		    t[j - 1].kind == DEM_TOKEN_SCOPE) {
+			t[j - 1].length = t[i].offset + t[i].length -
+			    t[j - 1].offset;
+			continue;
+		}
+		t[j++] = t[i];
+	}
+	v->size = j;
+}
+
 static int
 cpp_demangle_push_subst(struct cpp_demangle_data *ddata, const char *str,
     size_t len)
@@ -803,15 +1403,15 @@ cpp_demangle_push_subst_v(struct cpp_demangle_data *ddata, struct vector_str *v)
 	int rtn;
 	char *str;
 
-	if (ddata == NULL || v == NULL)
+	if (ddata == NULL || v == NULL || v->size == 0)
 		return (0);
 
-	if ((str = vector_str_get_flat(v, &str_len)) == NULL)
+	if ((str = vector_str_substr(v, 0, v->size - 1, &str_len)) == NULL)
 		return (0);
 
 	rtn = cpp_demangle_push_subst(ddata, str, str_len);
 
-	free(str);
+	dem_free(&ddata->arena, str);
 
 	return (rtn);
 }
@@ -835,7 +1435,7 @@ cpp_demangle_push_type_qualifier(struct cpp_demangle_data *ddata,
 
 	rtn = 0;
 	if (type_str != NULL) {
-		if (!vector_str_init(&subst_v))
+		if (!vector_str_init(&subst_v, &ddata->arena))
 			return (0);
 		if (!VEC_PUSH_STR(&subst_v, type_str))
 			goto clean;
@@ -930,28 +1530,29 @@ cpp_demangle_push_type_qualifier(struct cpp_demangle_data *ddata,
 			if ((e_len = strlen(v->ext_name.container[e_idx])) ==
 			    0)
 				goto clean;
-			if ((buf = malloc(e_len + 2)) == NULL)
+			if ((buf = dem_alloc(&ddata->arena, e_len + 2)) ==
+			    NULL)
 				goto clean;
 			snprintf(buf, e_len + 2, " %s",
 			    v->ext_name.container[e_idx]);
 
 			if (!DEM_PUSH_STR(ddata, buf)) {
-				free(buf);
+				dem_free(&ddata->arena, buf);
 				goto clean;
 			}
 
 			if (type_str != NULL) {
 				if (!VEC_PUSH_STR(&subst_v, buf)) {
-					free(buf);
+					dem_free(&ddata->arena, buf);
 					goto clean;
 				}
 				if (!cpp_demangle_push_subst_v(ddata,
 				    &subst_v)) {
-					free(buf);
+					dem_free(&ddata->arena, buf);
 					goto clean;
 				}
 			}
-			free(buf);
+			dem_free(&ddata->arena, buf);
 			++e_idx;
 			break;
 
@@ -1034,26 +1635,27 @@ cpp_demangle_push_type_qualifier(struct cpp_demangle_data *ddata,
 			if ((e_len = strlen(v->ext_name.container[e_idx])) ==
 			    0)
 				goto clean;
-			if ((buf = malloc(e_len + 12)) == NULL)
+			if ((buf = dem_alloc(&ddata->arena, e_len + 12)) ==
+			    NULL)
 				goto clean;
 			snprintf(buf, e_len + 12, " __vector(%s)",
 			    v->ext_name.container[e_idx]);
 			if (!DEM_PUSH_STR(ddata, buf)) {
-				free(buf);
+				dem_free(&ddata->arena, buf);
 				goto clean;
 			}
 			if (type_str != NULL) {
 				if (!VEC_PUSH_STR(&subst_v, buf)) {
-					free(buf);
+					dem_free(&ddata->arena, buf);
 					goto clean;
 				}
 				if (!cpp_demangle_push_subst_v(ddata,
 				    &subst_v)) {
-					free(buf);
+					dem_free(&ddata->arena, buf);
 					goto clean;
 				}
 			}
-			free(buf);
+			dem_free(&ddata->arena, buf);
 			++e_idx;
 			break;
 		}
@@ -1151,35 +1753,35 @@ cpp_demangle_read_array(struct cpp_demangle_data *ddata)
 			idx = ddata->output.size;
 			for (i = p_idx; i < idx; ++i)
 				if (!vector_str_pop(&ddata->output)) {
-					free(exp);
+					dem_free(&ddata->arena, exp);
 					return (0);
 				}
 			if (*ddata->cur != '_') {
-				free(exp);
+				dem_free(&ddata->arena, exp);
 				return (0);
 			}
 			++ddata->cur;
 			if (*ddata->cur == '\0') {
-				free(exp);
+				dem_free(&ddata->arena, exp);
 				return (0);
 			}
 			if (!cpp_demangle_read_type(ddata, NULL)) {
-				free(exp);
+				dem_free(&ddata->arena, exp);
 				return (0);
 			}
 			if (!DEM_PUSH_STR(ddata, " [")) {
-				free(exp);
+				dem_free(&ddata->arena, exp);
 				return (0);
 			}
 			if (!cpp_demangle_push_str(ddata, exp, exp_len)) {
-				free(exp);
+				dem_free(&ddata->arena, exp);
 				return (0);
 			}
 			if (!DEM_PUSH_STR(ddata, "]")) {
-				free(exp);
+				dem_free(&ddata->arena, exp);
 				return (0);
 			}
-			free(exp);
+			dem_free(&ddata->arena, exp);
 		}
 	}
 
@@ -1575,7 +2177,7 @@ cpp_demangle_read_expression_flat(struct cpp_demangle_data *ddata, char **str)
 	idx = output->size;
 	for (i = p_idx; i < idx; ++i) {
 		if (!vector_str_pop(output)) {
-			free(exp);
+			dem_free(&ddata->arena, exp);
 			return (0);
 		}
 	}
@@ -1746,7 +2348,7 @@ cpp_demangle_read_function(struct cpp_demangle_data *ddata, int *ext_c,
 
 		/* Release type qualifier vector. */
 		vector_type_qualifier_dest(v);
-		if (!vector_type_qualifier_init(v))
+		if (!vector_type_qualifier_init(v, &ddata->arena))
 			return (0);
 
 		/* Push ref-qualifiers. */
@@ -1794,6 +2396,8 @@ cpp_demangle_read_encoding(struct cpp_demangle_data *ddata)
 		return (cpp_demangle_read_encoding(ddata));
 
 	case SIMPLE_HASH('G', 'R'):
+		/* The name is moved after the number, so it has no tokens. */
+		ddata->tokens_active = false;
 		if (!DEM_PUSH_STR(ddata, "reference temporary #"))
 			return (0);
 		ddata->cur += 2;
@@ -1812,9 +2416,9 @@ cpp_demangle_read_encoding(struct cpp_demangle_data *ddata)
 			goto clean2;
 		rtn = 1;
 	clean2:
-		free(num_str);
+		dem_free(&ddata->arena, num_str);
 	clean1:
-		free(name);
+		dem_free(&ddata->arena, name);
 		return (rtn);
 
 	case SIMPLE_HASH('G', 'T'):
@@ -1858,6 +2462,7 @@ cpp_demangle_read_encoding(struct cpp_demangle_data *ddata)
 
 	case SIMPLE_HASH('T', 'C'):
 		/* construction vtable */
+		ddata->tokens_active = false;
 		if (!DEM_PUSH_STR(ddata, "construction vtable for "))
 			return (0);
 		ddata->cur += 2;
@@ -1878,7 +2483,7 @@ cpp_demangle_read_encoding(struct cpp_demangle_data *ddata)
 			goto clean3;
 		rtn = 1;
 	clean3:
-		free(type);
+		dem_free(&ddata->arena, type);
 		return (rtn);
 
 	case SIMPLE_HASH('T', 'D'):
@@ -1892,7 +2497,7 @@ cpp_demangle_read_encoding(struct cpp_demangle_data *ddata)
 		ddata->cur += 2;
 		if (*ddata->cur == '\0')
 			return (0);
-		return (cpp_demangle_read_type(ddata, NULL));
+		return (cpp_demangle_read_special_type(ddata));
 
 	case SIMPLE_HASH('T', 'h'):
 		/* virtual function non-virtual override thunk */
@@ -1922,7 +2527,7 @@ cpp_demangle_read_encoding(struct cpp_demangle_data *ddata)
 		ddata->cur += 2;
 		if (*ddata->cur == '\0')
 			return (0);
-		return (cpp_demangle_read_type(ddata, NULL));
+		return (cpp_demangle_read_special_type(ddata));
 
 	case SIMPLE_HASH('T', 'J'):
 		/* java class */
@@ -1931,7 +2536,7 @@ cpp_demangle_read_encoding(struct cpp_demangle_data *ddata)
 		ddata->cur += 2;
 		if (*ddata->cur == '\0')
 			return (0);
-		return (cpp_demangle_read_type(ddata, NULL));
+		return (cpp_demangle_read_special_type(ddata));
 
 	case SIMPLE_HASH('T', 'S'):
 		/* RTTI name (NTBS) */
@@ -1940,7 +2545,7 @@ cpp_demangle_read_encoding(struct cpp_demangle_data *ddata)
 		ddata->cur += 2;
 		if (*ddata->cur == '\0')
 			return (0);
-		return (cpp_demangle_read_type(ddata, NULL));
+		return (cpp_demangle_read_special_type(ddata));
 
 	case SIMPLE_HASH('T', 'T'):
 		/* VTT table */
@@ -1949,7 +2554,7 @@ cpp_demangle_read_encoding(struct cpp_demangle_data *ddata)
 		ddata->cur += 2;
 		if (*ddata->cur == '\0')
 			return (0);
-		return (cpp_demangle_read_type(ddata, NULL));
+		return (cpp_demangle_read_special_type(ddata));
 
 	case SIMPLE_HASH('T', 'v'):
 		/* virtual function virtual override thunk */
@@ -1969,7 +2574,7 @@ cpp_demangle_read_encoding(struct cpp_demangle_data *ddata)
 		ddata->cur += 2;
 		if (*ddata->cur == '\0')
 			return (0);
-		return (cpp_demangle_read_type(ddata, NULL));
+		return (cpp_demangle_read_special_type(ddata));
 
 	case SIMPLE_HASH('T', 'W'):
 		/* TLS wrapper function */
@@ -1997,7 +2602,7 @@ cpp_demangle_read_local_name(struct cpp_demangle_data *ddata)
 	if (*(++ddata->cur) == '\0')
 		return (0);
 
-	if (!vector_str_init(&local_name))
+	if (!vector_str_init(&local_name, &ddata->arena))
 		return (0);
 	ddata->cur_output = &local_name;
 
@@ -2078,9 +2683,10 @@ static int
 cpp_demangle_read_name(struct cpp_demangle_data *ddata)
 {
 	struct vector_str *output, v;
-	size_t p_idx, subst_str_len;
+	size_t off, p_idx, subst_str_len;
 	int rtn;
 	char *subst_str;
+	bool active;
 
 	if (ddata == NULL || *ddata->cur == '\0')
 		return (0);
@@ -2089,16 +2695,33 @@ cpp_demangle_read_name(struct cpp_demangle_data *ddata)
 
 	subst_str = NULL;
 
+	/* Only the top-level name of an encoding is split into tokens. */
+	active = ddata->tokens_active && output == &ddata->output;
+	ddata->tokens_active = false;
+
 	switch (*ddata->cur) {
 	case 'S':
+		ddata->tokens_active = active;
 		return (cpp_demangle_read_subst(ddata));
 	case 'N':
+		ddata->tokens_active = active;
 		return (cpp_demangle_read_nested_name(ddata));
-	case 'Z':
-		return (cpp_demangle_read_local_name(ddata));
 	}
 
-	if (!vector_str_init(&v))
+	off = active ? cpp_demangle_output_len(ddata) : 0;
+
+	/* A local name is one token, including the enclosing function. */
+	if (*ddata->cur == 'Z') {
+		if (!cpp_demangle_read_local_name(ddata))
+			return (0);
+		if (active)
+			return (cpp_demangle_push_token(ddata,
+			    ddata->tokens.size, DEM_TOKEN_NAME, off,
+			    cpp_demangle_output_len(ddata) - off));
+		return (1);
+	}
+
+	if (!vector_str_init(&v, &ddata->arena))
 		return (0);
 
 	p_idx = output->size;
@@ -2108,6 +2731,10 @@ cpp_demangle_read_name(struct cpp_demangle_data *ddata)
 	if ((subst_str = vector_str_substr(output, p_idx, output->size - 1,
 	    &subst_str_len)) == NULL)
 		goto clean;
+	if (active && !cpp_demangle_push_token(ddata, ddata->tokens.size,
+	    DEM_TOKEN_NAME, off, subst_str_len))
+		goto clean;
+	off += subst_str_len;
 	if (subst_str_len > 8 && strstr(subst_str, "operator") != NULL) {
 		rtn = 1;
 		goto clean;
@@ -2121,7 +2748,7 @@ cpp_demangle_read_name(struct cpp_demangle_data *ddata)
 		p_idx = output->size;
 		if (!cpp_demangle_read_tmpl_args(ddata))
 			goto clean;
-		free(subst_str);
+		dem_free(&ddata->arena, subst_str);
 		if ((subst_str = vector_str_substr(output, p_idx,
 		    output->size - 1, &subst_str_len)) == NULL)
 			goto clean;
@@ -2129,12 +2756,16 @@ cpp_demangle_read_name(struct cpp_demangle_data *ddata)
 			goto clean;
 		if (!cpp_demangle_push_subst_v(ddata, &v))
 			goto clean;
+		if (active && !cpp_demangle_push_token(ddata,
+		    ddata->tokens.size, DEM_TOKEN_TEMPLATE_ARGS, off,
+		    subst_str_len))
+			goto clean;
 	}
 
 	rtn = 1;
 
 clean:
-	free(subst_str);
+	dem_free(&ddata->arena, subst_str);
 	vector_str_dest(&v);
 
 	return (rtn);
@@ -2161,7 +2792,7 @@ cpp_demangle_read_name_flat(struct cpp_demangle_data *ddata, char **str)
 	idx = output->size;
 	for (i = p_idx; i < idx; ++i) {
 		if (!vector_str_pop(output)) {
-			free(name);
+			dem_free(&ddata->arena, name);
 			return (0);
 		}
 	}
@@ -2175,9 +2806,10 @@ static int
 cpp_demangle_read_nested_name(struct cpp_demangle_data *ddata)
 {
 	struct vector_str *output, v;
-	size_t limit, p_idx, subst_str_len;
-	int rtn;
+	size_t first_tok, limit, off, p_idx, sep_len, subst_str_len;
+	int kind, rtn;
 	char *subst_str;
+	bool active;
 
 	if (ddata == NULL || *ddata->cur != 'N')
 		return (0);
@@ -2208,17 +2840,25 @@ cpp_demangle_read_nested_name(struct cpp_demangle_data *ddata)
 
 next:
 	output = ddata->cur_output;
-	if (!vector_str_init(&v))
+	if (!vector_str_init(&v, &ddata->arena))
 		return (0);
 
+	/* Each component is a scope until the last becomes the name. */
+	active = ddata->tokens_active && output == &ddata->output;
+	ddata->tokens_active = false;
+	first_tok = ddata->tokens.size;
+	off = active ? cpp_demangle_output_len(ddata) : 0;
+
 	rtn = 0;
 	limit = 0;
 	for (;;) {
 		p_idx = output->size;
+		kind = DEM_TOKEN_SCOPE;
 		switch (*ddata->cur) {
 		case 'I':
 			if (!cpp_demangle_read_tmpl_args(ddata))
 				goto clean;
+			kind = DEM_TOKEN_TEMPLATE_ARGS;
 			break;
 		case 'S':
 			if (!cpp_demangle_read_subst(ddata))
@@ -2239,14 +2879,22 @@ next:
 		    output->size - 1, &subst_str_len)) == NULL)
 			goto clean;
 		if (!vector_str_push(&v, subst_str, subst_str_len)) {
-			free(subst_str);
+			dem_free(&ddata->arena, subst_str);
 			goto clean;
 		}
-		free(subst_str);
+		/* Constructors and destructors bring their own "::". */
+		sep_len = strncmp(subst_str, "::", 2) == 0 ? 2 : 0;
+		dem_free(&ddata->arena, subst_str);
 
 		if (!cpp_demangle_push_subst_v(ddata, &v))
 			goto clean;
 
+		if (active && !cpp_demangle_push_token(ddata,
+		    ddata->tokens.size, kind, off + sep_len,
+		    subst_str_len - sep_len))
+			goto clean;
+		off += subst_str_len;
+
 	next_comp:
 		if (*ddata->cur == 'E')
 			break;
@@ -2256,11 +2904,15 @@ next:
 				goto clean;
 			if (!VEC_PUSH_STR(&v, "::"))
 				goto clean;
+			off += 2;
 		}
 		if (limit++ > CPP_DEMANGLE_TRY_LIMIT)
 			goto clean;
 	}
 
+	if (active)
+		cpp_demangle_nested_name_tokens(&ddata->tokens, first_tok);
+
 	++ddata->cur;
 	rtn = 1;
 
@@ -2317,10 +2969,10 @@ cpp_demangle_read_number_as_string(struct cpp_demangle_data *ddata, char **str)
 		return (0);
 	}
 
-	if (asprintf(str, "%ld", n) < 0) {
-		*str = NULL;
+	if ((*str = dem_alloc(&ddata->arena, sizeof(n) * 3 + 2)) == NULL)
 		return (0);
-	}
+
+	snprintf(*str, sizeof(n) * 3 + 2, "%ld", n);
 
 	return (1);
 }
@@ -2445,10 +3097,10 @@ clean2:
 	if (!vector_read_cmd_pop(&ddata->cmd))
 		rtn = 0;
 clean1:
-	free(class_type);
+	dem_free(&ddata->arena, class_type);
 
 	vector_type_qualifier_dest(v);
-	if (!vector_type_qualifier_init(v))
+	if (!vector_type_qualifier_init(v, &ddata->arena))
 		return (0);
 
 	return (rtn);
@@ -2483,14 +3135,44 @@ cpp_demangle_read_sname(struct cpp_demangle_data *ddata)
 	return (1);
 }
 
+/**
+ * @brief Read the type that a special name such as a vtable is for.
+ *
+ * At the top level, the type is recorded as the name.
+ */
+static int
+cpp_demangle_read_special_type(struct cpp_demangle_data *ddata)
+{
+	size_t off;
+	bool active;
+
+	active = ddata->tokens_active;
+	off = active ? cpp_demangle_output_len(ddata) : 0;
+
+	if (!cpp_demangle_read_type(ddata, NULL))
+		return (0);
+
+	if (active)
+		return (cpp_demangle_push_token(ddata, ddata->tokens.size,
+		    DEM_TOKEN_NAME, off,
+		    cpp_demangle_output_len(ddata) - off));
+
+	return (1);
+}
+
 static int
 cpp_demangle_read_subst(struct cpp_demangle_data *ddata)
 {
 	long nth;
+	bool active;
 
 	if (ddata == NULL || *ddata->cur == '\0')
 		return (0);
 
+	/* Only std:: names are split into tokens. */
+	active = ddata->tokens_active;
+	ddata->tokens_active = false;
+
 	/* abbreviations of the form Sx */
 	switch (SIMPLE_HASH(*ddata->cur, *(ddata->cur + 1))) {
 	case SIMPLE_HASH('S', 'a'):
@@ -2567,6 +3249,7 @@ cpp_demangle_read_subst(struct cpp_demangle_data *ddata)
 
 	case SIMPLE_HASH('S', 't'):
 		/* std:: */
+		ddata->tokens_active = active;
 		return (cpp_demangle_read_subst_std(ddata));
 	}
 
@@ -2610,20 +3293,29 @@ static int
 cpp_demangle_read_subst_std(struct cpp_demangle_data *ddata)
 {
 	struct vector_str *output, v;
-	size_t p_idx, subst_str_len;
+	size_t off, p_idx, subst_str_len;
 	int rtn;
 	char *subst_str;
+	bool active;
 
 	if (ddata == NULL)
 		return (0);
 
-	if (!vector_str_init(&v))
+	if (!vector_str_init(&v, &ddata->arena))
 		return (0);
 
+	active = ddata->tokens_active && ddata->cur_output == &ddata->output;
+	ddata->tokens_active = false;
+	off = active ? cpp_demangle_output_len(ddata) : 0;
+
 	subst_str = NULL;
 	rtn = 0;
 	if (!DEM_PUSH_STR(ddata, "std::"))
 		goto clean;
+	if (active && !cpp_demangle_push_token(ddata, ddata->tokens.size,
+	    DEM_TOKEN_SCOPE, off, 3))
+		goto clean;
+	off += 5;
 
 	if (!VEC_PUSH_STR(&v, "std::"))
 		goto clean;
@@ -2646,11 +3338,16 @@ cpp_demangle_read_subst_std(struct cpp_demangle_data *ddata)
 	if (!cpp_demangle_push_subst_v(ddata, &v))
 		goto clean;
 
+	if (active && !cpp_demangle_push_token(ddata, ddata->tokens.size,
+	    DEM_TOKEN_NAME, off, subst_str_len))
+		goto clean;
+	off += subst_str_len;
+
 	if (*ddata->cur == 'I') {
 		p_idx = output->size;
 		if (!cpp_demangle_read_tmpl_args(ddata))
 			goto clean;
-		free(subst_str);
+		dem_free(&ddata->arena, subst_str);
 		if ((subst_str = vector_str_substr(output, p_idx,
 		    output->size - 1, &subst_str_len)) == NULL)
 			goto clean;
@@ -2658,11 +3355,15 @@ cpp_demangle_read_subst_std(struct cpp_demangle_data *ddata)
 			goto clean;
 		if (!cpp_demangle_push_subst_v(ddata, &v))
 			goto clean;
+		if (active && !cpp_demangle_push_token(ddata,
+		    ddata->tokens.size, DEM_TOKEN_TEMPLATE_ARGS, off,
+		    subst_str_len))
+			goto clean;
 	}
 
 	rtn = 1;
 clean:
-	free(subst_str);
+	dem_free(&ddata->arena, subst_str);
 	vector_str_dest(&v);
 
 	return (rtn);
@@ -2696,8 +3397,8 @@ cpp_demangle_read_subst_stdtmpl(struct cpp_demangle_data *ddata,
 		return (0);
 
 	rtn = 0;
-	if ((subst_str = malloc(sizeof(char) * (substr_len + len + 1))) ==
-	    NULL)
+	if ((subst_str = dem_alloc(&ddata->arena,
+	    sizeof(char) * (substr_len + len + 1))) == NULL)
 		goto clean;
 
 	memcpy(subst_str, str, len);
@@ -2709,8 +3410,8 @@ cpp_demangle_read_subst_stdtmpl(struct cpp_demangle_data *ddata,
 
 	rtn = 1;
 clean:
-	free(subst_str);
-	free(substr);
+	dem_free(&ddata->arena, subst_str);
+	dem_free(&ddata->arena, substr);
 
 	return (rtn);
 }
@@ -2764,11 +3465,11 @@ cpp_demangle_read_tmpl_args(struct cpp_demangle_data *ddata)
 			return (0);
 		if (!vector_str_find(&ddata->tmpl, arg, arg_len) &&
 		    !vector_str_push(&ddata->tmpl, arg, arg_len)) {
-			free(arg);
+			dem_free(&ddata->arena, arg);
 			return (0);
 		}
 
-		free(arg);
+		dem_free(&ddata->arena, arg);
 
 		if (*ddata->cur == 'E') {
 			++ddata->cur;
@@ -2841,6 +3542,9 @@ cpp_demangle_read_type(struct cpp_demangle_data *ddata,
 	if (ddata == NULL)
 		return (0);
 
+	/* Names inside types are not split into tokens. */
+	ddata->tokens_active = false;
+
 	output = ddata->cur_output;
 	if (td) {
 		if (td->paren == false) {
@@ -2865,7 +3569,7 @@ cpp_demangle_read_type(struct cpp_demangle_data *ddata,
 	 * pointer-to-member, template-param, template-template-param, subst
 	 */
 
-	if (!vector_type_qualifier_init(&v))
+	if (!vector_type_qualifier_init(&v, &ddata->arena))
 		return (0);
 
 	extern_c = 0;
@@ -3083,16 +3787,16 @@ again:
 		if ((subst_str = vector_str_substr(output, p_idx,
 		    output->size - 1, &subst_str_len)) == NULL)
 			goto clean;
-		if (!vector_str_init(&sv)) {
-			free(subst_str);
+		if (!vector_str_init(&sv, &ddata->arena)) {
+			dem_free(&ddata->arena, subst_str);
 			goto clean;
 		}
 		if (!vector_str_push(&sv, subst_str, subst_str_len)) {
-			free(subst_str);
+			dem_free(&ddata->arena, subst_str);
 			vector_str_dest(&sv);
 			goto clean;
 		}
-		free(subst_str);
+		dem_free(&ddata->arena, subst_str);
 		if (!cpp_demangle_push_subst_v(ddata, &sv)) {
 			vector_str_dest(&sv);
 			goto clean;
@@ -3331,16 +4035,16 @@ rtn:
 	if (td)
 		td->firstp = false;
 
-	free(type_str);
-	free(exp_str);
-	free(num_str);
+	dem_free(&ddata->arena, type_str);
+	dem_free(&ddata->arena, exp_str);
+	dem_free(&ddata->arena, num_str);
 	vector_type_qualifier_dest(&v);
 
 	return (1);
 clean:
-	free(type_str);
-	free(exp_str);
-	free(num_str);
+	dem_free(&ddata->arena, type_str);
+	dem_free(&ddata->arena, exp_str);
+	dem_free(&ddata->arena, num_str);
 	vector_type_qualifier_dest(&v);
 
 	return (0);
@@ -3367,7 +4071,7 @@ cpp_demangle_read_type_flat(struct cpp_demangle_data *ddata, char **str)
 	idx = output->size;
 	for (i = p_idx; i < idx; ++i) {
 		if (!vector_str_pop(output)) {
-			free(type);
+			dem_free(&ddata->arena, type);
 			return (0);
 		}
 	}
@@ -4170,16 +4874,6 @@ is_cpp_mangled_gnu3(const char *org)
 	    (len > 11 && !strncmp(org, "_GLOBAL__I_", 11)));
 }
 
-static void
-vector_read_cmd_dest(struct vector_read_cmd *v)
-{
-
-	if (v == NULL)
-		return;
-
-	free(v->r_container);
-}
-
 static struct read_cmd_item *
 vector_read_cmd_find(struct vector_read_cmd *v, enum read_cmd dst)
 {
@@ -4196,17 +4890,18 @@ vector_read_cmd_find(struct vector_read_cmd *v, enum read_cmd dst)
 }
 
 static int
-vector_read_cmd_init(struct vector_read_cmd *v)
+vector_read_cmd_init(struct vector_read_cmd *v, struct dem_arena *a)
 {
 
-	if (v == NULL)
+	if (v == NULL || a == NULL)
 		return (0);
 
 	v->size = 0;
 	v->capacity = VECTOR_DEF_CAPACITY;
+	v->arena = a;
 
-	if ((v->r_container = malloc(sizeof(*v->r_container) * v->capacity))
-	    == NULL)
+	if ((v->r_container = dem_alloc(a,
+	    sizeof(*v->r_container) * v->capacity)) == NULL)
 		return (0);
 
 	return (1);
@@ -4231,18 +4926,16 @@ vector_read_cmd_push(struct vector_read_cmd *v, enum read_cmd cmd, void *data)
 {
 	struct read_cmd_item *tmp_r_ctn;
 	size_t tmp_cap;
-	size_t i;
 
 	if (v == NULL)
 		return (0);
 
 	if (v->size == v->capacity) {
 		tmp_cap = BUFFER_GROW(v->capacity);
-		if ((tmp_r_ctn = malloc(sizeof(*tmp_r_ctn) * tmp_cap)) == NULL)
+		if ((tmp_r_ctn = dem_realloc(v->arena, v->r_container,
+		    sizeof(*tmp_r_ctn) * v->size,
+		    sizeof(*tmp_r_ctn) * tmp_cap)) == NULL)
 			return (0);
-		for (i = 0; i < v->size; ++i)
-			tmp_r_ctn[i] = v->r_container[i];
-		free(v->r_container);
 		v->r_container = tmp_r_ctn;
 		v->capacity = tmp_cap;
 	}
@@ -4261,31 +4954,31 @@ vector_type_qualifier_dest(struct vector_type_qualifier *v)
 	if (v == NULL)
 		return;
 
-	free(v->q_container);
 	vector_str_dest(&v->ext_name);
+	dem_free(v->arena, v->q_container);
 }
 
 /* size, capacity, ext_name */
 static int
-vector_type_qualifier_init(struct vector_type_qualifier *v)
+vector_type_qualifier_init(struct vector_type_qualifier *v,
+    struct dem_arena *a)
 {
 
-	if (v == NULL)
+	if (v == NULL || a == NULL)
 		return (0);
 
 	v->size = 0;
 	v->capacity = VECTOR_DEF_CAPACITY;
+	v->arena = a;
 
-	if ((v->q_container = malloc(sizeof(enum type_qualifier) * v->capacity))
-	    == NULL)
+	if ((v->q_container = dem_alloc(a,
+	    sizeof(enum type_qualifier) * v->capacity)) == NULL)
 		return (0);
 
 	assert(v->q_container != NULL);
 
-	if (!vector_str_init(&v->ext_name)) {
-		free(v->q_container);
+	if (!vector_str_init(&v->ext_name, a))
 		return (0);
-	}
 
 	return (1);
 }
@@ -4296,19 +4989,16 @@ vector_type_qualifier_push(struct vector_type_qualifier *v,
 {
 	enum type_qualifier *tmp_ctn;
 	size_t tmp_cap;
-	size_t i;
 
 	if (v == NULL)
 		return (0);
 
 	if (v->size == v->capacity) {
 		tmp_cap = BUFFER_GROW(v->capacity);
-		if ((tmp_ctn = malloc(sizeof(enum type_qualifier) * tmp_cap))
-		    == NULL)
+		if ((tmp_ctn = dem_realloc(v->arena, v->q_container,
+		    sizeof(enum type_qualifier) * v->size,
+		    sizeof(enum type_qualifier) * tmp_cap)) == NULL)
 			return (0);
-		for (i = 0; i < v->size; ++i)
-			tmp_ctn[i] = v->q_container[i];
-		free(v->q_container);
 		v->q_container = tmp_ctn;
 		v->capacity = tmp_cap;
 	}
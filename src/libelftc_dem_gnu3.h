@@ -0,0 +1,63 @@
+/**
+ * libelftc_dem_gnu3.h - Entry points of the C++ demangler.
+ *
+ * The structures returned by __cxa_demangle_gnu3_structured() are declared
+ * here, so that typeinfo.cc can check that they have the same layout as the
+ * pathscale::demangled_symbol that it returns them as.
+ */
+#pragma once
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Kind of a demangle_token.
+ *
+ * Must match pathscale::demangle_token_kind in cxxabi.h.
+ */
+enum demangle_token_kind {
+	DEM_TOKEN_SPECIAL,	/* e.g. "guard variable for " */
+	DEM_TOKEN_RETURN_TYPE,	/* return type of a template */
+	DEM_TOKEN_SCOPE,	/* enclosing namespace or class */
+	DEM_TOKEN_NAME,		/* unqualified name */
+	DEM_TOKEN_TEMPLATE_ARGS, /* template args of the name */
+	DEM_TOKEN_PARAMETER,	/* function parameter type */
+	DEM_TOKEN_QUALIFIERS	/* cv and ref qualifiers */
+};
+
+/**
+ * @brief Part of the demangled string that a token stands for.
+ *
+ * Must match pathscale::demangle_token in cxxabi.h.
+ */
+struct demangle_token {
+	int		 kind;		/* demangle_token_kind */
+	size_t		 offset;	/* start in demangled string */
+	size_t		 length;
+};
+
+/**
+ * @brief Result of __cxa_demangle_gnu3_structured().
+ *
+ * Must match pathscale::demangled_symbol in cxxabi.h.
+ */
+struct demangled_symbol {
+	const char			*text;
+	size_t				 length;
+	size_t				 token_count;
+	const struct demangle_token	*tokens;
+};
+
+char	*__cxa_demangle_gnu3(const char *);
+int	__cxa_demangle_gnu3_buf(const char *, char **, size_t *,
+	    size_t *);
+int	__cxa_demangle_gnu3_append(const char *, char **, size_t *,
+	    size_t *);
+struct demangled_symbol *
+	__cxa_demangle_gnu3_structured(const char *, int *);
+
+#ifdef __cplusplus
+}
+#endif
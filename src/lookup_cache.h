@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "atomic.h"
+
+namespace
+{
+	/**
+	 * A small, fixed-size, direct-mapped cache that may be read and updated
+	 * concurrently without locks.
+	 *
+	 * Keys and values are fixed-size arrays of words.  Each entry is guarded
+	 * by a sequence counter: a writer makes the counter odd while it updates
+	 * the entry and a reader discards anything that it read while the counter
+	 * was odd or changed.  Writers never wait for each other; if another
+	 * thread is updating an entry then the insertion is simply dropped.
+	 *
+	 * Entries start out zeroed, so a key that is entirely zero must never be
+	 * looked up.
+	 */
+	template<size_t KeyWords, size_t ValueWords, size_t Entries>
+	class lookup_cache
+	{
+		static_assert((Entries & (Entries - 1)) == 0,
+		              "Cache size must be a power of two");
+
+		/**
+		 * A single cache entry.
+		 */
+		struct entry
+		{
+			/**
+			 * Sequence counter.  Odd while a writer is updating the entry.
+			 */
+			atomic<uint32_t> sequence;
+			/**
+			 * The key for this entry.
+			 */
+			atomic<uintptr_t> key[KeyWords];
+			/**
+			 * The value associated with the key.
+			 */
+			atomic<uintptr_t> value[ValueWords];
+		};
+
+		/**
+		 * The cache entries.
+		 */
+		entry entries[Entries];
+
+		/**
+		 * Returns the entry that the specified key maps to.
+		 */
+		entry &entry_for_key(const uintptr_t (&key)[KeyWords])
+		{
+			uint64_t hash = 0;
+			for (size_t i=0 ; i<KeyWords ; i++)
+			{
+				hash = (hash ^ key[i]) * 0x9e3779b97f4a7c15ULL;
+				hash ^= hash >> 29;
+			}
+			return entries[(hash >> 32) & (Entries - 1)];
+		}
+
+		public:
+		/**
+		 * Looks up key.  On success, copies the associated value into value
+		 * and returns true.  On failure, value is left in an unspecified
+		 * state.
+		 *
+		 * The fields are read with acquire loads, so that the second read of
+		 * the sequence counter can not be reordered before any of them.
+		 */
+		bool lookup(const uintptr_t (&key)[KeyWords],
+		            uintptr_t (&value)[ValueWords])
+		{
+			entry &e = entry_for_key(key);
+			uint32_t sequence = e.sequence.load(acquire);
+			if (sequence & 1) { return false; }
+			for (size_t i=0 ; i<KeyWords ; i++)
+			{
+				if (e.key[i].load(acquire) != key[i]) { return false; }
+			}
+			for (size_t i=0 ; i<ValueWords ; i++)
+			{
+				value[i] = e.value[i].load(acquire);
+			}
+			return e.sequence.load(acquire) == sequence;
+		}
+
+		/**
+		 * Associates value with key, replacing whatever was previously in the
+		 * entry that key maps to.
+		 */
+		void insert(const uintptr_t (&key)[KeyWords],
+		            const uintptr_t (&value)[ValueWords])
+		{
+			entry &e = entry_for_key(key);
+			uint32_t sequence = e.sequence.load(acquire);
+			if ((sequence & 1) ||
+			    !e.sequence.compare_exchange(sequence, sequence + 1, acquire))
+			{
+				return;
+			}
+			for (size_t i=0 ; i<KeyWords ; i++)
+			{
+				e.key[i].store(key[i], release);
+			}
+			for (size_t i=0 ; i<ValueWords ; i++)
+			{
+				e.value[i].store(value[i], release);
+			}
+			e.sequence.store(sequence + 2, release);
+		}
+	};
+} // namespace
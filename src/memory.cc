@@ -29,19 +29,30 @@
  *
  * These definitions are intended to be used for testing and are weak symbols
  * to allow them to be replaced by definitions from a STL implementation.
- * These versions simply wrap malloc() and free(), they do not provide a
- * C++-specific allocator.
+ * By default, these versions simply wrap malloc() and free().  When built with
+ * LIBCXXRT_SIZE_CLASS_NEW, they use the size-class allocator in
+ * size_class_alloc.cc instead.
  */
 
 #include <stddef.h>
 #include <stdlib.h>
+#include <dlfcn.h>
 #include "stdexcept.h"
 #include "atomic.h"
+#ifdef LIBCXXRT_SIZE_CLASS_NEW
+#include "size_class_alloc.h"
+#endif
+#ifdef LIBCXXRT_HEAP_PROFILE
+#include "heap_profile.h"
+#else
+#include "cxxabi.h"
+#endif
 
 
 namespace std
 {
 	struct nothrow_t {};
+	enum class align_val_t : size_t {};
 }
 
 
@@ -67,7 +78,179 @@ namespace std
 	__attribute__((weak))
 	new_handler get_new_handler(void)
 	{
-		return new_handl.load();
+		return new_handl.load(memory_order::acquire);
+	}
+}
+
+namespace
+{
+	/**
+	 * Allocates memory for operator new, returning null on failure.
+	 */
+	inline void *allocate(size_t size)
+	{
+#ifdef LIBCXXRT_SIZE_CLASS_NEW
+		return size_class_alloc(size);
+#else
+		return malloc(size);
+#endif
+	}
+
+	/**
+	 * Allocates memory aligned to alignment for aligned operator new,
+	 * returning null on failure.
+	 */
+	inline void *allocate_aligned(size_t size, size_t alignment)
+	{
+#ifdef LIBCXXRT_SIZE_CLASS_NEW
+		return size_class_alloc_aligned(size, alignment);
+#else
+		if (alignment <= alignof(max_align_t))
+		{
+			return malloc(size);
+		}
+		void *mem;
+		return (posix_memalign(&mem, alignment, size) == 0) ? mem : nullptr;
+#endif
+	}
+
+	/**
+	 * Frees memory allocated with allocate().  Also used for memory from
+	 * allocate_aligned(), which is always accepted by free().
+	 */
+	inline void deallocate(void *ptr)
+	{
+#ifdef LIBCXXRT_HEAP_PROFILE
+		heap_profile_free(ptr);
+#endif
+#ifdef LIBCXXRT_SIZE_CLASS_NEW
+		size_class_free(ptr);
+#else
+		free(ptr);
+#endif
+	}
+
+	/**
+	 * Sized deallocation functions that malloc() may provide.
+	 */
+	enum sized_free_kind
+	{
+		/**
+		 * Not yet looked up.
+		 */
+		sized_free_unknown,
+		/**
+		 * No sized deallocation function; use free().
+		 */
+		sized_free_none,
+		/**
+		 * C23 free_sized().
+		 */
+		sized_free_c23,
+		/**
+		 * jemalloc-style sdallocx().
+		 */
+		sized_free_sdallocx
+	};
+
+	/**
+	 * Which sized deallocation function to use.
+	 */
+	atomic<sized_free_kind> sized_free_available{sized_free_unknown};
+
+	/**
+	 * free_sized(), if sized_free_available is sized_free_c23.
+	 */
+	void (*libc_free_sized)(void *, size_t);
+
+	/**
+	 * sdallocx(), if sized_free_available is sized_free_sdallocx.
+	 */
+	void (*libc_sdallocx)(void *, size_t, int);
+
+	/**
+	 * Returns whether two functions are defined in the same object.
+	 */
+	bool same_object(void *a, void *b)
+	{
+		Dl_info a_info, b_info;
+		return (a != nullptr) && (b != nullptr) &&
+		       (dladdr(a, &a_info) != 0) && (dladdr(b, &b_info) != 0) &&
+		       (a_info.dli_fbase == b_info.dli_fbase);
+	}
+
+	/**
+	 * Looks for a sized deallocation function.  They are looked up by name,
+	 * rather than declared weak, because newer C libraries declare
+	 * free_sized() themselves.  A function is only used if it comes from the
+	 * same object as the free() in use, so that a malloc() replacement that
+	 * lacks it is not paired with the C library's version.
+	 */
+	__attribute__((noinline))
+	sized_free_kind find_sized_free()
+	{
+		sized_free_kind kind = sized_free_none;
+		void *libc_free = dlsym(RTLD_DEFAULT, "free");
+		void *fn = dlsym(RTLD_DEFAULT, "free_sized");
+		if (same_object(fn, libc_free))
+		{
+			libc_free_sized = reinterpret_cast<void(*)(void*, size_t)>(fn);
+			kind = sized_free_c23;
+		}
+		else if (same_object(fn = dlsym(RTLD_DEFAULT, "sdallocx"), libc_free))
+		{
+			libc_sdallocx = reinterpret_cast<void(*)(void*, size_t, int)>(fn);
+			kind = sized_free_sdallocx;
+		}
+		sized_free_available.store(kind, memory_order::release);
+		return kind;
+	}
+
+	/**
+	 * Frees memory returned by malloc(size), telling the allocator the size
+	 * if it can use it.
+	 */
+	inline void free_with_size(void *ptr, size_t size)
+	{
+		sized_free_kind kind = sized_free_available.load(memory_order::acquire);
+		if (kind == sized_free_unknown)
+		{
+			kind = find_sized_free();
+		}
+		switch (kind)
+		{
+			case sized_free_c23:
+				libc_free_sized(ptr, size);
+				return;
+			case sized_free_sdallocx:
+				libc_sdallocx(ptr, size, 0);
+				return;
+			default:
+				free(ptr);
+				return;
+		}
+	}
+
+	/**
+	 * Frees memory allocated with allocate(size).
+	 */
+	inline void deallocate_sized(void *ptr, size_t size)
+	{
+		// operator new turns zero-byte requests into one-byte ones.
+		if (0 == size)
+		{
+			size = 1;
+		}
+#ifdef LIBCXXRT_HEAP_PROFILE
+		heap_profile_free(ptr);
+#endif
+#ifdef LIBCXXRT_SIZE_CLASS_NEW
+		if (size_class_free_sized(ptr, size))
+		{
+			return;
+		}
+#endif
+		free_with_size(ptr, size);
 	}
 }
 
@@ -83,7 +266,7 @@ namespace
 	/**
 	 * Helper for forwarding from no-throw operators to versions that can
 	 * return nullptr.  Catches any exception and converts it into a nullptr
-	 * return.
+	 * return.  Only used when the throwing operator has been replaced.
 	 */
 	template<void*(New)(size_t)>
 	void *noexcept_new(size_t size)
@@ -102,50 +285,130 @@ namespace
 	return New(size);
 #endif
 	}
-}
-
 
-__attribute__((weak))
-void* operator new(size_t size) BADALLOC
-{
-	if (0 == size)
-	{
-		size = 1;
-	}
-	void * mem = malloc(size);
-	while (0 == mem)
+	/**
+	 * The core of the default operator new.  Allocates size bytes with
+	 * alloc, calling the new handler each time that it fails.  Returns null,
+	 * rather than throwing, if allocation fails and there is no new handler,
+	 * so that the nothrow forms don't have to allocate and unwind an
+	 * exception to report failure.  Exceptions thrown by the new handler are
+	 * propagated.
+	 */
+	template<typename Allocator>
+	__attribute__((always_inline))
+	inline void *allocate_with_handler(size_t size, Allocator alloc)
 	{
-		new_handler h = std::get_new_handler();
-		if (0 != h)
+		if (0 == size)
 		{
-			h();
+			size = 1;
 		}
-		else
+		void * mem = alloc(size);
+		while (0 == mem)
 		{
+			new_handler h = std::get_new_handler();
+			if (0 == h)
+			{
+				return nullptr;
+			}
+			h();
+			mem = alloc(size);
+		}
+#ifdef LIBCXXRT_HEAP_PROFILE
+		heap_profile_alloc(mem, size);
+#endif
+		return mem;
+	}
+
+	/**
+	 * The default throwing operator new: throws std::bad_alloc if
+	 * allocate_with_handler() fails.
+	 */
+	template<typename Allocator>
+	__attribute__((always_inline))
+	inline void *throwing_allocate(size_t size, Allocator alloc)
+	{
+		void * mem = allocate_with_handler(size, alloc);
 #if !defined(_CXXRT_NO_EXCEPTIONS)
+		if (0 == mem)
+		{
 			throw std::bad_alloc();
+		}
+#endif
+		return mem;
+	}
+
+	/**
+	 * The default nothrow operator new: returns null if
+	 * allocate_with_handler() fails or the new handler throws.
+	 */
+	template<typename Allocator>
+	__attribute__((always_inline))
+	inline void *nothrow_allocate(size_t size, Allocator alloc)
+	{
+#if !defined(_CXXRT_NO_EXCEPTIONS)
+	try
+	{
+		return allocate_with_handler(size, alloc);
+	} catch (...)
+	{
+		return nullptr;
+	}
 #else
-			break;
+	return allocate_with_handler(size, alloc);
 #endif
-		}
-		mem = malloc(size);
 	}
+}
+
 
-	return mem;
+#ifdef __ELF__
+/**
+ * The default operator new.  The nothrow forms may only bypass
+ * operator new(size_t) if it has not been replaced, so it is defined as an
+ * alias of this function and the two addresses are compared.
+ */
+extern "C" __attribute__((visibility("hidden")))
+void *__cxxrt_default_new(size_t size) BADALLOC
+{
+	return throwing_allocate(size, allocate);
 }
 
+__attribute__((weak, alias("__cxxrt_default_new")))
+void* operator new(size_t size) BADALLOC;
 
-__attribute__((weak))
-void* operator new(size_t size, const std::nothrow_t &) _LIBCXXRT_NOEXCEPT
+/**
+ * The default operator new[], which forwards to operator new(size_t).
+ */
+extern "C" __attribute__((visibility("hidden")))
+void *__cxxrt_default_new_array(size_t size) BADALLOC
 {
-	return noexcept_new<(::operator new)>(size);
+	return ::operator new(size);
 }
 
+__attribute__((weak, alias("__cxxrt_default_new_array")))
+void * operator new[](size_t size) BADALLOC;
 
+namespace
+{
+	/**
+	 * Returns whether operator new(size_t) (and, if array is true,
+	 * operator new[](size_t)) are the defaults, so that the nothrow forms
+	 * can allocate without going through them.
+	 */
+	inline bool default_new_in_use(bool array)
+	{
+		void *(*single)(size_t) = ::operator new;
+		void *(*multiple)(size_t) = ::operator new[];
+		return (reinterpret_cast<void*>(single) ==
+		        reinterpret_cast<void*>(__cxxrt_default_new)) &&
+		       (!array || (reinterpret_cast<void*>(multiple) ==
+		                   reinterpret_cast<void*>(__cxxrt_default_new_array)));
+	}
+}
+#else
 __attribute__((weak))
-void operator delete(void * ptr) _LIBCXXRT_NOEXCEPT
+void* operator new(size_t size) BADALLOC
 {
-	free(ptr);
+	return throwing_allocate(size, allocate);
 }
 
 
@@ -155,35 +418,344 @@ void * operator new[](size_t size) BADALLOC
 	return ::operator new(size);
 }
 
+namespace
+{
+	/**
+	 * Without aliases, there is no way to tell whether operator new has been
+	 * replaced, so the nothrow forms must always call it.
+	 */
+	inline bool default_new_in_use(bool)
+	{
+		return false;
+	}
+}
+#endif
+
+
+__attribute__((weak))
+void* operator new(size_t size, const std::nothrow_t &) _LIBCXXRT_NOEXCEPT
+{
+	if (!default_new_in_use(false))
+	{
+		return noexcept_new<(::operator new)>(size);
+	}
+	return nothrow_allocate(size, allocate);
+}
+
+#ifdef __ELF__
+/**
+ * The default operator delete.  The sized forms may only bypass
+ * operator delete(void*) if it has not been replaced, so it is defined as an
+ * alias of this function and the two addresses are compared.
+ */
+extern "C" __attribute__((visibility("hidden")))
+void __cxxrt_default_delete(void * ptr) _LIBCXXRT_NOEXCEPT
+{
+	deallocate(ptr);
+}
+
+/**
+ * The default operator delete[], which forwards to operator delete(void*).
+ */
+extern "C" __attribute__((visibility("hidden")))
+void __cxxrt_default_delete_array(void * ptr) _LIBCXXRT_NOEXCEPT
+{
+	::operator delete(ptr);
+}
+
+__attribute__((weak, alias("__cxxrt_default_delete")))
+void operator delete(void * ptr) _LIBCXXRT_NOEXCEPT;
+
+namespace
+{
+	/**
+	 * Returns whether the unsized operator delete (and, if array is true,
+	 * operator delete[]) are the defaults, so that memory can be freed
+	 * directly with the size.
+	 */
+	inline bool default_delete_in_use(bool array)
+	{
+		void (*unsized)(void*) = ::operator delete;
+		void (*unsized_array)(void*) = ::operator delete[];
+		return (reinterpret_cast<void*>(unsized) ==
+		        reinterpret_cast<void*>(__cxxrt_default_delete)) &&
+		       (!array || (reinterpret_cast<void*>(unsized_array) ==
+		                   reinterpret_cast<void*>(__cxxrt_default_delete_array)));
+	}
+}
+#else
+__attribute__((weak))
+void operator delete(void * ptr) _LIBCXXRT_NOEXCEPT
+{
+	deallocate(ptr);
+}
+
+namespace
+{
+	/**
+	 * Without aliases, there is no way to tell whether operator delete has
+	 * been replaced, so the sized forms must always forward to it.
+	 */
+	inline bool default_delete_in_use(bool)
+	{
+		return false;
+	}
+}
+#endif
+
 
 __attribute__((weak))
 void * operator new[](size_t size, const std::nothrow_t &) _LIBCXXRT_NOEXCEPT
 {
-	return noexcept_new<(::operator new[])>(size);
+	if (!default_new_in_use(true))
+	{
+		return noexcept_new<(::operator new[])>(size);
+	}
+	return nothrow_allocate(size, allocate);
 }
 
 
+#ifdef __ELF__
+__attribute__((weak, alias("__cxxrt_default_delete_array")))
+void operator delete[](void * ptr) _LIBCXXRT_NOEXCEPT;
+#else
 __attribute__((weak))
 void operator delete[](void * ptr) _LIBCXXRT_NOEXCEPT
 {
 	::operator delete(ptr);
 }
+#endif
 
-// C++14 additional delete operators
+// C++14 additional delete operators.  These are defined regardless of the
+// language version that libcxxrt is built with, because C++14 code calls them.
+
+__attribute__((weak))
+void operator delete(void * ptr, size_t size) _LIBCXXRT_NOEXCEPT
+{
+	if (!default_delete_in_use(false))
+	{
+		::operator delete(ptr);
+		return;
+	}
+	deallocate_sized(ptr, size);
+}
 
-#if __cplusplus >= 201402L
 
 __attribute__((weak))
-void operator delete(void * ptr, size_t) _LIBCXXRT_NOEXCEPT
+void operator delete[](void * ptr, size_t size) _LIBCXXRT_NOEXCEPT
 {
-	::operator delete(ptr);
+	if (!default_delete_in_use(true))
+	{
+		::operator delete[](ptr);
+		return;
+	}
+	deallocate_sized(ptr, size);
+}
+
+
+// C++17 aligned new and delete operators.  Like the sized forms, these are
+// defined regardless of the language version that libcxxrt is built with.
+
+namespace
+{
+	/**
+	 * Helper for forwarding from no-throw aligned operators to versions that
+	 * can return nullptr, as noexcept_new() does for the unaligned forms.
+	 */
+	template<void*(New)(size_t, std::align_val_t)>
+	void *noexcept_aligned_new(size_t size, std::align_val_t alignment)
+	{
+#if !defined(_CXXRT_NO_EXCEPTIONS)
+	try
+	{
+		return New(size, alignment);
+	} catch (...)
+	{
+		return nullptr;
+	}
+#else
+	return New(size, alignment);
+#endif
+	}
+
+	/**
+	 * Allocator for allocate_with_handler() that returns memory with the
+	 * requested alignment.
+	 */
+	struct aligned_allocator
+	{
+		/**
+		 * The alignment, which must be a power of two.
+		 */
+		size_t alignment;
+		void *operator()(size_t size) const
+		{
+			return allocate_aligned(size, alignment);
+		}
+	};
 }
 
 
+#ifdef __ELF__
+/**
+ * The default aligned operator new.  Like __cxxrt_default_new(), it is
+ * aliased so that the nothrow forms can tell whether it has been replaced.
+ */
+extern "C" __attribute__((visibility("hidden")))
+void *__cxxrt_default_aligned_new(size_t size, std::align_val_t alignment) BADALLOC
+{
+	return throwing_allocate(size,
+	  aligned_allocator{static_cast<size_t>(alignment)});
+}
+
+__attribute__((weak, alias("__cxxrt_default_aligned_new")))
+void* operator new(size_t size, std::align_val_t alignment) BADALLOC;
+
+/**
+ * The default aligned operator new[], which forwards to aligned
+ * operator new.
+ */
+extern "C" __attribute__((visibility("hidden")))
+void *__cxxrt_default_aligned_new_array(size_t size,
+                                        std::align_val_t alignment) BADALLOC
+{
+	return ::operator new(size, alignment);
+}
+
+__attribute__((weak, alias("__cxxrt_default_aligned_new_array")))
+void * operator new[](size_t size, std::align_val_t alignment) BADALLOC;
+
+namespace
+{
+	/**
+	 * Returns whether aligned operator new (and, if array is true, aligned
+	 * operator new[]) are the defaults.
+	 */
+	inline bool default_aligned_new_in_use(bool array)
+	{
+		void *(*single)(size_t, std::align_val_t) = ::operator new;
+		void *(*multiple)(size_t, std::align_val_t) = ::operator new[];
+		return (reinterpret_cast<void*>(single) ==
+		        reinterpret_cast<void*>(__cxxrt_default_aligned_new)) &&
+		       (!array || (reinterpret_cast<void*>(multiple) ==
+		                   reinterpret_cast<void*>(__cxxrt_default_aligned_new_array)));
+	}
+}
+#else
 __attribute__((weak))
-void operator delete[](void * ptr, size_t) _LIBCXXRT_NOEXCEPT
+void* operator new(size_t size, std::align_val_t alignment) BADALLOC
 {
-	::operator delete(ptr);
+	return throwing_allocate(size,
+	  aligned_allocator{static_cast<size_t>(alignment)});
+}
+
+
+__attribute__((weak))
+void * operator new[](size_t size, std::align_val_t alignment) BADALLOC
+{
+	return ::operator new(size, alignment);
+}
+
+namespace
+{
+	/**
+	 * Without aliases, the nothrow forms must always call the throwing ones.
+	 */
+	inline bool default_aligned_new_in_use(bool)
+	{
+		return false;
+	}
+}
+#endif
+
+
+__attribute__((weak))
+void* operator new(size_t size,
+                   std::align_val_t alignment,
+                   const std::nothrow_t &) _LIBCXXRT_NOEXCEPT
+{
+	if (!default_aligned_new_in_use(false))
+	{
+		return noexcept_aligned_new<(::operator new)>(size, alignment);
+	}
+	return nothrow_allocate(size,
+	  aligned_allocator{static_cast<size_t>(alignment)});
+}
+
+
+__attribute__((weak))
+void * operator new[](size_t size,
+                      std::align_val_t alignment,
+                      const std::nothrow_t &) _LIBCXXRT_NOEXCEPT
+{
+	if (!default_aligned_new_in_use(true))
+	{
+		return noexcept_aligned_new<(::operator new[])>(size, alignment);
+	}
+	return nothrow_allocate(size,
+	  aligned_allocator{static_cast<size_t>(alignment)});
+}
+
+
+__attribute__((weak))
+void operator delete(void * ptr, std::align_val_t) _LIBCXXRT_NOEXCEPT
+{
+	deallocate(ptr);
+}
+
+
+__attribute__((weak))
+void operator delete(void * ptr,
+                     size_t,
+                     std::align_val_t alignment) _LIBCXXRT_NOEXCEPT
+{
+	::operator delete(ptr, alignment);
+}
+
+
+__attribute__((weak))
+void operator delete(void * ptr,
+                     std::align_val_t alignment,
+                     const std::nothrow_t &) _LIBCXXRT_NOEXCEPT
+{
+	::operator delete(ptr, alignment);
+}
+
+
+__attribute__((weak))
+void operator delete[](void * ptr, std::align_val_t alignment) _LIBCXXRT_NOEXCEPT
+{
+	::operator delete(ptr, alignment);
+}
+
+
+__attribute__((weak))
+void operator delete[](void * ptr,
+                       size_t,
+                       std::align_val_t alignment) _LIBCXXRT_NOEXCEPT
+{
+	::operator delete[](ptr, alignment);
 }
 
+
+__attribute__((weak))
+void operator delete[](void * ptr,
+                       std::align_val_t alignment,
+                       const std::nothrow_t &) _LIBCXXRT_NOEXCEPT
+{
+	::operator delete[](ptr, alignment);
+}
+
+
+#ifndef LIBCXXRT_HEAP_PROFILE
+namespace pathscale
+{
+	/**
+	 * Without the heap profiler, there is never a profile to write.
+	 */
+	bool heap_profile_dump(const char *) _LIBCXXRT_NOEXCEPT
+	{
+		return false;
+	}
+}
 #endif
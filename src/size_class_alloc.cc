@@ -0,0 +1,820 @@
+/**
+ * size_class_alloc.cc - Size-class allocator used by operator new.
+ *
+ * Small requests are rounded up to one of a fixed set of size classes.  Each
+ * thread has a cache holding a free list for every class, so most allocations
+ * and deallocations are a few instructions with no atomic operations.
+ *
+ * Memory comes from a single range of address space, reserved on first use,
+ * that is handed out in 64KB spans.  Every span holds objects of one class,
+ * and starts with a header recording that class and the thread cache that
+ * carved it (its owner).  A pointer is recognised as ours by checking whether
+ * it is within the range, and its span header is found by masking off the low
+ * bits, so no size needs to be passed to operator delete.
+ *
+ * Objects freed by the owner of their span go on its local free list.
+ * Objects freed by any other thread are pushed onto the owner's remote-free
+ * stack, which is lock free, and are collected by the owner the next time
+ * that one of its free lists runs dry.  When a local free list grows too
+ * long, a batch of objects is moved to a central, per-class pool, from which
+ * threads refill their lists a batch at a time before carving new spans.
+ *
+ * When a thread exits, its cache returns its full batches to the central pool
+ * and is then abandoned.  Caches are never freed, because other threads may
+ * still free objects from its spans; instead, the next thread to start
+ * adopts an abandoned cache, along with anything freed to it in the meantime.
+ *
+ * Spans are never unmapped or moved to another class.  Telling when every
+ * object in a span is free would need a count of live objects in each span,
+ * updated on every allocation and deallocation, including by threads that do
+ * not own the span, which would cost the fast paths an atomic operation.
+ *
+ * In huge page mode, the range is aligned to 2MB, marked with
+ * MADV_HUGEPAGE, and made accessible 2MB at a time, so that the kernel can
+ * back it with transparent huge pages.  Programs that keep millions of small
+ * nodes live then take far fewer TLB misses walking them.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "atomic.h"
+#include "size_class_alloc.h"
+
+#pragma weak pthread_key_create
+#pragma weak pthread_setspecific
+#pragma weak pthread_once
+#ifdef LIBCXXRT_WEAK_LOCKS
+#pragma weak pthread_mutex_lock
+#define pthread_mutex_lock(mtx) do {\
+	if (pthread_mutex_lock) pthread_mutex_lock(mtx);\
+	} while(0)
+#pragma weak pthread_mutex_unlock
+#define pthread_mutex_unlock(mtx) do {\
+	if (pthread_mutex_unlock) pthread_mutex_unlock(mtx);\
+	} while(0)
+#endif
+
+#ifndef MAP_ANON
+#define MAP_ANON MAP_ANONYMOUS
+#endif
+
+#ifndef LIBCXXRT_NEW_REGION_SIZE
+/**
+ * The amount of address space reserved for small allocations.  Only the spans
+ * that are actually used are made accessible.
+ */
+#	if UINTPTR_MAX > 0xffffffffU
+#		define LIBCXXRT_NEW_REGION_SIZE (64ULL << 30)
+#	else
+#		define LIBCXXRT_NEW_REGION_SIZE (256UL << 20)
+#	endif
+#endif
+
+#ifdef LIBCXXRT_NEW_HUGE_PAGES
+/**
+ * Huge page mode is on unless the LIBCXXRT_NEW_HUGE_PAGES environment variable
+ * is set to 0.
+ */
+#	define LIBCXXRT_NEW_HUGE_PAGES_DEFAULT true
+#else
+/**
+ * Huge page mode is off unless the LIBCXXRT_NEW_HUGE_PAGES environment
+ * variable is set to 1.
+ */
+#	define LIBCXXRT_NEW_HUGE_PAGES_DEFAULT false
+#endif
+
+namespace
+{
+	/**
+	 * The size of a span, which must be a power of two.  Spans are aligned
+	 * to their size.
+	 */
+	constexpr size_t span_size = 64 * 1024;
+
+	/**
+	 * The size of a transparent huge page.  In huge page mode, the range is
+	 * aligned to this and made accessible in chunks of this size.
+	 */
+	constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+	static_assert(huge_page_size % span_size == 0,
+	              "Huge pages must hold a whole number of spans");
+
+	/**
+	 * The offset of the first object in a span.  The span header lives
+	 * below this.
+	 */
+	constexpr size_t span_header_size = 64;
+
+	/**
+	 * The number of size classes.
+	 */
+	constexpr unsigned size_classes = 32;
+
+	/**
+	 * The largest request served from a size class.  Anything larger goes to
+	 * malloc().
+	 */
+	constexpr size_t max_small_size = 8192;
+
+	/**
+	 * Returns the size of objects in a class.  The first eight classes are
+	 * multiples of 16 bytes, up to 128.  After that, there are four classes
+	 * for each power of two, up to 8KB.
+	 */
+	constexpr size_t class_size(unsigned size_class)
+	{
+		return (size_class < 8) ? (size_class + 1) * 16 :
+		       static_cast<size_t>(5 + ((size_class - 8) % 4))
+		         << (5 + (size_class - 8) / 4);
+	}
+
+	static_assert(class_size(size_classes - 1) == max_small_size,
+	              "Largest size class must match max_small_size");
+
+	/**
+	 * Returns the smallest class whose objects can hold size bytes.  size
+	 * must be between 1 and max_small_size.
+	 */
+	inline unsigned size_to_class(size_t size)
+	{
+		if (size <= 128)
+		{
+			return static_cast<unsigned>((size + 15) / 16) - 1;
+		}
+		size_t rounded = size - 1;
+		unsigned log2 = (sizeof(size_t) * 8 - 1) - __builtin_clzl(rounded);
+		return 8 + (log2 - 7) * 4 +
+		       static_cast<unsigned>(rounded >> (log2 - 2)) - 4;
+	}
+
+	/**
+	 * Returns the number of objects moved between a thread cache and the
+	 * central pool at once.
+	 */
+	constexpr unsigned batch_size(unsigned size_class)
+	{
+		return (32768 / class_size(size_class) > 64) ? 64 :
+		       (32768 / class_size(size_class) < 4) ? 4 :
+		       static_cast<unsigned>(32768 / class_size(size_class));
+	}
+
+	/**
+	 * A free object.  Every class is at least 16 bytes, so there is room for
+	 * two links.
+	 */
+	struct free_object
+	{
+		/**
+		 * The next object in the same list or batch.
+		 */
+		free_object *next;
+		/**
+		 * In the first object of a batch in the central pool, the next
+		 * batch.
+		 */
+		free_object *next_batch;
+	};
+
+	/**
+	 * A free list in a thread cache.
+	 */
+	struct free_list
+	{
+		/**
+		 * The first free object.
+		 */
+		free_object *head;
+		/**
+		 * The number of objects in the list.
+		 */
+		unsigned count;
+	};
+
+	/**
+	 * Per-thread cache.
+	 */
+	struct thread_cache
+	{
+		/**
+		 * Free objects, one list per class.
+		 */
+		free_list free[size_classes];
+		/**
+		 * For each class, the next unused object in the span that is being
+		 * carved.
+		 */
+		char *carve[size_classes];
+		/**
+		 * For each class, the end of the space in the span being carved.
+		 */
+		char *carve_end[size_classes];
+		/**
+		 * Objects from this cache's spans freed by other threads.  Other
+		 * threads only push; the owner takes the whole list at once, so there
+		 * is no ABA problem.
+		 */
+		atomic<free_object*> remote_free;
+		/**
+		 * The next cache in the list of abandoned caches.
+		 */
+		thread_cache *next_abandoned;
+	};
+
+	/**
+	 * The header at the start of each span.
+	 */
+	struct span_header
+	{
+		/**
+		 * The cache that carved this span.
+		 */
+		thread_cache *owner;
+		/**
+		 * The class of the objects in this span.
+		 */
+		unsigned size_class;
+	};
+
+	static_assert(sizeof(span_header) <= span_header_size,
+	              "Span header is too large");
+
+	static_assert((max_small_size % span_header_size == 0) &&
+	              (span_header_size % alignof(max_align_t) == 0),
+	              "Aligned classes need the largest class and the header to "
+	              "be multiples of the largest supported alignment");
+
+	/**
+	 * Central pool of free objects for one class, held as a list of full
+	 * batches.
+	 */
+	struct central_list
+	{
+		/**
+		 * Lock protecting the list.
+		 */
+		pthread_mutex_t lock;
+		/**
+		 * The first batch.
+		 */
+		free_object *batches;
+	};
+
+	/**
+	 * The central pools.
+	 */
+	central_list central[size_classes];
+
+	/**
+	 * Start of the reserved range, or null if it has not been reserved yet.
+	 */
+	atomic<char*> region_base;
+
+	/**
+	 * Set if reserving the range failed, in which case everything is passed
+	 * to malloc().
+	 */
+	atomic<bool> region_failed;
+
+	/**
+	 * The index of the next span to hand out.
+	 */
+	atomic<size_t> next_span;
+
+	/**
+	 * The amount of the range that is accessible, in bytes from its start.
+	 */
+	atomic<size_t> committed_size;
+
+	/**
+	 * The amount by which committed_size grows each time that it is
+	 * exhausted: a span normally, or a huge page in huge page mode.  Set
+	 * before region_base is published.
+	 */
+	atomic<size_t> commit_granule;
+
+	/**
+	 * Lock serialising the growth of committed_size.
+	 */
+	pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+	/**
+	 * Caches whose threads have exited, waiting to be adopted.
+	 */
+	thread_cache *abandoned_caches;
+
+	/**
+	 * Lock protecting abandoned_caches.
+	 */
+	pthread_mutex_t abandoned_lock = PTHREAD_MUTEX_INITIALIZER;
+
+	/**
+	 * Key used to run release_thread_cache() when a thread exits.
+	 */
+	pthread_key_t cache_key;
+
+	/**
+	 * Set if cache_key was successfully created.
+	 */
+	bool cache_key_valid;
+
+	/**
+	 * Once control used to protect init_thread_support().
+	 */
+	pthread_once_t thread_support_once = PTHREAD_ONCE_INIT;
+
+	/**
+	 * The calling thread's cache.  The initial-exec model is only used when
+	 * LIBCXXRT_TLS_THREAD_INFO opts in to it, because a library using it
+	 * may fail to load with dlopen().
+	 */
+#ifdef LIBCXXRT_TLS_THREAD_INFO
+	__thread thread_cache *current_cache __attribute__((tls_model("initial-exec")));
+#else
+	__thread thread_cache *current_cache;
+#endif
+
+	/**
+	 * Returns the header of the span containing ptr.
+	 */
+	inline span_header *span_of(void *ptr)
+	{
+		return reinterpret_cast<span_header*>(
+		  reinterpret_cast<uintptr_t>(ptr) & ~(span_size - 1));
+	}
+
+	/**
+	 * Returns whether ptr was allocated from the reserved range.
+	 */
+	inline bool in_region(void *ptr)
+	{
+		char *base = region_base.load(memory_order::acquire);
+		return (base != nullptr) &&
+		       (static_cast<size_t>(static_cast<char*>(ptr) - base) <
+		        LIBCXXRT_NEW_REGION_SIZE);
+	}
+
+	/**
+	 * Returns whether the range should be backed by huge pages, from the
+	 * LIBCXXRT_NEW_HUGE_PAGES environment variable or the build default.
+	 */
+	bool huge_pages_requested()
+	{
+#ifdef MADV_HUGEPAGE
+		const char *env = getenv("LIBCXXRT_NEW_HUGE_PAGES");
+		if ((env != nullptr) && (*env != '\0'))
+		{
+			return strcmp(env, "0") != 0;
+		}
+		return LIBCXXRT_NEW_HUGE_PAGES_DEFAULT;
+#else
+		return false;
+#endif
+	}
+
+	/**
+	 * Reserves the address range.  Returns its start, or null on failure.
+	 * Races are resolved by keeping the first range to be published.
+	 */
+	char *reserve_region()
+	{
+		if (region_failed.load(memory_order::acquire))
+		{
+			return nullptr;
+		}
+		bool huge = huge_pages_requested();
+		size_t alignment = huge ? huge_page_size : span_size;
+		// Over-allocate, so that the start can be aligned.
+		size_t length = LIBCXXRT_NEW_REGION_SIZE + alignment;
+		int flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_NORESERVE
+		flags |= MAP_NORESERVE;
+#endif
+		void *mapping = mmap(nullptr, length, PROT_NONE, flags, -1, 0);
+		if (mapping == MAP_FAILED)
+		{
+			region_failed.store(true, memory_order::release);
+			return nullptr;
+		}
+		char *start = static_cast<char*>(mapping);
+		char *aligned = reinterpret_cast<char*>(
+		  (reinterpret_cast<uintptr_t>(start) + alignment - 1) &
+		  ~(alignment - 1));
+#ifdef MADV_HUGEPAGE
+		// The advice sticks to the mapping as parts of it are made
+		// accessible.  If the kernel doesn't support it, the range still
+		// works, just with small pages.
+		if (huge)
+		{
+			madvise(aligned, LIBCXXRT_NEW_REGION_SIZE, MADV_HUGEPAGE);
+		}
+#endif
+		commit_granule.store(alignment, memory_order::release);
+		char *expected = nullptr;
+		if (!region_base.compare_exchange(expected, aligned))
+		{
+			munmap(mapping, length);
+			return expected;
+		}
+		if (aligned != start)
+		{
+			munmap(start, aligned - start);
+		}
+		char *end = aligned + LIBCXXRT_NEW_REGION_SIZE;
+		if (end != start + length)
+		{
+			munmap(end, (start + length) - end);
+		}
+		return aligned;
+	}
+
+	/**
+	 * Makes the range accessible up to at least size bytes from its start,
+	 * a whole commit granule at a time.  Returns false on failure.
+	 */
+	bool commit_range(char *base, size_t size)
+	{
+		bool success = true;
+		size_t granule = commit_granule.load(memory_order::acquire);
+		pthread_mutex_lock(&commit_lock);
+		size_t committed = committed_size.load(memory_order::acquire);
+		while (committed < size)
+		{
+			size_t length = granule;
+			if (length > LIBCXXRT_NEW_REGION_SIZE - committed)
+			{
+				length = LIBCXXRT_NEW_REGION_SIZE - committed;
+			}
+			if (mprotect(base + committed, length, PROT_READ | PROT_WRITE) != 0)
+			{
+				success = false;
+				break;
+			}
+			committed += length;
+			committed_size.store(committed, memory_order::release);
+		}
+		pthread_mutex_unlock(&commit_lock);
+		return success;
+	}
+
+	/**
+	 * Hands out a new span of the specified class, owned by cache.  Returns
+	 * null if the range is exhausted or can not be reserved.
+	 */
+	span_header *new_span(thread_cache *cache, unsigned size_class)
+	{
+		char *base = region_base.load(memory_order::acquire);
+		if ((base == nullptr) && ((base = reserve_region()) == nullptr))
+		{
+			return nullptr;
+		}
+		size_t index = next_span.fetch_add(1);
+		if (index >= LIBCXXRT_NEW_REGION_SIZE / span_size)
+		{
+			return nullptr;
+		}
+		size_t end = (index + 1) * span_size;
+		if ((committed_size.load(memory_order::acquire) < end) &&
+		    !commit_range(base, end))
+		{
+			return nullptr;
+		}
+		char *span = base + index * span_size;
+		span_header *header = reinterpret_cast<span_header*>(span);
+		header->owner = cache;
+		header->size_class = size_class;
+		return header;
+	}
+
+	/**
+	 * Pushes a full batch, starting with first, onto the central pool.
+	 */
+	void central_push(unsigned size_class, free_object *first)
+	{
+		central_list &list = central[size_class];
+		pthread_mutex_lock(&list.lock);
+		first->next_batch = list.batches;
+		list.batches = first;
+		pthread_mutex_unlock(&list.lock);
+	}
+
+	/**
+	 * Pops a full batch from the central pool, or returns null if it is
+	 * empty.
+	 */
+	free_object *central_pop(unsigned size_class)
+	{
+		central_list &list = central[size_class];
+		pthread_mutex_lock(&list.lock);
+		free_object *first = list.batches;
+		if (first != nullptr)
+		{
+			list.batches = first->next_batch;
+		}
+		pthread_mutex_unlock(&list.lock);
+		return first;
+	}
+
+	/**
+	 * Moves a batch from the front of one of a cache's free lists to the
+	 * central pool.  The list must hold at least a batch.
+	 */
+	void release_batch(thread_cache *cache, unsigned size_class)
+	{
+		free_list &list = cache->free[size_class];
+		free_object *first = list.head;
+		free_object *last = first;
+		for (unsigned i=1 ; i<batch_size(size_class) ; i++)
+		{
+			last = last->next;
+		}
+		list.head = last->next;
+		list.count -= batch_size(size_class);
+		last->next = nullptr;
+		central_push(size_class, first);
+	}
+
+	/**
+	 * Adds an object to the appropriate free list of its owner, which must be
+	 * cache.
+	 */
+	inline void local_free(thread_cache *cache, unsigned size_class,
+	                       free_object *object)
+	{
+		free_list &list = cache->free[size_class];
+		object->next = list.head;
+		list.head = object;
+		if (++list.count >= 2 * batch_size(size_class))
+		{
+			release_batch(cache, size_class);
+		}
+	}
+
+	/**
+	 * Moves everything that other threads have freed to cache onto its local
+	 * free lists.
+	 */
+	void collect_remote_frees(thread_cache *cache)
+	{
+		free_object *object = cache->remote_free.exchange(nullptr,
+		                                                  memory_order::acquire);
+		while (object != nullptr)
+		{
+			free_object *next = object->next;
+			local_free(cache, span_of(object)->size_class, object);
+			object = next;
+		}
+	}
+
+	/**
+	 * Returns a cache's objects to the central pool and abandons it.  Called
+	 * when a thread exits.
+	 */
+	void release_thread_cache(void *arg)
+	{
+		thread_cache *cache = static_cast<thread_cache*>(arg);
+		collect_remote_frees(cache);
+		for (unsigned i=0 ; i<size_classes ; i++)
+		{
+			while (cache->free[i].count >= batch_size(i))
+			{
+				release_batch(cache, i);
+			}
+		}
+		current_cache = nullptr;
+		pthread_mutex_lock(&abandoned_lock);
+		cache->next_abandoned = abandoned_caches;
+		abandoned_caches = cache;
+		pthread_mutex_unlock(&abandoned_lock);
+	}
+
+	/**
+	 * Initialises the central pool locks and creates the key used to find out
+	 * when threads exit.
+	 */
+	void init_thread_support()
+	{
+		for (central_list &list : central)
+		{
+			pthread_mutex_init(&list.lock, nullptr);
+		}
+		cache_key_valid = (pthread_key_create != nullptr) &&
+		                  (pthread_setspecific != nullptr) &&
+		                  (pthread_key_create(&cache_key,
+		                                      release_thread_cache) == 0);
+	}
+
+	/**
+	 * Gives the calling thread a cache, adopting an abandoned one if possible.
+	 * Returns null if no cache can be allocated.
+	 */
+	__attribute__((noinline))
+	thread_cache *create_thread_cache()
+	{
+		// Without pthread_once(), the program can't have created any threads,
+		// so the locks are never contended and no thread will exit.
+		bool notify_exit = (pthread_once != nullptr) &&
+		  (pthread_once(&thread_support_once, init_thread_support) == 0) &&
+		  cache_key_valid;
+		pthread_mutex_lock(&abandoned_lock);
+		thread_cache *cache = abandoned_caches;
+		if (cache != nullptr)
+		{
+			abandoned_caches = cache->next_abandoned;
+			cache->next_abandoned = nullptr;
+		}
+		pthread_mutex_unlock(&abandoned_lock);
+		if (cache == nullptr)
+		{
+			cache = static_cast<thread_cache*>(calloc(1, sizeof(thread_cache)));
+			if (cache == nullptr)
+			{
+				return nullptr;
+			}
+		}
+		current_cache = cache;
+		if (notify_exit)
+		{
+			pthread_setspecific(cache_key, cache);
+		}
+		return cache;
+	}
+
+	/**
+	 * Allocates memory from the C library, for requests that can't be served
+	 * from a size class.
+	 */
+	void *system_alloc(size_t size, size_t alignment)
+	{
+		if (alignment <= alignof(max_align_t))
+		{
+			return malloc(size);
+		}
+		void *mem;
+		if (alignment < sizeof(void*))
+		{
+			alignment = sizeof(void*);
+		}
+		return (posix_memalign(&mem, alignment, size) == 0) ? mem : nullptr;
+	}
+
+	/**
+	 * Pops an object from one of the calling thread's free lists, or returns
+	 * null if the thread has no cache or the list is empty.
+	 */
+	inline void *pop_local(unsigned size_class)
+	{
+		thread_cache *cache = current_cache;
+		if (cache == nullptr)
+		{
+			return nullptr;
+		}
+		free_list &list = cache->free[size_class];
+		free_object *object = list.head;
+		if (object != nullptr)
+		{
+			list.head = object->next;
+			list.count--;
+		}
+		return object;
+	}
+
+	/**
+	 * Slow path for allocation, used when the thread's free list for the
+	 * class is empty.  If the object can't come from a span, falls back to
+	 * the C library with the requested size, so that a sized free of such an
+	 * object can pass its size on.
+	 */
+	__attribute__((noinline))
+	void *alloc_slow(unsigned size_class, size_t requested, size_t alignment)
+	{
+		thread_cache *cache = current_cache;
+		if ((cache == nullptr) && ((cache = create_thread_cache()) == nullptr))
+		{
+			return system_alloc(requested, alignment);
+		}
+		free_list &list = cache->free[size_class];
+		// Take back anything that other threads have freed.
+		collect_remote_frees(cache);
+		if (list.head == nullptr)
+		{
+			// Refill from the central pool.
+			free_object *batch = central_pop(size_class);
+			if (batch != nullptr)
+			{
+				list.head = batch;
+				list.count = batch_size(size_class);
+			}
+		}
+		if (list.head != nullptr)
+		{
+			free_object *object = list.head;
+			list.head = object->next;
+			list.count--;
+			return object;
+		}
+		// Carve a new object, starting a new span if necessary.
+		size_t size = class_size(size_class);
+		if (cache->carve[size_class] == cache->carve_end[size_class])
+		{
+			span_header *span = new_span(cache, size_class);
+			if (span == nullptr)
+			{
+				return system_alloc(requested, alignment);
+			}
+			char *start = reinterpret_cast<char*>(span) + span_header_size;
+			cache->carve[size_class] = start;
+			cache->carve_end[size_class] = start +
+			  ((span_size - span_header_size) / size) * size;
+		}
+		void *object = cache->carve[size_class];
+		cache->carve[size_class] += size;
+		return object;
+	}
+
+	/**
+	 * Frees an object from the span, which must be of the specified class.
+	 */
+	inline void span_free(span_header *span, unsigned size_class, void *ptr)
+	{
+		free_object *object = static_cast<free_object*>(ptr);
+		thread_cache *owner = span->owner;
+		if (owner == current_cache)
+		{
+			local_free(owner, size_class, object);
+			return;
+		}
+		free_object *head = owner->remote_free.load(memory_order::acquire);
+		do
+		{
+			object->next = head;
+		} while (!owner->remote_free.compare_exchange(head, object));
+	}
+}
+
+void *size_class_alloc(size_t size)
+{
+	if (size > max_small_size)
+	{
+		return malloc(size);
+	}
+	unsigned size_class = size_to_class(size == 0 ? 1 : size);
+	if (void *object = pop_local(size_class))
+	{
+		return object;
+	}
+	return alloc_slow(size_class, size, alignof(max_align_t));
+}
+
+void *size_class_alloc_aligned(size_t size, size_t alignment)
+{
+	if (alignment <= alignof(max_align_t))
+	{
+		return size_class_alloc(size);
+	}
+	// Objects start at the end of the span header, so classes that are
+	// multiples of the alignment give aligned objects up to its size.
+	size_t rounded = (size + alignment - 1) & ~(alignment - 1);
+	if ((alignment > span_header_size) || (rounded > max_small_size) ||
+	    (rounded < size))
+	{
+		return system_alloc(size, alignment);
+	}
+	unsigned size_class = size_to_class(rounded == 0 ? alignment : rounded);
+	// The largest class is a multiple of every alignment that we handle, so
+	// this terminates.
+	while ((class_size(size_class) & (alignment - 1)) != 0)
+	{
+		size_class++;
+	}
+	if (void *object = pop_local(size_class))
+	{
+		return object;
+	}
+	return alloc_slow(size_class, size, alignment);
+}
+
+void size_class_free(void *ptr)
+{
+	if (!in_region(ptr))
+	{
+		free(ptr);
+		return;
+	}
+	span_header *span = span_of(ptr);
+	span_free(span, span->size_class, ptr);
+}
+
+bool size_class_free_sized(void *ptr, size_t size)
+{
+	// Large requests always go to malloc(), so don't need the range check.
+	if ((size > max_small_size) || !in_region(ptr))
+	{
+		return false;
+	}
+	span_free(span_of(ptr), size_to_class(size), ptr);
+	return true;
+}
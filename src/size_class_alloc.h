@@ -0,0 +1,49 @@
+/**
+ * size_class_alloc.h - Size-class allocator used by operator new.
+ *
+ * When LIBCXXRT_SIZE_CLASS_NEW is defined, the default operator new and
+ * operator delete serve small allocations from per-thread caches of fixed-size
+ * objects, carved from 64KB spans in a single reserved address range.  Larger
+ * allocations, and everything if the range can not be reserved, are passed to
+ * malloc().
+ *
+ * Spans are never returned to the operating system, and a span is never
+ * reused for a different size class, even when all of its objects are free.
+ * Freed objects are only reused for allocations of the same class.  A program
+ * whose mix of allocation sizes changes between phases therefore keeps the
+ * peak memory that it used for each class until it exits.
+ *
+ * Setting the LIBCXXRT_NEW_HUGE_PAGES environment variable to 1 (or building
+ * with LIBCXXRT_NEW_HUGE_PAGES defined and not setting it to 0) aligns the
+ * range to 2MB and asks for it to be backed by transparent huge pages.
+ */
+#pragma once
+#include <stddef.h>
+
+/**
+ * Allocates size bytes, aligned for any fundamental type.  Returns null if the
+ * memory can not be allocated.  Never calls the new handler.
+ */
+void *size_class_alloc(size_t size);
+
+/**
+ * Allocates size bytes aligned to alignment, which must be a power of two.
+ * Alignments of up to 64 bytes are served from size classes whose objects are
+ * multiples of the alignment, so no space is wasted beyond rounding the size
+ * up.  Larger alignments go to posix_memalign().  Returns null if the memory
+ * can not be allocated.
+ */
+void *size_class_alloc_aligned(size_t size, size_t alignment);
+
+/**
+ * Frees memory returned by size_class_alloc() or size_class_alloc_aligned().
+ * ptr may be null.
+ */
+void size_class_free(void *ptr);
+
+/**
+ * Frees memory returned by size_class_alloc(size), taking the size class from
+ * size rather than from the span.  Returns false, without freeing anything, if
+ * the memory came from malloc(size), in which case the caller must free it.
+ */
+bool size_class_free_sized(void *ptr, size_t size);
@@ -25,6 +25,9 @@
  */
 
 #include "typeinfo.h"
+#include "cxxabi.h"
+#include "libelftc_dem_gnu3.h"
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -69,8 +72,39 @@ ABI_NAMESPACE::__pbase_type_info::~__pbase_type_info() {}
 ABI_NAMESPACE::__pointer_type_info::~__pointer_type_info() {}
 ABI_NAMESPACE::__pointer_to_member_type_info::~__pointer_to_member_type_info() {}
 
-// From libelftc
-extern "C" char    *__cxa_demangle_gnu3(const char *);
+// The demangler fills in the C structs, which are returned to callers as the
+// public ones, so the two must have the same layout.
+static_assert(sizeof(pathscale::demangle_token_kind) == sizeof(int),
+    "demangle_token_kind should be stored as an int");
+static_assert(pathscale::demangle_special == DEM_TOKEN_SPECIAL &&
+    pathscale::demangle_return_type == DEM_TOKEN_RETURN_TYPE &&
+    pathscale::demangle_scope == DEM_TOKEN_SCOPE &&
+    pathscale::demangle_name == DEM_TOKEN_NAME &&
+    pathscale::demangle_template_args == DEM_TOKEN_TEMPLATE_ARGS &&
+    pathscale::demangle_parameter == DEM_TOKEN_PARAMETER &&
+    pathscale::demangle_qualifiers == DEM_TOKEN_QUALIFIERS,
+    "demangle_token_kind should have the same values as the C enum");
+static_assert(sizeof(pathscale::demangle_token) == sizeof(::demangle_token),
+    "demangle_token should have the same size as the C struct");
+static_assert(offsetof(pathscale::demangle_token, kind) ==
+    offsetof(::demangle_token, kind) &&
+    offsetof(pathscale::demangle_token, offset) ==
+    offsetof(::demangle_token, offset) &&
+    offsetof(pathscale::demangle_token, length) ==
+    offsetof(::demangle_token, length),
+    "demangle_token fields should have the same offsets as the C struct");
+static_assert(sizeof(pathscale::demangled_symbol) ==
+    sizeof(::demangled_symbol),
+    "demangled_symbol should have the same size as the C struct");
+static_assert(offsetof(pathscale::demangled_symbol, text) ==
+    offsetof(::demangled_symbol, text) &&
+    offsetof(pathscale::demangled_symbol, length) ==
+    offsetof(::demangled_symbol, length) &&
+    offsetof(pathscale::demangled_symbol, token_count) ==
+    offsetof(::demangled_symbol, token_count) &&
+    offsetof(pathscale::demangled_symbol, tokens) ==
+    offsetof(::demangled_symbol, tokens),
+    "demangled_symbol fields should have the same offsets as the C struct");
 
 extern "C" char* __cxa_demangle(const char* mangled_name,
                                 char* buf,
@@ -82,43 +116,50 @@ extern "C" char* __cxa_demangle(const char* mangled_name,
 	// however, and for our changes to be pushed upstream.  We also need to
 	// call a different demangling function here depending on the ABI (e.g.
 	// ARM).
-	char *demangled = __cxa_demangle_gnu3(mangled_name);
-	if (NULL != demangled)
+	if ((NULL != buf) && (NULL == n))
 	{
-		size_t len = strlen(demangled);
-		if (!buf || (*n < len+1))
-		{
-			buf = static_cast<char*>(realloc(buf, len+1));
-		}
-		if (0 != buf)
-		{
-			memcpy(buf, demangled, len);
-			buf[len] = 0;
-			if (n)
-			{
-				*n = len;
-			}
-			if (status)
-			{
-				*status = 0;
-			}
-		}
-		else
+		if (status)
 		{
-			if (status)
-			{
-				*status = -1;
-			}
+			*status = -3;
 		}
-		free(demangled);
+		return NULL;
 	}
-	else
+	// The demangler renders straight into buf, only growing it if the
+	// result doesn't fit.
+	size_t size = buf ? *n : 0;
+	size_t len;
+	int result = __cxa_demangle_gnu3_buf(mangled_name, &buf, &size, &len);
+	if (status)
+	{
+		*status = result;
+	}
+	if (0 != result)
 	{
-		if (status)
-		{
-			*status = -2;
-		}
 		return NULL;
 	}
+	if (n)
+	{
+		*n = len;
+	}
 	return buf;
 }
+
+namespace pathscale
+{
+	int demangled_length(const char *mangled_name,
+	                     size_t *length) _LIBCXXRT_NOEXCEPT
+	{
+		if (NULL == length)
+		{
+			return -3;
+		}
+		return __cxa_demangle_gnu3_buf(mangled_name, NULL, NULL, length);
+	}
+
+	demangled_symbol *demangle_structured(const char *mangled_name,
+	                                      int *status) _LIBCXXRT_NOEXCEPT
+	{
+		return reinterpret_cast<demangled_symbol*>(
+			__cxa_demangle_gnu3_structured(mangled_name, status));
+	}
+}
@@ -253,6 +253,32 @@ namespace ABI_NAMESPACE
 		virtual void *cast_to(void *obj, const struct __class_type_info *other) const;
 	};
 
+	/**
+	 * Returns whether the class hierarchy rooted at type has any virtual
+	 * bases, in which case the offsets of some of its subobjects must be read
+	 * from the object's vtable.
+	 */
+	inline bool __has_virtual_base(const std::type_info *type)
+	{
+		if (const __si_class_type_info *si =
+		    dynamic_cast<const __si_class_type_info*>(type))
+		{
+			return __has_virtual_base(si->__base_type);
+		}
+		const __vmi_class_type_info *vmi =
+			dynamic_cast<const __vmi_class_type_info*>(type);
+		if (0 == vmi) { return false; }
+		for (unsigned int i=0 ; i<vmi->__base_count ; i++)
+		{
+			const __base_class_type_info *info = &vmi->__base_info[i];
+			if (info->isVirtual() || __has_virtual_base(info->__base_type))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
 	/**
 	 * Base class used for both pointer and pointer-to-member type info.
 	 */
@@ -0,0 +1,20 @@
+/**
+ * eh_index_module.cc - Module that cxxrt-test-eh-index loads and unloads.
+ */
+
+/**
+ * Calls fn inside a handler, so that this module has an LSDA.  Returns 1 if
+ * fn throws, or 0 otherwise.
+ */
+extern "C" int eh_index_module_call(void (*fn)())
+{
+	try
+	{
+		fn();
+	}
+	catch (...)
+	{
+		return 1;
+	}
+	return 0;
+}
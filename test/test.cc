@@ -35,7 +35,9 @@ static void __attribute__((constructor)) init(void)
 void test_type_info(void);
 void test_exceptions();
 void test_init_primary_exception(void);
+void test_callsite_encodings(void);
 void test_guards(void);
+void test_memory(void);
 void test_demangle(void);
 int main(int argc, char **argv)
 {
@@ -53,9 +55,11 @@ int main(int argc, char **argv)
 
 	test_type_info();
 	test_guards();
+	test_memory();
 #if !defined(_CXXRT_NO_EXCEPTIONS)
 	test_exceptions();
 	test_init_primary_exception();
+	test_callsite_encodings();
 #endif
 	test_demangle();
 	return 0;
@@ -0,0 +1,64 @@
+#include "test.h"
+
+#ifdef TEST_LSDA_FIXTURES
+/*
+ * Functions defined in lsda_fixtures_x86_64.S, which differ only in the
+ * encoding of their exception tables.  Each calls fn(0), fn(1) and fn(2),
+ * returns 1 or 2 if the first or second call throws, lets an exception from
+ * the third call propagate, and otherwise returns 0.
+ */
+extern "C" int lsda_fixture_uleb128(void (*fn)(int));
+extern "C" int lsda_fixture_udata4(void (*fn)(int));
+extern "C" int lsda_fixture_sdata4(void (*fn)(int));
+extern "C" int lsda_fixture_udata8(void (*fn)(int));
+extern "C" int lsda_fixture_lpstart(void (*fn)(int));
+
+/**
+ * The argument for which thrower() throws.
+ */
+static int throw_at;
+
+static void thrower(int i)
+{
+	if (i == throw_at)
+	{
+		throw i;
+	}
+}
+
+/**
+ * Checks that the call sites of fixture are each found, with the right
+ * landing pad and action, when fn throws from each in turn.
+ */
+static void test_fixture(int (*fixture)(void (*)(int)), const char *file, int line)
+{
+	throw_at = 0;
+	TEST_LOC(fixture(thrower) == 1, "Exception from the first call site caught", file, line);
+	throw_at = 1;
+	TEST_LOC(fixture(thrower) == 2, "Exception from the second call site caught", file, line);
+	throw_at = 2;
+	int caught = -1;
+	try
+	{
+		fixture(thrower);
+	}
+	catch (int i)
+	{
+		caught = i;
+	}
+	TEST_LOC(caught == 2, "Exception from the call site without a landing pad propagated", file, line);
+	throw_at = 3;
+	TEST_LOC(fixture(thrower) == 0, "Fixture returned normally without an exception", file, line);
+}
+#endif
+
+void test_callsite_encodings(void)
+{
+#ifdef TEST_LSDA_FIXTURES
+	test_fixture(lsda_fixture_uleb128, __FILE__, __LINE__);
+	test_fixture(lsda_fixture_udata4, __FILE__, __LINE__);
+	test_fixture(lsda_fixture_sdata4, __FILE__, __LINE__);
+	test_fixture(lsda_fixture_udata8, __FILE__, __LINE__);
+	test_fixture(lsda_fixture_lpstart, __FILE__, __LINE__);
+#endif
+}
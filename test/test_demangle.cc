@@ -1,5 +1,9 @@
 #include "test.h"
+#ifdef TEST_LIBCXXRT_EXTENSIONS
+#include "../src/cxxabi.h"
+#else
 #include <cxxabi.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,6 +41,179 @@ template <typename T> void test(const char* expected, int line) {
 	test(typeid(T).name(), expected, 0, line);
 }
 
+#ifdef TEST_LIBCXXRT_EXTENSIONS
+/*
+ * Checks that pathscale::demangled_length() gives the same status as
+ * __cxa_demangle(), and the length of its result.
+ */
+static void test_demangled_length(const char* mangled, int line) {
+	int status = 0;
+	char* demangled = abi::__cxa_demangle(mangled, NULL, NULL, &status);
+	size_t length = 0;
+	int length_status = pathscale::demangled_length(mangled, &length);
+	TEST_LOC(length_status == status,
+	    "demangled_length should match __cxa_demangle's status", __FILE__,
+	    line);
+	if (demangled != NULL) {
+		TEST_LOC(length == strlen(demangled),
+		    "demangled_length should match __cxa_demangle's length",
+		    __FILE__, line);
+	}
+	free(demangled);
+}
+
+/*
+ * Checks one pathscale::demangle_batch() result against __cxa_demangle().
+ */
+static bool batch_result_matches(const char* mangled, const char* buffer,
+    size_t offset) {
+	int status = 0;
+	char* demangled = abi::__cxa_demangle(mangled, NULL, NULL, &status);
+	bool matches;
+	if (demangled == NULL) {
+		matches = (offset == pathscale::demangle_failed);
+	} else {
+		matches = (offset != pathscale::demangle_failed) &&
+		    (strcmp(buffer + offset, demangled) == 0);
+	}
+	free(demangled);
+	return matches;
+}
+
+/*
+ * Demangles enough names for several chunks with one and with several
+ * threads, and checks that the results agree with __cxa_demangle().
+ */
+static void test_demangle_batch(void) {
+	static const size_t count = 1000;
+	static char storage[count][32];
+	static const char* names[count];
+	for (size_t i = 0; i < count; i++) {
+		if (i % 7 == 3) {
+			snprintf(storage[i], sizeof(storage[i]), "_Zx%zu", i);
+		} else {
+			char id[16];
+			snprintf(id, sizeof(id), "f%zu", i);
+			snprintf(storage[i], sizeof(storage[i]), "_Z%zu%s%s",
+			    strlen(id), id, (i % 2) ? "v" : "ic");
+		}
+		names[i] = storage[i];
+	}
+
+	static size_t serial_offsets[count];
+	char* serial = NULL;
+	size_t serial_size = 0;
+	TEST(pathscale::demangle_batch(names, count, &serial, &serial_size,
+	    serial_offsets, 1) == 0,
+	    "demangle_batch should demangle with one thread");
+	static size_t parallel_offsets[count];
+	char* parallel = NULL;
+	size_t parallel_size = 0;
+	TEST(pathscale::demangle_batch(names, count, &parallel, &parallel_size,
+	    parallel_offsets, 4) == 0,
+	    "demangle_batch should demangle with four threads");
+	bool serial_matches = true;
+	bool parallel_matches = true;
+	bool identical = true;
+	bool in_order = true;
+	size_t last = 0;
+	for (size_t i = 0; i < count; i++) {
+		serial_matches &= batch_result_matches(names[i], serial,
+		    serial_offsets[i]);
+		parallel_matches &= batch_result_matches(names[i], parallel,
+		    parallel_offsets[i]);
+		identical &= (serial_offsets[i] == parallel_offsets[i]);
+		if (parallel_offsets[i] != pathscale::demangle_failed) {
+			in_order &= (parallel_offsets[i] >= last);
+			last = parallel_offsets[i];
+		}
+	}
+	TEST(serial_matches, "demangle_batch should match __cxa_demangle");
+	TEST(parallel_matches,
+	    "threaded demangle_batch should match __cxa_demangle");
+	TEST(identical && memcmp(serial, parallel, last) == 0,
+	    "demangle_batch should give the same results with any thread count");
+	TEST(in_order, "demangle_batch should keep the results in order");
+	TEST(serial_offsets[3] == pathscale::demangle_failed,
+	    "demangle_batch should report names that are not mangled");
+	free(serial);
+	free(parallel);
+
+	// A batch of several chunks where every name fails produces no text.
+	static const char* invalid[count];
+	for (size_t i = 0; i < count; i++)
+		invalid[i] = "_Zx";
+	parallel = NULL;
+	parallel_size = 0;
+	TEST(pathscale::demangle_batch(invalid, count, &parallel, &parallel_size,
+	    parallel_offsets, 4) == 0,
+	    "demangle_batch should succeed when every name fails");
+	bool all_failed = true;
+	for (size_t i = 0; i < count; i++)
+		all_failed &= (parallel_offsets[i] == pathscale::demangle_failed);
+	TEST(all_failed, "demangle_batch should report every invalid name");
+	free(parallel);
+
+	// A caller-supplied buffer is grown.
+	size_t size = 8;
+	char* buffer = static_cast<char*>(malloc(size));
+	size_t offsets[2];
+	TEST(pathscale::demangle_batch(names, 2, &buffer, &size, offsets, 1) == 0,
+	    "demangle_batch should demangle into a caller-supplied buffer");
+	TEST(size >= strlen("f0(int, char)") + strlen("f1()") + 2 &&
+	    strcmp(buffer + offsets[0], "f0(int, char)") == 0 &&
+	    strcmp(buffer + offsets[1], "f1()") == 0,
+	    "demangle_batch should grow a caller-supplied buffer");
+	free(buffer);
+
+	// An empty batch needs no names or offsets.
+	buffer = NULL;
+	size = 0;
+	TEST(pathscale::demangle_batch(NULL, 0, &buffer, &size, NULL, 4) == 0,
+	    "demangle_batch should accept an empty batch");
+	free(buffer);
+	TEST(pathscale::demangle_batch(names, 1, NULL, &size, offsets, 1) == -3,
+	    "demangle_batch should reject a null buffer pointer");
+}
+
+/*
+ * Checks that pathscale::demangle_structured() splits a symbol into the
+ * expected tokens.
+ */
+static void test_structured(const char* mangled, const char* expected,
+    const pathscale::demangle_token_kind* kinds, const char* const* parts,
+    size_t count, int line) {
+	int status = -1;
+	pathscale::demangled_symbol* symbol =
+	    pathscale::demangle_structured(mangled, &status);
+	TEST_LOC(status == 0 && symbol != NULL,
+	    "demangle_structured should demangle", __FILE__, line);
+	if (symbol == NULL)
+		return;
+	TEST_LOC(strcmp(symbol->text, expected) == 0 &&
+	    symbol->length == strlen(expected),
+	    "demangle_structured should give the demangled text", __FILE__,
+	    line);
+	TEST_LOC(symbol->token_count == count,
+	    "demangle_structured should give the expected number of tokens",
+	    __FILE__, line);
+	bool matches = (symbol->token_count == count);
+	size_t end = 0;
+	for (size_t i = 0; matches && i < count; i++) {
+		const pathscale::demangle_token& token = symbol->tokens[i];
+		matches = (token.kind == kinds[i]) && (token.offset >= end) &&
+		    (token.offset + token.length <= symbol->length) &&
+		    (token.length == strlen(parts[i])) &&
+		    (strncmp(symbol->text + token.offset, parts[i],
+		    token.length) == 0);
+		end = token.offset + token.length;
+	}
+	TEST_LOC(matches,
+	    "demangle_structured tokens should be in order and cover their parts",
+	    __FILE__, line);
+	free(symbol);
+}
+#endif
 
 namespace N {
 template<typename T, int U>
@@ -60,4 +237,79 @@ void test_demangle(void)
 
 	// Negative tests (expected to fail with the indicated status)
 	test("NSt3__15tupleIJibEEE", NULL, -2, __LINE__);
+
+	// Demangling into a caller's buffer, which should only be replaced if
+	// the result doesn't fit.
+	const char *mangled = typeid(Templated<Templated<long, 7>, 8>).name();
+	const char *expected = "N::Templated<N::Templated<long, 7>, 8>";
+	int status = 0;
+	size_t n = 128;
+	char *buf = static_cast<char*>(malloc(n));
+	char *demangled = abi::__cxa_demangle(mangled, buf, &n, &status);
+	TEST(status == 0, "should be able to demangle into a buffer");
+	TEST(demangled == buf, "a large enough buffer should be used");
+	TEST(strcmp(expected, demangled) == 0,
+	    "should demangle correctly into a buffer");
+	n = 4;
+	demangled = abi::__cxa_demangle(mangled, demangled, &n, &status);
+	TEST(status == 0, "should be able to demangle into a small buffer");
+	TEST(demangled != NULL && strcmp(expected, demangled) == 0,
+	    "a small buffer should be grown");
+	free(demangled);
+
+	// A buffer without its length is an invalid argument.
+	buf = static_cast<char*>(malloc(128));
+	status = 0;
+	demangled = abi::__cxa_demangle(mangled, buf, NULL, &status);
+	TEST(status == -3, "a buffer without a length should be rejected");
+	TEST(demangled == NULL, "a rejected buffer should not be returned");
+	free(buf);
+
+#ifdef TEST_LIBCXXRT_EXTENSIONS
+	// Measuring the result without producing it.
+	test_demangled_length(mangled, __LINE__);
+	test_demangled_length(typeid(int).name(), __LINE__);
+	test_demangled_length("_ZNSt6vectorIiSaIiEE9push_backERKi", __LINE__);
+	test_demangled_length("_ZTV1A", __LINE__);
+	test_demangled_length("NSt3__15tupleIJibEEE", __LINE__);
+	size_t length = 0;
+	TEST(pathscale::demangled_length("_ZTV1A", &length) == 0 &&
+	    length == strlen("vtable for A"),
+	    "demangled_length should measure a special name");
+	TEST(pathscale::demangled_length("_ZTV1A", NULL) == -3,
+	    "demangled_length should reject a null length");
+
+	test_demangle_batch();
+
+	// Tokens cover the parts of the name, but not the separators.
+	static const pathscale::demangle_token_kind member_kinds[] = {
+		pathscale::demangle_scope, pathscale::demangle_scope,
+		pathscale::demangle_name, pathscale::demangle_parameter,
+		pathscale::demangle_parameter, pathscale::demangle_qualifiers
+	};
+	static const char* const member_parts[] = {
+		"N", "A", "foo", "int", "char", "const"
+	};
+	test_structured("_ZNK1N1A3fooEic", "N::A::foo(int, char) const",
+	    member_kinds, member_parts, 6, __LINE__);
+	static const pathscale::demangle_token_kind template_kinds[] = {
+		pathscale::demangle_return_type, pathscale::demangle_name,
+		pathscale::demangle_template_args, pathscale::demangle_parameter
+	};
+	static const char* const template_parts[] = {
+		"void", "f", "<int>", "int"
+	};
+	test_structured("_Z1fIiEvT_", "void f<int>(int)", template_kinds,
+	    template_parts, 4, __LINE__);
+	static const pathscale::demangle_token_kind special_kinds[] = {
+		pathscale::demangle_special, pathscale::demangle_name
+	};
+	static const char* const special_parts[] = { "vtable for ", "A" };
+	test_structured("_ZTV1A", "vtable for A", special_kinds, special_parts,
+	    2, __LINE__);
+	status = 0;
+	TEST(pathscale::demangle_structured("_Zx", &status) == NULL &&
+	    status == -2,
+	    "demangle_structured should fail for an invalid name");
+#endif
 }
@@ -0,0 +1,390 @@
+/**
+ * test_eh_index.cc - Checks the exception index against the LSDA.
+ *
+ * Usage: cxxrt-test-eh-index module
+ *
+ * For every frame on the stack that has an LSDA, compares the result of
+ * eh_index_lookup() with the result of parsing the LSDA directly.  This is
+ * done for functions with fixed-width call-site tables, for one whose tables
+ * the index does not handle, and for a module that is repeatedly loaded and
+ * unloaded.  Also checks that the index frees the memory that it no longer
+ * needs, and that it is not rebuilt for exceptions thrown before an unload or
+ * through code that is not in any loaded object.
+ */
+#include <dlfcn.h>
+#include <link.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "eh_index.h"
+
+extern "C" void *__libc_malloc(size_t);
+extern "C" void *__libc_calloc(size_t, size_t);
+extern "C" void *__libc_realloc(void *, size_t);
+extern "C" void __libc_free(void *);
+
+/**
+ * Set while eh_index_lookup() is running.
+ */
+static bool counting;
+/**
+ * The number of allocations made while counting.
+ */
+static long allocations;
+/**
+ * The number of allocations freed while counting.
+ */
+static long frees;
+
+/**
+ * Replace the C library's allocation functions so that the index's
+ * allocations can be counted.
+ */
+extern "C" void *malloc(size_t size)
+{
+	void *p = __libc_malloc(size);
+	allocations += (counting && p);
+	return p;
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+	void *p = __libc_calloc(count, size);
+	allocations += (counting && p);
+	return p;
+}
+
+extern "C" void *realloc(void *old, size_t size)
+{
+	void *p = __libc_realloc(old, size);
+	allocations += (counting && p && !old);
+	return p;
+}
+
+extern "C" void free(void *p)
+{
+	frees += (counting && p);
+	__libc_free(p);
+}
+
+/**
+ * Results of looking up the frames on the stack.
+ */
+struct frame_counts
+{
+	/**
+	 * Frames with an LSDA.
+	 */
+	int frames;
+	/**
+	 * Frames that were found in the index.
+	 */
+	int found;
+	/**
+	 * Frames that were not in the index.
+	 */
+	int missed;
+	/**
+	 * Frames where the index disagreed with the LSDA.
+	 */
+	int mismatched;
+};
+
+static frame_counts counts;
+
+/**
+ * The epoch passed to eh_index_lookup().
+ */
+static unsigned long lookup_epoch;
+
+static int failures;
+
+static void check(bool ok, const char *message, int line)
+{
+	if (!ok)
+	{
+		fprintf(stderr, "Test failed: line %d: %s\n", line, message);
+		failures++;
+	}
+}
+
+#define CHECK(p, m) check(p, m, __LINE__)
+
+static int read_epoch(struct dl_phdr_info *info, size_t, void *data)
+{
+	*static_cast<unsigned long*>(data) = info->dlpi_subs + 1;
+	return 1;
+}
+
+/**
+ * Returns the epoch that the runtime passes to eh_index_lookup() for an
+ * exception thrown now.
+ */
+static unsigned long current_epoch()
+{
+	unsigned long epoch = 0;
+	dl_iterate_phdr(read_epoch, &epoch);
+	return epoch;
+}
+
+static _Unwind_Reason_Code check_frame(struct _Unwind_Context *context, void *)
+{
+	unsigned char *lsda_addr =
+		reinterpret_cast<unsigned char*>(_Unwind_GetLanguageSpecificData(context));
+	if (0 == lsda_addr) { return _URC_NO_REASON; }
+	counts.frames++;
+	dwarf_eh_lsda expected_lsda = parse_lsda(context, lsda_addr);
+	dwarf_eh_action expected;
+	bool has_callsite = dwarf_eh_find_callsite(context, &expected_lsda, &expected);
+	dwarf_eh_lsda lsda;
+	dwarf_eh_action action;
+	counting = true;
+	eh_index_result result =
+		eh_index_lookup(context, lsda_addr, lookup_epoch, &lsda, &action);
+	counting = false;
+	switch (result)
+	{
+		case eh_index_miss:
+			counts.missed++;
+			break;
+		case eh_index_no_callsite:
+			counts.found++;
+			counts.mismatched += has_callsite;
+			break;
+		case eh_index_found:
+			counts.found++;
+			counts.mismatched += !has_callsite ||
+				(action.landing_pad != expected.landing_pad) ||
+				(action.action_record != expected.action_record) ||
+				(lsda.landing_pads != expected_lsda.landing_pads) ||
+				(lsda.type_table != expected_lsda.type_table) ||
+				(lsda.action_table != expected_lsda.action_table);
+			break;
+	}
+	return _URC_NO_REASON;
+}
+
+/**
+ * Looks up every frame on the stack.
+ */
+static void check_frames()
+{
+	_Unwind_Backtrace(check_frame, 0);
+}
+
+static void check_frames_at(int)
+{
+	check_frames();
+}
+
+/**
+ * Calls fn inside a handler, so that this function has an LSDA.
+ */
+static __attribute__((noinline)) int call_with_handler(void (*fn)())
+{
+	try
+	{
+		fn();
+	}
+	catch (...)
+	{
+		return 1;
+	}
+	return 0;
+}
+
+#ifdef TEST_LSDA_FIXTURES
+extern "C" int lsda_fixture_udata4(void (*fn)(int));
+extern "C" int lsda_fixture_sdata4(void (*fn)(int));
+extern "C" int lsda_fixture_udata8(void (*fn)(int));
+extern "C" int lsda_fixture_lpstart(void (*fn)(int));
+
+/**
+ * Checks the index for the three call sites of a fixture from
+ * lsda_fixtures_x86_64.S.  Returns the number of frames that were missed.
+ */
+static int check_fixture(int (*fixture)(void (*)(int)), int line)
+{
+	counts = frame_counts();
+	fixture(check_frames_at);
+	check(counts.frames >= 3, "Fixture frames have an LSDA", line);
+	check(0 == counts.mismatched, "Index agrees with the LSDA", line);
+	return counts.missed;
+}
+#endif
+
+#ifdef __x86_64__
+extern "C" void __register_frame(void *);
+extern "C" void __deregister_frame(void *);
+
+/**
+ * Code and unwind tables for a function that is not in any loaded object, as
+ * a JIT compiler would generate.  The function calls its argument:
+ *
+ *     sub $8, %rsp; call *%rdi; add $8, %rsp; ret
+ *
+ * Its FDE, registered with __register_frame(), gives it an empty LSDA.
+ */
+struct jit_function
+{
+	unsigned char code[16];
+	uint32_t cie[6];
+	uint32_t fde[10];
+	uint32_t terminator;
+	unsigned char lsda[4];
+};
+
+/**
+ * Creates and registers a jit_function.  Returns null on failure.
+ */
+static jit_function *make_jit_function()
+{
+	void *page = mmap(0, sizeof(jit_function), PROT_READ | PROT_WRITE,
+	                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == page) { return 0; }
+	jit_function *f = static_cast<jit_function*>(page);
+	static const unsigned char code[] =
+		{ 0x48, 0x83, 0xec, 0x08, 0xff, 0xd7, 0x48, 0x83, 0xc4, 0x08, 0xc3 };
+	memcpy(f->code, code, sizeof(code));
+	// Version 1, augmentation "zLR" with absolute LSDA and FDE pointers,
+	// code alignment 1, data alignment -8, return address in register 16.
+	// The CFA starts at %rsp + 8, with the return address below it.
+	static const unsigned char cie[] =
+		{ 1, 'z', 'L', 'R', 0, 1, 0x78, 16, 2, 0, 0,
+		  0x0c, 7, 8, 0x90, 1 };
+	f->cie[0] = sizeof(f->cie) - 4;
+	f->cie[1] = 0;
+	memcpy(&f->cie[2], cie, sizeof(cie));
+	f->fde[0] = sizeof(f->fde) - 4;
+	f->fde[1] = reinterpret_cast<char*>(&f->fde[1]) -
+	            reinterpret_cast<char*>(f->cie);
+	uint64_t start = reinterpret_cast<uint64_t>(f->code);
+	uint64_t length = sizeof(code);
+	uint64_t lsda = reinterpret_cast<uint64_t>(f->lsda);
+	memcpy(&f->fde[2], &start, 8);
+	memcpy(&f->fde[4], &length, 8);
+	// Augmentation data: the LSDA pointer.  Then the CFA moves to
+	// %rsp + 16 after the sub, and back to %rsp + 8 after the add.
+	unsigned char *p = reinterpret_cast<unsigned char*>(&f->fde[6]);
+	*p++ = 8;
+	memcpy(p, &lsda, 8);
+	p += 8;
+	static const unsigned char instructions[] =
+		{ 0x44, 0x0e, 16, 0x46, 0x0e, 8, 0 };
+	memcpy(p, instructions, sizeof(instructions));
+	f->terminator = 0;
+	// No @LPStart, no type table, and an empty ULEB128 call-site table.
+	static const unsigned char empty_lsda[] = { 0xff, 0xff, 0x01, 0 };
+	memcpy(f->lsda, empty_lsda, sizeof(empty_lsda));
+	if (0 != mprotect(page, sizeof(jit_function), PROT_READ | PROT_EXEC))
+	{
+		munmap(page, sizeof(jit_function));
+		return 0;
+	}
+	__register_frame(f->cie);
+	return f;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	if (argc != 2)
+	{
+		fputs("usage: cxxrt-test-eh-index module\n", stderr);
+		return EXIT_FAILURE;
+	}
+	lookup_epoch = current_epoch();
+
+	// Functions with call-site tables in each fixed-width encoding.
+#ifdef TEST_LSDA_FIXTURES
+	CHECK(0 == check_fixture(lsda_fixture_udata4, __LINE__),
+	      "udata4 call sites are indexed");
+	CHECK(0 == check_fixture(lsda_fixture_sdata4, __LINE__),
+	      "sdata4 call sites are indexed");
+	CHECK(0 == check_fixture(lsda_fixture_udata8, __LINE__),
+	      "udata8 call sites are indexed");
+	// The index does not handle an explicit @LPStart, so each lookup in
+	// this function misses and the personality function parses the LSDA.
+	CHECK(3 == check_fixture(lsda_fixture_lpstart, __LINE__),
+	      "Function with @LPStart is not indexed");
+#endif
+
+	// Load and unload a module repeatedly.  Each unload changes the epoch,
+	// so the next lookup rebuilds the index, dropping the unloaded module
+	// and retiring the old snapshot.  After the first few rounds, the index
+	// should free as much as it allocates.
+	long live = 0;
+	for (int i=0 ; i<20 ; i++)
+	{
+		void *module = dlopen(argv[1], RTLD_NOW);
+		if (0 == module)
+		{
+			fprintf(stderr, "dlopen failed: %s\n", dlerror());
+			return EXIT_FAILURE;
+		}
+		int (*module_call)(void (*)()) = reinterpret_cast<int(*)(void (*)())>(
+			dlsym(module, "eh_index_module_call"));
+		CHECK(0 != module_call, "Module exports eh_index_module_call");
+		if (0 == module_call) { return EXIT_FAILURE; }
+		lookup_epoch = current_epoch();
+		counts = frame_counts();
+		module_call(check_frames);
+		CHECK(counts.frames >= 1, "Module frame has an LSDA");
+		CHECK(counts.found == counts.frames, "Module frames are indexed");
+		CHECK(0 == counts.mismatched, "Index agrees with the LSDA in the module");
+		dlclose(module);
+		if (i == 1)
+		{
+			live = allocations - frees;
+		}
+	}
+	CHECK(live == allocations - frees,
+	      "Index does not grow while modules are loaded and unloaded");
+
+	// Bring the index up to date, then look frames up on behalf of an
+	// exception thrown before the last unload.  The index is newer than the
+	// exception, so should be used without being rebuilt.
+	unsigned long epoch = current_epoch();
+	lookup_epoch = epoch;
+	counts = frame_counts();
+	call_with_handler(check_frames);
+	CHECK((counts.frames >= 1) && (counts.found == counts.frames),
+	      "Frames are indexed after modules are unloaded");
+	lookup_epoch = epoch - 1;
+	allocations = 0;
+	for (int i=0 ; i<100 ; i++)
+	{
+		call_with_handler(check_frames);
+	}
+	CHECK(0 == allocations, "Index is not rebuilt for older exceptions");
+	CHECK(0 == counts.mismatched, "Index agrees with the LSDA");
+
+#ifdef __x86_64__
+	// Frames in code outside every loaded object miss.  After the first
+	// lookup records the gap that the code is in, later ones should not
+	// rebuild the index.
+	jit_function *jit = make_jit_function();
+	CHECK(0 != jit, "JIT function created");
+	if (0 == jit) { return EXIT_FAILURE; }
+	void (*jit_call)(void (*)()) =
+		reinterpret_cast<void (*)(void (*)())>(jit->code);
+	lookup_epoch = current_epoch();
+	counts = frame_counts();
+	jit_call(check_frames);
+	CHECK((1 == counts.missed) && (counts.found == counts.frames - 1),
+	      "Only the JIT frame misses");
+	allocations = 0;
+	for (int i=0 ; i<100 ; i++)
+	{
+		jit_call(check_frames);
+	}
+	CHECK(0 == allocations, "Index is not rebuilt for code outside every object");
+	CHECK(0 == counts.mismatched, "Index agrees with the LSDA around JIT code");
+	__deregister_frame(jit->cie);
+	munmap(jit, sizeof(jit_function));
+#endif
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
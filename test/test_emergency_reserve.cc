@@ -0,0 +1,131 @@
+/**
+ * test_emergency_reserve.cc - Throws exceptions while malloc() fails.
+ *
+ * Usage: cxxrt-test-emergency-reserve object_size depth [size slots limit]
+ *
+ * Throws depth nested exceptions of object_size bytes, all live at once, while
+ * malloc() returns null, so that each one must come from the emergency
+ * reserve.  Prints "caught" if they were all thrown and caught, or
+ * "terminated" if allocating one failed.  If size, slots and limit are given,
+ * the reserve is first configured with pathscale::set_emergency_reserve().
+ * Otherwise, it is configured by the LIBCXXRT_EMERGENCY_RESERVE environment
+ * variable.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <exception>
+
+// cxxabi.h conflicts with the system <exception>.
+namespace pathscale
+{
+	bool set_emergency_reserve(size_t size,
+	                           size_t slots,
+	                           int per_thread_limit) noexcept;
+}
+
+extern "C" void *__libc_malloc(size_t);
+
+/**
+ * Set to make malloc() fail.
+ */
+static bool fail_malloc;
+
+/**
+ * Replaces the C library's malloc() so that failures can be injected.
+ */
+extern "C" void *malloc(size_t size)
+{
+	return fail_malloc ? nullptr : __libc_malloc(size);
+}
+
+template<size_t N>
+struct payload
+{
+	char data[N];
+};
+
+/**
+ * Throws depth nested exceptions, each caught inside the handler for the last.
+ */
+template<size_t N>
+static void nest(int depth)
+{
+	try
+	{
+		throw payload<N>();
+	}
+	catch (payload<N> &)
+	{
+		if (depth > 1)
+		{
+			nest<N>(depth - 1);
+		}
+	}
+}
+
+static void terminated()
+{
+	fail_malloc = false;
+	puts("terminated");
+	_exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char **argv)
+{
+	if ((argc != 3) && (argc != 6))
+	{
+		fputs("usage: cxxrt-test-emergency-reserve object_size depth "
+		      "[size slots limit]\n", stderr);
+		return EXIT_FAILURE;
+	}
+	setvbuf(stdout, nullptr, _IONBF, 0);
+	// Arguments that would give a reserve that can not be used are rejected,
+	// leaving the configuration unchanged.
+	if (pathscale::set_emergency_reserve(65536, 0, 2) ||
+	    pathscale::set_emergency_reserve(65536, 65536, 2) ||
+	    pathscale::set_emergency_reserve(65536, 16, 0) ||
+	    pathscale::set_emergency_reserve(65536, 16, -1))
+	{
+		puts("set_emergency_reserve accepted an unusable reserve");
+		return EXIT_FAILURE;
+	}
+	if ((argc == 6) &&
+	    !pathscale::set_emergency_reserve(strtoul(argv[3], nullptr, 0),
+	                                      strtoul(argv[4], nullptr, 0),
+	                                      atoi(argv[5])))
+	{
+		puts("set_emergency_reserve failed before the first exception");
+		return EXIT_FAILURE;
+	}
+	std::set_terminate(terminated);
+	// The first exception creates the reserve.
+	try
+	{
+		throw 0;
+	}
+	catch (int) {}
+	if (pathscale::set_emergency_reserve(0, 0, 0))
+	{
+		puts("set_emergency_reserve succeeded after the reserve was created");
+		return EXIT_FAILURE;
+	}
+	int depth = atoi(argv[2]);
+	fail_malloc = true;
+	if (0 == strcmp(argv[1], "2000"))
+	{
+		nest<2000>(depth);
+	}
+	else if (0 == strcmp(argv[1], "40000"))
+	{
+		nest<40000>(depth);
+	}
+	else if (0 == strcmp(argv[1], "100000"))
+	{
+		nest<100000>(depth);
+	}
+	fail_malloc = false;
+	puts("caught");
+	return EXIT_SUCCESS;
+}
@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <pthread.h>
 
 #include <exception>
 
@@ -332,6 +334,162 @@ void test_uncaught_exceptions()
 	catch (...) {}
 }
 
+/**
+ * Exception type with a payload of a configurable size, filled with a known
+ * pattern.
+ */
+template<size_t Size>
+struct sized_exception
+{
+	unsigned char payload[Size];
+	sized_exception(unsigned char fill) { memset(payload, fill, Size); }
+	bool check(unsigned char fill) const
+	{
+		for (size_t i=0 ; i<Size ; i++)
+		{
+			if (payload[i] != fill) { return false; }
+		}
+		return true;
+	}
+};
+
+template<size_t Size>
+static bool throw_sized(unsigned char fill)
+{
+	try
+	{
+		throw sized_exception<Size>(fill);
+	}
+	catch (const sized_exception<Size> &e)
+	{
+		return e.check(fill);
+	}
+	return false;
+}
+
+/**
+ * Throws exceptions of several different sizes many times, so that their
+ * storage is reused, and checks that each one arrives intact.
+ */
+static void *throw_many_sizes(void*)
+{
+	bool ok = true;
+	for (int i=0 ; i<1000 ; i++)
+	{
+		unsigned char fill = static_cast<unsigned char>(i);
+		ok &= throw_sized<1>(fill);
+		ok &= throw_sized<200>(fill);
+		ok &= throw_sized<700>(fill);
+		ok &= throw_sized<4000>(fill);
+	}
+	return ok ? reinterpret_cast<void*>(1) : nullptr;
+}
+
+void test_exception_storage_reuse()
+{
+	pthread_t threads[4];
+	for (int i=0 ; i<4 ; i++)
+	{
+		pthread_create(&threads[i], nullptr, throw_many_sizes, nullptr);
+	}
+	bool ok = (throw_many_sizes(nullptr) != nullptr);
+	for (int i=0 ; i<4 ; i++)
+	{
+		void *ret;
+		pthread_join(threads[i], &ret);
+		ok &= (ret != nullptr);
+	}
+	TEST(ok, "Exceptions of different sizes thrown repeatedly from several threads");
+}
+
+struct handler_base_a { int a; handler_base_a() : a(1) {} };
+struct handler_base_b { int b; handler_base_b() : b(2) {} };
+struct handler_derived : handler_base_a, handler_base_b {};
+struct handler_virtual_derived : handler_base_a, virtual handler_base_b {};
+
+static int handler_cleanups;
+
+struct handler_cleanup
+{
+	~handler_cleanup() { handler_cleanups++; }
+};
+
+__attribute__((noinline))
+static void throw_one_of(int kind)
+{
+	handler_cleanup c;
+	switch (kind)
+	{
+		case 0: throw handler_derived();
+		case 1: throw handler_virtual_derived();
+		default: throw kind;
+	}
+}
+
+/**
+ * Throws several types from the same call site many times and checks that each
+ * is caught by the right handler with the right adjusted pointer.
+ */
+void test_repeated_handler_search()
+{
+	bool ok = true;
+	handler_cleanups = 0;
+	for (int i=0 ; i<300 ; i++)
+	{
+		int kind = i % 3;
+		try
+		{
+			throw_one_of(kind);
+		}
+		catch (handler_base_b &e)
+		{
+			ok &= (kind != 2) && (e.b == 2);
+		}
+		catch (int e)
+		{
+			ok &= (e == 2);
+		}
+	}
+	TEST(ok, "Repeated throws from the same call site caught correctly");
+	TEST(handler_cleanups == 300, "Cleanups run for repeated throws");
+}
+
+struct match_root { int r; match_root() : r(7) {} };
+struct match_left : match_root {};
+struct match_other { int o; match_other() : o(9) {} };
+struct match_mid : match_other, match_left {};
+struct match_vbase { int v; match_vbase() : v(11) {} };
+struct match_leaf : match_mid, virtual match_vbase {};
+
+/**
+ * Catches the same deep, multiply and virtually inherited type as each of its
+ * bases, repeatedly, and checks that the adjusted pointers are correct.
+ */
+void test_repeated_type_match()
+{
+	bool ok = true;
+	match_leaf leaf;
+	for (int i=0 ; i<400 ; i++)
+	{
+		try
+		{
+			switch (i % 4)
+			{
+				case 0: throw match_leaf();
+				case 1: throw static_cast<match_mid*>(&leaf);
+				case 2: throw &leaf;
+				default: throw match_mid();
+			}
+		}
+		catch (int) { ok = false; }
+		catch (match_vbase &e) { ok &= (i % 4 == 0) && (e.v == 11); }
+		catch (match_vbase *e) { ok &= (i % 4 == 2) && (e->v == 11); }
+		catch (match_other *e) { ok &= (i % 4 == 1) && (e->o == 9); }
+		catch (match_root &e) { ok &= (i % 4 == 3) && (e.r == 7); }
+	}
+	TEST(ok, "Repeated catches of a deep hierarchy adjusted correctly");
+}
+
 extern "C" void __cxa_bad_cast();
 
 void test_exceptions(void)
@@ -384,6 +542,9 @@ void test_exceptions(void)
 	test_rethrown_uncaught_exception();
 	test_rethrown_uncaught_foreign_exception();
 	test_uncaught_exceptions();
+	test_exception_storage_reuse();
+	test_repeated_handler_search();
+	test_repeated_type_match();
 
 
 	//printf("Test: %s\n",
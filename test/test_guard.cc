@@ -1,7 +1,11 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <pthread.h>
 #include <unistd.h>
 #include "test.h"
+#ifdef TEST_LIBCXXRT_EXTENSIONS
+#include "../src/cxxabi.h"
+#endif
 
 static int static_count;
 struct static_struct
@@ -53,6 +57,39 @@ void *init_static_race(void*)
 	return nullptr;
 }
 
+static int contended_attempts;
+static int contended_instances;
+struct static_contended_struct
+{
+	int field;
+	static_contended_struct()
+	{
+		// Hold the lock long enough for the other threads to start waiting.
+		usleep(50000);
+		// Fail the first time, so that the waiting threads must be woken
+		// when the guard is released without being initialised.
+		if (contended_attempts++ == 0)
+		{
+			throw 0;
+		}
+		field = 3;
+		contended_instances++;
+	};
+};
+
+void *init_static_contended(void*)
+{
+	for (;;)
+	{
+		try
+		{
+			static static_contended_struct s;
+			return reinterpret_cast<void*>(static_cast<intptr_t>(s.field));
+		}
+		catch (int) {}
+	}
+}
+
 void test_guards(void)
 {
 	init_static();
@@ -63,4 +100,39 @@ void test_guards(void)
 	init_static_race(nullptr);
 	pthread_join(thr, nullptr);
 	TEST(instances == 1, "Two threads both tried to initialise a static");
+
+	pthread_t contended[16];
+	for (pthread_t &t : contended)
+	{
+		pthread_create(&t, nullptr, init_static_contended, nullptr);
+	}
+	bool all_initialised = true;
+	for (pthread_t &t : contended)
+	{
+		void *field;
+		pthread_join(t, &field);
+		all_initialised &= (field == reinterpret_cast<void*>(3));
+	}
+	TEST(all_initialised, "Contended static initialised for every thread");
+	TEST(contended_instances == 1, "Contended static only initialised once");
+	TEST(contended_attempts == 2, "Contended static retried after exception");
+#if defined(TEST_LIBCXXRT_EXTENSIONS) && defined(LIBCXXRT_GUARD_PROFILE)
+	// Every thread tried to acquire the contended guard at least once, so it
+	// is the only one with that many acquisitions.
+	pathscale::guard_contention_info info[16];
+	size_t count = pathscale::guard_contention_stats(info, 16);
+	const pathscale::guard_contention_info *contended_guard = nullptr;
+	for (size_t i=0 ; i<count && i<16 ; i++)
+	{
+		if (info[i].acquisitions >= 16)
+		{
+			contended_guard = &info[i];
+		}
+	}
+	TEST(contended_guard != nullptr, "Contended guard recorded");
+	TEST(contended_guard != nullptr && contended_guard->contended > 0,
+	     "Contended guard has contended acquisitions");
+	TEST(contended_guard != nullptr && contended_guard->wait_nanoseconds > 0,
+	     "Contended guard has a non-zero wait time");
+#endif
 }
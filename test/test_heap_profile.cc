@@ -0,0 +1,167 @@
+/**
+ * test_heap_profile.cc - Checks the heap profiles written by operator new.
+ *
+ * Usage: cxxrt-test-heap-profile run path
+ *        cxxrt-test-heap-profile check path
+ *
+ * run allocates kept_objects objects that it never frees and freed_objects
+ * that it frees, writes a profile to path with pathscale::heap_profile_dump()
+ * and checks it.  It is expected to be run with LIBCXXRT_HEAP_PROFILE_RATE=1,
+ * so that every allocation is sampled, and with LIBCXXRT_HEAP_PROFILE set, so
+ * that another profile is written at exit.  check checks that profile.
+ *
+ * Prints "Test failed" and exits with a failure status if any check fails.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/cxxabi.h"
+
+static const size_t kept_objects = 100;
+static const size_t freed_objects = 100;
+
+struct kept_object
+{
+	char data[64];
+};
+
+struct freed_object
+{
+	char data[32];
+};
+
+static kept_object *kept[kept_objects];
+
+static int failures;
+
+static void check(bool ok, const char *message, int line)
+{
+	if (!ok)
+	{
+		printf("Test failed: line %d: %s\n", line, message);
+		failures++;
+	}
+}
+
+#define CHECK(p, m) check(p, m, __LINE__)
+
+/**
+ * Allocates the objects that stay live until exit, all from one stack.
+ */
+static __attribute__((noinline)) void allocate_kept()
+{
+	for (kept_object *&k : kept)
+	{
+		k = new kept_object;
+	}
+}
+
+/**
+ * Allocates and frees objects, all from one stack.
+ */
+static __attribute__((noinline)) void allocate_freed()
+{
+	freed_object *freed[freed_objects];
+	for (freed_object *&f : freed)
+	{
+		f = new freed_object;
+	}
+	for (freed_object *f : freed)
+	{
+		delete f;
+	}
+}
+
+/**
+ * Checks the format of the profile at path, and that it has a bucket for the
+ * kept objects, all live, and one for the freed objects, none live.
+ */
+static void check_profile(const char *path)
+{
+	FILE *profile = fopen(path, "r");
+	CHECK(profile != nullptr, "Profile was written");
+	if (profile == nullptr)
+	{
+		return;
+	}
+	char line[4096];
+	size_t live, live_bytes, allocs, alloc_bytes;
+	long rate;
+	CHECK((fgets(line, sizeof(line), profile) != nullptr) &&
+	      (sscanf(line, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%ld",
+	              &live, &live_bytes, &allocs, &alloc_bytes, &rate) == 5),
+	      "Profile starts with a heap_v2 header");
+	CHECK(rate == 1, "Header has the sampling rate");
+	CHECK(live >= kept_objects, "Header counts the live samples");
+	CHECK(allocs >= kept_objects + freed_objects, "Header counts the samples");
+	bool found_kept = false;
+	bool found_freed = false;
+	bool found_libraries = false;
+	bool found_mapping = false;
+	while (fgets(line, sizeof(line), profile) != nullptr)
+	{
+		if (found_libraries)
+		{
+			found_mapping |= (strchr(line, '/') != nullptr);
+			continue;
+		}
+		if (strcmp(line, "MAPPED_LIBRARIES:\n") == 0)
+		{
+			found_libraries = true;
+			continue;
+		}
+		int stack;
+		if ((line[0] == '\n') ||
+		    (sscanf(line, "%zu: %zu [%zu: %zu] @ %n",
+		            &live, &live_bytes, &allocs, &alloc_bytes, &stack) != 4))
+		{
+			CHECK(line[0] == '\n', "Bucket lines have counts and a stack");
+			continue;
+		}
+		CHECK(strncmp(line + stack, "0x", 2) == 0, "Buckets have a stack");
+		if (alloc_bytes == kept_objects * sizeof(kept_object))
+		{
+			found_kept = true;
+			CHECK(allocs == kept_objects, "Kept objects sampled");
+			CHECK(live == kept_objects, "Kept objects are live");
+			CHECK(live_bytes == alloc_bytes, "Kept bytes are live");
+		}
+		else if (alloc_bytes == freed_objects * sizeof(freed_object))
+		{
+			found_freed = true;
+			CHECK(allocs == freed_objects, "Freed objects sampled");
+			CHECK(live == 0, "Freed objects are not live");
+			CHECK(live_bytes == 0, "Freed bytes are not live");
+		}
+	}
+	CHECK(found_kept, "Profile has a bucket for the kept objects");
+	CHECK(found_freed, "Profile has a bucket for the freed objects");
+	CHECK(found_libraries, "Profile has a MAPPED_LIBRARIES section");
+	CHECK(found_mapping, "MAPPED_LIBRARIES lists mapped files");
+	fclose(profile);
+}
+
+int main(int argc, char **argv)
+{
+	if ((argc != 3) ||
+	    ((strcmp(argv[1], "run") != 0) && (strcmp(argv[1], "check") != 0)))
+	{
+		fputs("usage: cxxrt-test-heap-profile run|check path\n", stderr);
+		return EXIT_FAILURE;
+	}
+	if (strcmp(argv[1], "run") == 0)
+	{
+		// Don't let a profile from an earlier run be checked.
+		const char *at_exit = getenv("LIBCXXRT_HEAP_PROFILE");
+		if (at_exit != nullptr)
+		{
+			remove(at_exit);
+		}
+		remove(argv[2]);
+		allocate_kept();
+		allocate_freed();
+		CHECK(pathscale::heap_profile_dump(argv[2]), "heap_profile_dump() succeeded");
+	}
+	check_profile(argv[2]);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
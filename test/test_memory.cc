@@ -0,0 +1,181 @@
+#include <new>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include "test.h"
+#ifdef TEST_LIBCXXRT_EXTENSIONS
+#include "../src/cxxabi.h"
+#endif
+
+#ifndef __cpp_aligned_new
+// The tests are built as C++11, so <new> doesn't declare the aligned forms.
+namespace std
+{
+	enum class align_val_t : size_t {};
+}
+void *operator new(size_t, std::align_val_t);
+void *operator new[](size_t, std::align_val_t, const std::nothrow_t&) noexcept;
+void operator delete(void *, std::align_val_t) noexcept;
+void operator delete[](void *, std::align_val_t) noexcept;
+#endif
+
+static const int cross_thread_objects = 10000;
+
+/**
+ * Fills an allocation with a pattern derived from its size.
+ */
+static void fill(unsigned char *p, size_t size)
+{
+	memset(p, static_cast<int>(size & 0xff), size);
+}
+
+/**
+ * Checks that an allocation still holds the pattern written by fill().
+ */
+static bool check(unsigned char *p, size_t size)
+{
+	for (size_t i=0 ; i<size ; i++)
+	{
+		if (p[i] != static_cast<unsigned char>(size & 0xff))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static void *allocate_objects(void *arg)
+{
+	void **objects = static_cast<void**>(arg);
+	for (int i=0 ; i<cross_thread_objects ; i++)
+	{
+		size_t size = 16 + (i % 64) * 8;
+		objects[i] = ::operator new(size);
+		fill(static_cast<unsigned char*>(objects[i]), size);
+	}
+	return nullptr;
+}
+
+#if !defined(_CXXRT_NO_EXCEPTIONS)
+static int handler_calls;
+
+static void failing_new_handler()
+{
+	handler_calls++;
+	std::set_new_handler(nullptr);
+}
+
+static void throwing_new_handler()
+{
+	handler_calls++;
+	throw std::bad_alloc();
+}
+#endif
+
+void test_memory(void)
+{
+	// Allocate a range of sizes, keeping them all live at once, and check that
+	// none of them overlap.
+	static unsigned char *live[10000];
+	bool aligned = true;
+	for (size_t size=0 ; size<10000 ; size++)
+	{
+		live[size] = static_cast<unsigned char*>(::operator new(size));
+		aligned &= ((reinterpret_cast<uintptr_t>(live[size]) & 15) == 0);
+		fill(live[size], size);
+	}
+	bool intact = true;
+	for (size_t size=0 ; size<10000 ; size++)
+	{
+		intact &= check(live[size], size);
+		::operator delete(live[size]);
+	}
+	TEST(aligned, "operator new returns 16-byte aligned memory");
+	TEST(intact, "Live allocations do not overlap");
+
+	// Free objects allocated by another thread, then reuse the memory.
+	static void *objects[cross_thread_objects];
+	for (int round=0 ; round<3 ; round++)
+	{
+		pthread_t thread;
+		pthread_create(&thread, nullptr, allocate_objects, objects);
+		pthread_join(thread, nullptr);
+		intact = true;
+		for (int i=0 ; i<cross_thread_objects ; i++)
+		{
+			size_t size = 16 + (i % 64) * 8;
+			intact &= check(static_cast<unsigned char*>(objects[i]), size);
+			::operator delete(objects[i]);
+		}
+		TEST(intact, "Objects survive being freed by another thread");
+	}
+	allocate_objects(objects);
+	intact = true;
+	for (int i=0 ; i<cross_thread_objects ; i++)
+	{
+		size_t size = 16 + (i % 64) * 8;
+		intact &= check(static_cast<unsigned char*>(objects[i]), size);
+		::operator delete(objects[i]);
+	}
+	TEST(intact, "Memory freed by another thread can be reused");
+
+	// libcxxrt doesn't define std::nothrow; the standard library does.
+	std::nothrow_t nothrow;
+
+	// Allocate over-aligned objects, keeping them live at once.
+	static const size_t alignments[] = { 32, 64, 128, 4096 };
+	for (size_t alignment : alignments)
+	{
+		aligned = true;
+		for (size_t size=0 ; size<1000 ; size++)
+		{
+			live[size] = static_cast<unsigned char*>(
+			  ::operator new(size, std::align_val_t(alignment)));
+			aligned &= ((reinterpret_cast<uintptr_t>(live[size]) &
+			            (alignment - 1)) == 0);
+			fill(live[size], size);
+		}
+		intact = true;
+		for (size_t size=0 ; size<1000 ; size++)
+		{
+			intact &= check(live[size], size);
+			::operator delete(live[size], std::align_val_t(alignment));
+		}
+		TEST(aligned, "Aligned operator new returns aligned memory");
+		TEST(intact, "Live aligned allocations do not overlap");
+	}
+	void *aligned_array = ::operator new[](100, std::align_val_t(64), nothrow);
+	TEST((reinterpret_cast<uintptr_t>(aligned_array) & 63) == 0,
+	     "Aligned nothrow operator new[] returns aligned memory");
+	::operator delete[](aligned_array, std::align_val_t(64));
+	void *huge = ::operator new(SIZE_MAX / 2, nothrow);
+	TEST(huge == nullptr, "nothrow new returns null on failure");
+#if !defined(_CXXRT_NO_EXCEPTIONS)
+	std::set_new_handler(failing_new_handler);
+	bool threw = false;
+	try
+	{
+		huge = ::operator new(SIZE_MAX / 2);
+	}
+	catch (std::bad_alloc &)
+	{
+		threw = true;
+	}
+	TEST(handler_calls == 1, "new handler called when allocation fails");
+	TEST(threw, "bad_alloc thrown when there is no new handler");
+	std::set_new_handler(throwing_new_handler);
+	huge = ::operator new(SIZE_MAX / 2, nothrow);
+	TEST(huge == nullptr, "nothrow new returns null when the new handler throws");
+	TEST(handler_calls == 2, "nothrow new calls the new handler");
+	huge = ::operator new[](SIZE_MAX / 2, std::align_val_t(64), nothrow);
+	TEST(huge == nullptr, "Aligned nothrow new returns null when the new handler throws");
+	TEST(handler_calls == 3, "Aligned nothrow new calls the new handler");
+	std::set_new_handler(nullptr);
+#endif
+#ifdef TEST_LIBCXXRT_EXTENSIONS
+	// The tests are not run with LIBCXXRT_HEAP_PROFILE set, so heap profiling
+	// is disabled even if it is supported.
+	TEST(!pathscale::heap_profile_dump("/dev/null"),
+	     "heap_profile_dump() fails when profiling is disabled");
+#endif
+}
@@ -1,6 +1,9 @@
 #include "../src/typeinfo.h"
 #include "test.h"
 #include <stdio.h>
+#ifdef TEST_LIBCXXRT_EXTENSIONS
+#include "../src/cxxabi.h"
+#endif
 
 struct Virt1;
 struct Virt2;
@@ -67,6 +70,90 @@ struct Diamond2 : public virtual Virt1a, public virtual Virt2a
 	virtual Diamond2 *as_diamond2() { return this; }
 };
 
+struct HintA { virtual ~HintA() {} int a; };
+struct HintB { virtual ~HintB() {} int b; };
+struct HintC : public HintA, public HintB { int c; };
+struct HintD : public HintC { int d; };
+struct HintPrivate : private HintB
+{
+	HintB *base() { return this; }
+};
+
+/**
+ * Tests downcasts that the compiler passes an offset hint for, where the
+ * most-derived object is and is not the destination type.  The cast from a
+ * private base is passed the hint -2.
+ */
+static void test_dynamic_cast_hints(void)
+{
+	HintC c;
+	HintD d;
+	HintB b;
+	HintPrivate p;
+	// Volatile, so that the compiler can not see the dynamic types and fold
+	// the casts.
+	HintB *volatile c_as_b = &c;
+	HintB *volatile d_as_b = &d;
+	HintB *volatile b_as_b = &b;
+	HintB *volatile p_as_b = p.base();
+	TEST(&c == dynamic_cast<HintC*>(c_as_b), "Downcasting to the most-derived type");
+	TEST(&d == dynamic_cast<HintC*>(d_as_b), "Downcasting to an intermediate type");
+	TEST(&d == dynamic_cast<HintD*>(d_as_b), "Downcasting through two levels");
+	TEST(0 == dynamic_cast<HintC*>(b_as_b), "Downcasting a base object (0 expected)");
+	TEST(0 == dynamic_cast<HintPrivate*>(p_as_b), "Downcasting from a private base (0 expected)");
+	TEST(static_cast<HintA*>(&c) == dynamic_cast<HintA*>(c_as_b), "Cross-casting between bases");
+}
+
+/**
+ * Repeats the same casts on several objects of each type, so that any cached
+ * results are reused, and checks that each result is for the right object.
+ */
+static void test_repeated_dynamic_casts(void)
+{
+	bool ok = true;
+	HintC cs[4];
+	HintD ds[4];
+	Diamond diamonds[4];
+	for (int i=0 ; i<100 ; i++)
+	{
+		HintC *c = &cs[i % 4];
+		HintD *d = &ds[i % 4];
+		Diamond *diamond = &diamonds[i % 4];
+		HintA *c_as_a = c;
+		HintB *d_as_b = d;
+		Virt1 *diamond_as_virt1 = diamond;
+		ok &= (dynamic_cast<HintB*>(c_as_a) == static_cast<HintB*>(c));
+		ok &= (dynamic_cast<HintC*>(d_as_b) == d);
+		ok &= (dynamic_cast<HintD*>(static_cast<HintB*>(c)) == 0);
+		ok &= (dynamic_cast<Virt2*>(diamond_as_virt1) == static_cast<Virt2*>(diamond));
+		ok &= (dynamic_cast<Diamond2*>(diamond_as_virt1) == 0);
+	}
+	TEST(ok, "Repeated dynamic casts");
+}
+
+#if defined(TEST_LIBCXXRT_EXTENSIONS) && defined(LIBCXXRT_DYNAMIC_CAST_CACHE)
+/**
+ * Checks that repeating a cast is answered from the dynamic cast cache.
+ */
+static void test_dynamic_cast_cache_stats(void)
+{
+	HintD d;
+	HintA *volatile d_as_a = &d;
+	unsigned long long hits, misses;
+	pathscale::dynamic_cast_cache_stats(&hits, &misses);
+	bool ok = true;
+	for (int i=0 ; i<100 ; i++)
+	{
+		ok &= (dynamic_cast<HintB*>(d_as_a) == static_cast<HintB*>(&d));
+	}
+	unsigned long long later_hits, later_misses;
+	pathscale::dynamic_cast_cache_stats(&later_hits, &later_misses);
+	TEST(ok, "Repeated cross casts");
+	TEST(later_hits - hits >= 99, "Repeated casts hit the dynamic cast cache");
+	TEST(later_misses - misses <= 1, "Only the first cast misses the dynamic cast cache");
+}
+#endif
+
 void test_type_info(void)
 {
 	Sub2 sub2;
@@ -108,5 +195,11 @@ void test_type_info(void)
 	TEST(0 == dynamic_cast<Diamond*>(&root), "Downcasting root to diamond");
 
 	TEST(0 == dynamic_cast<Sub1*>(b2), "Casting Root to Sub1 (0 expected)");
+
+	test_dynamic_cast_hints();
+	test_repeated_dynamic_casts();
+#if defined(TEST_LIBCXXRT_EXTENSIONS) && defined(LIBCXXRT_DYNAMIC_CAST_CACHE)
+	test_dynamic_cast_cache_stats();
+#endif
 }
 
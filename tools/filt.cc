@@ -0,0 +1,387 @@
+/**
+ * filt.cc - A c++filt replacement built on pathscale::demangle_batch().
+ *
+ * With symbol arguments, prints each one demangled on its own line.  Without,
+ * copies standard input to standard output, replacing every word that is a
+ * mangled C++ name with its demangling.  As with c++filt, a word is a run of
+ * letters, digits, underscores, dots and dollar signs, and words that can't
+ * be demangled are copied unchanged.
+ *
+ * Input is read in large blocks, cut at the last newline, and every name in a
+ * block is demangled by one call to demangle_batch(), so large symbol dumps
+ * are demangled in parallel.  -j sets the number of threads; the default, 0,
+ * uses one per online processor.
+ *
+ * With -s, each argument or input line is a single symbol, which is printed
+ * demangled and followed by one line for each part that
+ * pathscale::demangle_structured() reports, giving its kind and text.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "cxxabi.h"
+
+namespace
+{
+	/**
+	 * The amount of input read at a time.  A block is extended if it does
+	 * not contain a newline.
+	 */
+	constexpr size_t block_size = 1 << 20;
+
+	/**
+	 * A mangled name found in the input.
+	 */
+	struct word
+	{
+		/**
+		 * The offset of the first character in the block.
+		 */
+		size_t start;
+		/**
+		 * The number of characters.
+		 */
+		size_t length;
+		/**
+		 * The character after the name, which is replaced by a NUL while the
+		 * name is being demangled.
+		 */
+		char terminator;
+	};
+
+	/**
+	 * Reusable storage for demangling blocks.
+	 */
+	struct filter
+	{
+		/**
+		 * The number of threads passed to demangle_batch().
+		 */
+		unsigned threads;
+		/**
+		 * The words found in the current block.
+		 */
+		word *words;
+		/**
+		 * The NUL-terminated names of the words, pointing into the block.
+		 */
+		const char **names;
+		/**
+		 * The offset of each demangled name in results.
+		 */
+		size_t *offsets;
+		/**
+		 * The number of words that words, names and offsets have space for.
+		 */
+		size_t capacity;
+		/**
+		 * The demangled names.
+		 */
+		char *results;
+		/**
+		 * The allocated size of results.
+		 */
+		size_t results_size;
+	};
+
+	/**
+	 * The names that -s prints for each demangle_token_kind.
+	 */
+	const char *const token_kinds[] =
+	{
+		"special",
+		"return-type",
+		"scope",
+		"name",
+		"template-args",
+		"parameter",
+		"qualifiers"
+	};
+
+	[[noreturn]] void out_of_memory()
+	{
+		fputs("cxxrt-filt: out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	/**
+	 * Returns whether c can be part of a symbol name.
+	 */
+	bool is_symbol_char(char c)
+	{
+		return ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) ||
+		       ((c >= '0') && (c <= '9')) || (c == '_') || (c == '.') ||
+		       (c == '$');
+	}
+
+	/**
+	 * Makes room for at least count words.
+	 */
+	void reserve(filter &f, size_t count)
+	{
+		if (count <= f.capacity)
+		{
+			return;
+		}
+		size_t capacity = f.capacity ? f.capacity : 1024;
+		while (capacity < count)
+		{
+			capacity *= 2;
+		}
+		word *words = static_cast<word*>(realloc(f.words, capacity * sizeof(word)));
+		if (nullptr == words)
+		{
+			out_of_memory();
+		}
+		f.words = words;
+		const char **names = static_cast<const char**>(
+		    realloc(f.names, capacity * sizeof(const char*)));
+		if (nullptr == names)
+		{
+			out_of_memory();
+		}
+		f.names = names;
+		size_t *offsets = static_cast<size_t*>(
+		    realloc(f.offsets, capacity * sizeof(size_t)));
+		if (nullptr == offsets)
+		{
+			out_of_memory();
+		}
+		f.offsets = offsets;
+		f.capacity = capacity;
+	}
+
+	/**
+	 * Demangles f.names[0, count).
+	 */
+	void demangle(filter &f, size_t count)
+	{
+		if (0 != pathscale::demangle_batch(f.names, count, &f.results,
+		                                   &f.results_size, f.offsets, f.threads))
+		{
+			out_of_memory();
+		}
+	}
+
+	/**
+	 * Writes length bytes of block to standard output, replacing mangled
+	 * names with their demangling.
+	 */
+	void filter_block(filter &f, char *block, size_t length)
+	{
+		size_t count = 0;
+		for (size_t i=0 ; i<length ; )
+		{
+			if (!is_symbol_char(block[i]))
+			{
+				i++;
+				continue;
+			}
+			size_t start = i;
+			while ((i < length) && is_symbol_char(block[i]))
+			{
+				i++;
+			}
+			if ((i - start > 2) && (block[start] == '_') && (block[start+1] == 'Z'))
+			{
+				reserve(f, count + 1);
+				f.words[count++] = { start, i - start, 0 };
+			}
+		}
+		// The block is followed by at least one spare byte, so the last word
+		// can always be terminated.
+		for (size_t i=0 ; i<count ; i++)
+		{
+			word &w = f.words[i];
+			w.terminator = block[w.start + w.length];
+			block[w.start + w.length] = 0;
+			f.names[i] = block + w.start;
+		}
+		demangle(f, count);
+		size_t written = 0;
+		for (size_t i=0 ; i<count ; i++)
+		{
+			word &w = f.words[i];
+			block[w.start + w.length] = w.terminator;
+			if (f.offsets[i] == pathscale::demangle_failed)
+			{
+				continue;
+			}
+			fwrite(block + written, 1, w.start - written, stdout);
+			fputs(f.results + f.offsets[i], stdout);
+			written = w.start + w.length;
+		}
+		fwrite(block + written, 1, length - written, stdout);
+	}
+
+	/**
+	 * Prints name demangled, then its parts, one per line.  Names that can't
+	 * be demangled are printed unchanged.
+	 */
+	void print_structured(const char *name)
+	{
+		pathscale::demangled_symbol *d = nullptr;
+		if (0 == strncmp(name, "_Z", 2))
+		{
+			d = pathscale::demangle_structured(name, nullptr);
+		}
+		if (nullptr == d)
+		{
+			puts(name);
+			return;
+		}
+		puts(d->text);
+		for (size_t i=0 ; i<d->token_count ; i++)
+		{
+			const pathscale::demangle_token &t = d->tokens[i];
+			printf("\t%s\t%.*s\n", token_kinds[t.kind],
+			       static_cast<int>(t.length), d->text + t.offset);
+		}
+		free(d);
+	}
+
+	/**
+	 * Prints each line of standard input with print_structured().
+	 */
+	void structured_stream()
+	{
+		char *line = nullptr;
+		size_t size = 0;
+		ssize_t length;
+		while ((length = getline(&line, &size, stdin)) >= 0)
+		{
+			if ((length > 0) && (line[length - 1] == '\n'))
+			{
+				line[length - 1] = 0;
+			}
+			print_structured(line);
+		}
+		free(line);
+	}
+
+	/**
+	 * Filters standard input to standard output.
+	 */
+	void filter_stream(filter &f)
+	{
+		size_t size = block_size + 1;
+		char *block = static_cast<char*>(malloc(size));
+		if (nullptr == block)
+		{
+			out_of_memory();
+		}
+		size_t used = 0;
+		for (;;)
+		{
+			if (size - used < block_size / 2 + 1)
+			{
+				size *= 2;
+				char *grown = static_cast<char*>(realloc(block, size));
+				if (nullptr == grown)
+				{
+					out_of_memory();
+				}
+				block = grown;
+			}
+			size_t read = fread(block + used, 1, size - used - 1, stdin);
+			used += read;
+			if (0 == read)
+			{
+				break;
+			}
+			// Only filter complete lines, so that no name is split between
+			// blocks.
+			size_t end = used;
+			while ((end > 0) && (block[end - 1] != '\n'))
+			{
+				end--;
+			}
+			if (0 == end)
+			{
+				continue;
+			}
+			filter_block(f, block, end);
+			memmove(block, block + end, used - end);
+			used -= end;
+		}
+		filter_block(f, block, used);
+		free(block);
+	}
+
+	[[noreturn]] void usage()
+	{
+		fputs("usage: cxxrt-filt [-j threads] [-s] [symbol ...]\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	filter f = { 0, nullptr, nullptr, nullptr, 0, nullptr, 0 };
+	bool structured = false;
+	int arg = 1;
+	while ((arg < argc) && (argv[arg][0] == '-'))
+	{
+		if (0 == strcmp(argv[arg], "--"))
+		{
+			arg++;
+			break;
+		}
+		if (0 == strcmp(argv[arg], "-s"))
+		{
+			structured = true;
+			arg++;
+			continue;
+		}
+		if ((0 != strcmp(argv[arg], "-j")) || (arg + 1 >= argc))
+		{
+			usage();
+		}
+		char *end;
+		f.threads = static_cast<unsigned>(strtoul(argv[arg+1], &end, 10));
+		if ((end == argv[arg+1]) || (*end != 0))
+		{
+			usage();
+		}
+		arg += 2;
+	}
+	static char out[1 << 16];
+	setvbuf(stdout, out, _IOFBF, sizeof(out));
+	if (structured)
+	{
+		if (arg == argc)
+		{
+			structured_stream();
+		}
+		for (int i=arg ; i<argc ; i++)
+		{
+			print_structured(argv[i]);
+		}
+	}
+	else if (arg == argc)
+	{
+		filter_stream(f);
+	}
+	else
+	{
+		size_t count = static_cast<size_t>(argc - arg);
+		reserve(f, count);
+		for (size_t i=0 ; i<count ; i++)
+		{
+			f.names[i] = argv[arg + i];
+		}
+		demangle(f, count);
+		for (size_t i=0 ; i<count ; i++)
+		{
+			bool failed = (f.offsets[i] == pathscale::demangle_failed) ||
+			              (0 != strncmp(f.names[i], "_Z", 2));
+			puts(failed ? f.names[i] : f.results + f.offsets[i]);
+		}
+	}
+	free(f.words);
+	free(f.names);
+	free(f.offsets);
+	free(f.results);
+	return (0 == fflush(stdout)) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,7 @@
+filt=$1
+input=$2
+expected_output=$3
+test_log=$4
+shift 4
+$filt "$@" < $input > $test_log 2>&1
+diff $test_log $expected_output
@@ -0,0 +1,8 @@
+symindex=$1
+elf_file=$2
+output=$3
+$symindex -j 4 $elf_file $output.idx || exit 1
+$symindex -d $output.idx > $output.txt || exit 1
+# Addresses are fixed-width hex, so sorted by address means sorted as text.
+LC_ALL=C sort -c -s -k1,1 $output.txt || exit 1
+grep -q ' pathscale::demangle_batch(char const\* const\*, ' $output.txt
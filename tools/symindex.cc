@@ -0,0 +1,460 @@
+/**
+ * symindex.cc - Builds a sorted address to name index from an ELF file.
+ *
+ * The ELF file is mapped and its symbol table (.symtab, or .dynsym if it has
+ * been stripped) and the associated string table are read in place.  Every
+ * defined function and object symbol is recorded, with C++ names demangled by
+ * a single call to pathscale::demangle_batch(), which is given pointers
+ * straight into the mapped string table.
+ *
+ * The index is written in the byte order of the host:
+ *
+ *  - An index_header.
+ *  - header.count index_entry records, sorted by address.  Symbols at the same
+ *    address are in symbol table order.
+ *  - header.strings_size bytes of NUL-terminated names, which the entries
+ *    refer to by offset.
+ *
+ * `cxxrt-symindex -d index` prints an index as text, one symbol per line.
+ */
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cxxabi.h"
+
+namespace
+{
+	/**
+	 * The start of an index file.
+	 */
+	struct index_header
+	{
+		/**
+		 * index_magic.
+		 */
+		char magic[8];
+		/**
+		 * index_version.
+		 */
+		uint32_t version;
+		/**
+		 * The number of entries.
+		 */
+		uint32_t count;
+		/**
+		 * The size of the names that follow the entries.
+		 */
+		uint64_t strings_size;
+	};
+
+	/**
+	 * A symbol in an index file.
+	 */
+	struct index_entry
+	{
+		/**
+		 * The address of the symbol.
+		 */
+		uint64_t address;
+		/**
+		 * The size of the symbol, clamped to UINT32_MAX.
+		 */
+		uint32_t size;
+		/**
+		 * The offset of the symbol's name from the start of the names.
+		 */
+		uint32_t name;
+	};
+
+	const char index_magic[8] = { 'c', 'x', 'x', 'r', 't', 's', 'y', 'm' };
+
+	constexpr uint32_t index_version = 1;
+
+	/**
+	 * A symbol read from the ELF file.
+	 */
+	struct symbol
+	{
+		uint64_t address;
+		uint64_t size;
+		/**
+		 * The name, in the mapped string table or in the demangled names.
+		 */
+		const char *name;
+		/**
+		 * The position of the symbol in the symbol table, used to keep
+		 * symbols at the same address in order.
+		 */
+		size_t order;
+	};
+
+	/**
+	 * A read-only mapping of a whole file.
+	 */
+	struct mapping
+	{
+		const unsigned char *data;
+		size_t size;
+	};
+
+	const char *program = "cxxrt-symindex";
+
+	[[noreturn]] void fail(const char *path, const char *message)
+	{
+		fprintf(stderr, "%s: %s: %s\n", program, path, message);
+		exit(EXIT_FAILURE);
+	}
+
+	/**
+	 * Maps the file at path, exiting on failure.
+	 */
+	mapping map_file(const char *path)
+	{
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+		{
+			fail(path, strerror(errno));
+		}
+		struct stat st;
+		if (0 != fstat(fd, &st))
+		{
+			fail(path, strerror(errno));
+		}
+		mapping m = { nullptr, static_cast<size_t>(st.st_size) };
+		if (m.size > 0)
+		{
+			void *p = mmap(nullptr, m.size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (MAP_FAILED == p)
+			{
+				fail(path, strerror(errno));
+			}
+			m.data = static_cast<const unsigned char*>(p);
+		}
+		close(fd);
+		return m;
+	}
+
+	/**
+	 * Returns whether [offset, offset + size) lies within the mapping.
+	 */
+	bool in_bounds(const mapping &m, uint64_t offset, uint64_t size)
+	{
+		return (offset <= m.size) && (size <= m.size - offset);
+	}
+
+	/**
+	 * Orders symbols by address, then by position in the symbol table.
+	 */
+	int compare_symbols(const void *a, const void *b)
+	{
+		const symbol *x = static_cast<const symbol*>(a);
+		const symbol *y = static_cast<const symbol*>(b);
+		if (x->address != y->address)
+		{
+			return (x->address < y->address) ? -1 : 1;
+		}
+		return (x->order < y->order) ? -1 : (x->order > y->order);
+	}
+
+	/**
+	 * The types used to read ELF files of one class.
+	 */
+	struct elf32
+	{
+		typedef Elf32_Ehdr ehdr;
+		typedef Elf32_Shdr shdr;
+		typedef Elf32_Sym sym;
+	};
+
+	struct elf64
+	{
+		typedef Elf64_Ehdr ehdr;
+		typedef Elf64_Shdr shdr;
+		typedef Elf64_Sym sym;
+	};
+
+	/**
+	 * Reads the defined function and object symbols from the ELF file mapped
+	 * at m.  Returns a malloc()ed array and sets *count to its length.
+	 */
+	template<typename Elf>
+	symbol *read_symbols(const char *path, const mapping &m, size_t *count)
+	{
+		const typename Elf::ehdr *ehdr =
+			reinterpret_cast<const typename Elf::ehdr*>(m.data);
+		if (!in_bounds(m, 0, sizeof(*ehdr)) ||
+		    (ehdr->e_shentsize != sizeof(typename Elf::shdr)) ||
+		    !in_bounds(m, ehdr->e_shoff,
+		               uint64_t(ehdr->e_shnum) * sizeof(typename Elf::shdr)))
+		{
+			fail(path, "invalid section headers");
+		}
+		const typename Elf::shdr *sections =
+			reinterpret_cast<const typename Elf::shdr*>(m.data + ehdr->e_shoff);
+		// Prefer the full symbol table, falling back to the dynamic symbols
+		// in stripped files.
+		const typename Elf::shdr *symtab = nullptr;
+		for (unsigned i=0 ; i<ehdr->e_shnum ; i++)
+		{
+			if (sections[i].sh_type == SHT_SYMTAB)
+			{
+				symtab = &sections[i];
+				break;
+			}
+			if ((sections[i].sh_type == SHT_DYNSYM) && (nullptr == symtab))
+			{
+				symtab = &sections[i];
+			}
+		}
+		*count = 0;
+		if (nullptr == symtab)
+		{
+			return nullptr;
+		}
+		if ((symtab->sh_entsize != sizeof(typename Elf::sym)) ||
+		    !in_bounds(m, symtab->sh_offset, symtab->sh_size) ||
+		    (symtab->sh_link >= ehdr->e_shnum))
+		{
+			fail(path, "invalid symbol table");
+		}
+		const typename Elf::shdr *strtab = &sections[symtab->sh_link];
+		// Names are used in place, so the string table must end with a NUL.
+		if (!in_bounds(m, strtab->sh_offset, strtab->sh_size) ||
+		    (0 == strtab->sh_size) ||
+		    (0 != m.data[strtab->sh_offset + strtab->sh_size - 1]))
+		{
+			fail(path, "invalid string table");
+		}
+		const char *strings =
+			reinterpret_cast<const char*>(m.data + strtab->sh_offset);
+		const typename Elf::sym *syms =
+			reinterpret_cast<const typename Elf::sym*>(m.data + symtab->sh_offset);
+		size_t sym_count = symtab->sh_size / sizeof(typename Elf::sym);
+
+		symbol *symbols = static_cast<symbol*>(malloc((sym_count + 1) * sizeof(symbol)));
+		if (nullptr == symbols)
+		{
+			fail(path, "out of memory");
+		}
+		for (size_t i=0 ; i<sym_count ; i++)
+		{
+			const typename Elf::sym &s = syms[i];
+			unsigned type = ELF64_ST_TYPE(s.st_info);
+			if (((type != STT_FUNC) && (type != STT_OBJECT) &&
+			     (type != STT_GNU_IFUNC)) ||
+			    (s.st_shndx == SHN_UNDEF) || (s.st_shndx == SHN_ABS) ||
+			    (s.st_name == 0) || (s.st_name >= strtab->sh_size))
+			{
+				continue;
+			}
+			symbols[(*count)++] = { s.st_value, s.st_size, strings + s.st_name, i };
+		}
+		return symbols;
+	}
+
+	/**
+	 * Replaces the names of C++ symbols with their demangling, which is
+	 * stored in a malloc()ed buffer that is returned.
+	 */
+	char *demangle_symbols(symbol *symbols, size_t count, unsigned threads)
+	{
+		const char **names = static_cast<const char**>(malloc((count + 1) * sizeof(char*)));
+		size_t *indexes = static_cast<size_t*>(malloc((count + 1) * sizeof(size_t)));
+		size_t *offsets = static_cast<size_t*>(malloc((count + 1) * sizeof(size_t)));
+		if ((nullptr == names) || (nullptr == indexes) || (nullptr == offsets))
+		{
+			fail("demangling", "out of memory");
+		}
+		size_t mangled = 0;
+		for (size_t i=0 ; i<count ; i++)
+		{
+			if (0 == strncmp(symbols[i].name, "_Z", 2))
+			{
+				indexes[mangled] = i;
+				names[mangled++] = symbols[i].name;
+			}
+		}
+		char *buffer = nullptr;
+		size_t size = 0;
+		if (0 != pathscale::demangle_batch(names, mangled, &buffer, &size,
+		                                   offsets, threads))
+		{
+			fail("demangling", "out of memory");
+		}
+		for (size_t i=0 ; i<mangled ; i++)
+		{
+			if (offsets[i] != pathscale::demangle_failed)
+			{
+				symbols[indexes[i]].name = buffer + offsets[i];
+			}
+		}
+		free(names);
+		free(indexes);
+		free(offsets);
+		return buffer;
+	}
+
+	/**
+	 * Writes count sorted symbols to an index file at path.
+	 */
+	void write_index(const char *path, const symbol *symbols, size_t count)
+	{
+		if (count > UINT32_MAX)
+		{
+			fail(path, "too many symbols");
+		}
+		index_header header;
+		memcpy(header.magic, index_magic, sizeof(index_magic));
+		header.version = index_version;
+		header.count = static_cast<uint32_t>(count);
+		header.strings_size = 0;
+		index_entry *entries = static_cast<index_entry*>(malloc((count + 1) * sizeof(index_entry)));
+		if (nullptr == entries)
+		{
+			fail(path, "out of memory");
+		}
+		for (size_t i=0 ; i<count ; i++)
+		{
+			if (header.strings_size > UINT32_MAX)
+			{
+				fail(path, "names too large for the index format");
+			}
+			entries[i].address = symbols[i].address;
+			entries[i].size = (symbols[i].size > UINT32_MAX) ?
+				UINT32_MAX : static_cast<uint32_t>(symbols[i].size);
+			entries[i].name = static_cast<uint32_t>(header.strings_size);
+			header.strings_size += strlen(symbols[i].name) + 1;
+		}
+		FILE *f = fopen(path, "wb");
+		if (nullptr == f)
+		{
+			fail(path, strerror(errno));
+		}
+		bool ok = (fwrite(&header, sizeof(header), 1, f) == 1) &&
+		          (fwrite(entries, sizeof(index_entry), count, f) == count);
+		for (size_t i=0 ; ok && (i<count) ; i++)
+		{
+			ok = (fputs(symbols[i].name, f) >= 0) && (fputc(0, f) != EOF);
+		}
+		if ((0 != fclose(f)) || !ok)
+		{
+			fail(path, "write failed");
+		}
+		free(entries);
+	}
+
+	/**
+	 * Prints the index file at path as text.
+	 */
+	void dump_index(const char *path)
+	{
+		mapping m = map_file(path);
+		const index_header *header = reinterpret_cast<const index_header*>(m.data);
+		if (!in_bounds(m, 0, sizeof(index_header)) ||
+		    (0 != memcmp(header->magic, index_magic, sizeof(index_magic))) ||
+		    (header->version != index_version))
+		{
+			fail(path, "not a symbol index");
+		}
+		uint64_t entries_size = uint64_t(header->count) * sizeof(index_entry);
+		if (!in_bounds(m, sizeof(index_header), entries_size) ||
+		    !in_bounds(m, sizeof(index_header) + entries_size, header->strings_size) ||
+		    ((header->strings_size > 0) &&
+		     (0 != m.data[sizeof(index_header) + entries_size + header->strings_size - 1])))
+		{
+			fail(path, "truncated symbol index");
+		}
+		const index_entry *entries =
+			reinterpret_cast<const index_entry*>(m.data + sizeof(index_header));
+		const char *strings =
+			reinterpret_cast<const char*>(m.data + sizeof(index_header) + entries_size);
+		for (uint32_t i=0 ; i<header->count ; i++)
+		{
+			if (entries[i].name >= header->strings_size)
+			{
+				fail(path, "invalid name offset");
+			}
+			printf("%016llx %8x %s\n",
+			       static_cast<unsigned long long>(entries[i].address),
+			       entries[i].size, strings + entries[i].name);
+		}
+		munmap(const_cast<unsigned char*>(m.data), m.size);
+	}
+
+	[[noreturn]] void usage()
+	{
+		fprintf(stderr, "usage: %s [-j threads] elf-file index-file\n"
+		                "       %s -d index-file\n", program, program);
+		exit(EXIT_FAILURE);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned threads = 0;
+	int arg = 1;
+	if ((argc == 3) && (0 == strcmp(argv[1], "-d")))
+	{
+		static char out[1 << 16];
+		setvbuf(stdout, out, _IOFBF, sizeof(out));
+		dump_index(argv[2]);
+		return (0 == fflush(stdout)) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	if ((argc > 2) && (0 == strcmp(argv[1], "-j")))
+	{
+		char *end;
+		threads = static_cast<unsigned>(strtoul(argv[2], &end, 10));
+		if ((end == argv[2]) || (*end != 0))
+		{
+			usage();
+		}
+		arg = 3;
+	}
+	if (argc - arg != 2)
+	{
+		usage();
+	}
+	const char *elf_path = argv[arg];
+	mapping m = map_file(elf_path);
+	if (!in_bounds(m, 0, EI_NIDENT) ||
+	    (0 != memcmp(m.data, ELFMAG, SELFMAG)))
+	{
+		fail(elf_path, "not an ELF file");
+	}
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	const unsigned char host_data = ELFDATA2LSB;
+#else
+	const unsigned char host_data = ELFDATA2MSB;
+#endif
+	if (m.data[EI_DATA] != host_data)
+	{
+		fail(elf_path, "byte order differs from the host");
+	}
+	size_t count;
+	symbol *symbols;
+	switch (m.data[EI_CLASS])
+	{
+		case ELFCLASS32:
+			symbols = read_symbols<elf32>(elf_path, m, &count);
+			break;
+		case ELFCLASS64:
+			symbols = read_symbols<elf64>(elf_path, m, &count);
+			break;
+		default:
+			fail(elf_path, "unknown ELF class");
+	}
+	char *names = demangle_symbols(symbols, count, threads);
+	qsort(symbols, count, sizeof(symbol), compare_symbols);
+	write_index(argv[arg + 1], symbols, count);
+	free(names);
+	free(symbols);
+	munmap(const_cast<unsigned char*>(m.data), m.size);
+	return EXIT_SUCCESS;
+}